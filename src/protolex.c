@@ -1,10 +1,17 @@
+#define _DEFAULT_SOURCE /* realpath and MAP_ANONYMOUS under -std=c99 */
+
 #include <ctype.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "protolex_runtime.h"
 #include "runtime.h"
 
@@ -31,6 +38,26 @@ typedef enum {
     NODE_TABLE
 } NodeType;
 
+typedef enum {
+    BIN_ADD,
+    BIN_SUB,
+    BIN_MUL,
+    BIN_DIV,
+    BIN_EQ,
+    BIN_NE,
+    BIN_LT,
+    BIN_LE,
+    BIN_GT,
+    BIN_GE,
+    BIN_AND,
+    BIN_OR
+} BinaryOp;
+
+typedef enum {
+    UNARY_NOT,
+    UNARY_NEG
+} UnaryOp;
+
 typedef struct {
     Node **items;
     size_t count;
@@ -52,18 +79,20 @@ struct Node {
         Value literal;
         struct {
             char *name;
+            int depth; /* scope hops to the binding; -1 if unbound */
+            int slot;
         } var;
         struct {
             Node *target;
             Node *value;
         } assign;
         struct {
-            char *op;
+            BinaryOp op;
             Node *left;
             Node *right;
         } binary;
         struct {
-            char *op;
+            UnaryOp op;
             Node *expr;
         } unary;
         struct {
@@ -86,10 +115,12 @@ struct Node {
         struct {
             StrList params;
             Node *body;
+            int slots;
         } fn;
         struct {
             char *name;
             char *path;
+            int slot;
         } import_stmt;
         struct {
             Node *target;
@@ -113,6 +144,7 @@ struct Node {
         } table;
         struct {
             NodeList statements;
+            int slots; /* size of the scope the block opens; 0 opens none */
         } block;
     } as;
 };
@@ -223,8 +255,24 @@ void runtime_fatal(const char *msg) {
     exit(1);
 }
 
+static void heap_exhausted(void);
+
+/*
+ * Headroom released the first time malloc fails, so the allocation can
+ * still succeed and the VM can reach a safepoint to throw "out of memory"
+ * instead of aborting. Re-acquired at the next full collection.
+ */
+#define MALLOC_RESERVE_BYTES ((size_t)1 << 20)
+static void *g_malloc_reserve;
+
 void *xmalloc(size_t size) {
     void *p = malloc(size);
+    if (!p && g_malloc_reserve) {
+        free(g_malloc_reserve);
+        g_malloc_reserve = NULL;
+        heap_exhausted();
+        p = malloc(size);
+    }
     if (!p) {
         runtime_fatal("out of memory");
     }
@@ -238,6 +286,177 @@ static char *xstrndup(const char *s, size_t n) {
     return out;
 }
 
+/*
+ * Heap.
+ *
+ * Strings, boxed ints, tables, closures and heap envs are allocated behind
+ * a GcHeader. New objects go on the young list; objects that survive a
+ * collection are promoted to the old list. Interned strings, shapes,
+ * protos and native functions live for the whole run and are not tracked.
+ *
+ * g_heap.bytes counts tracked objects (strings hold their bytes inline) and map
+ * entries. Every GC_NURSERY_BYTES of allocation requests a collection at
+ * the VM's next safepoint: a minor one that only traces and sweeps young
+ * objects, or a major one over everything once the heap has doubled since
+ * the last major collection.
+ *
+ * Old objects that are written a young value are recorded in the
+ * remembered set by gc_barrier, so minor collections can treat them as
+ * roots instead of tracing the old generation.
+ *
+ * With --gc-pause-us, major collections run incrementally: each safepoint
+ * runs one slice of at most that budget, first marking and then sweeping
+ * the old generation. gc_barrier shades values stored into already-marked
+ * objects so the mutator cannot hide a live object behind the marker.
+ */
+
+typedef enum {
+    GC_STRING,
+    GC_BIGINT,
+    GC_TABLE,
+    GC_FUNCTION,
+    GC_ENV,
+    GC_ROPE,
+    GC_ENTRIES, /* map storage of tables; accounting only, never a header kind */
+    GC_KIND_COUNT
+} GcKind;
+
+typedef struct GcHeader {
+    struct GcHeader *next;
+    size_t size;
+    GcKind kind;
+    bool marked;
+    bool old;        /* survived a collection */
+    bool remembered; /* old and in the remembered set */
+} GcHeader;
+
+#define GC_NURSERY_BYTES ((size_t)1 << 20)
+#define GC_MIN_THRESHOLD ((size_t)4 << 20)
+
+typedef struct {
+    GcHeader *young;
+    GcHeader *old;
+    GcHeader *sweeping; /* old objects not yet swept by an incremental major */
+    GcHeader **remembered;
+    size_t remembered_count;
+    size_t remembered_cap;
+    size_t bytes;
+    size_t kind_bytes[GC_KIND_COUNT];
+    size_t peak;
+    size_t limit;     /* --max-heap; 0 for none */
+    bool exhausted;   /* malloc failed or bytes went over limit */
+    size_t allocated; /* since the last collection */
+    size_t next_major;
+    bool pending;
+    bool marking;         /* an incremental major collection is under way */
+    long pause_budget_us; /* --gc-pause-us; 0 marks major collections in one go */
+    bool stats;           /* --gc-stats */
+    size_t minor_collections;
+    size_t major_collections;
+    size_t slices;
+    size_t bytes_freed;
+    double pause_total_ms;
+    double pause_max_ms;
+    double last_slice_us;
+    double max_slice_us;
+} Heap;
+
+static Heap g_heap = {.next_major = GC_MIN_THRESHOLD};
+
+static void heap_account(GcKind kind, size_t bytes) {
+    g_heap.bytes += bytes;
+    g_heap.kind_bytes[kind] += bytes;
+    g_heap.allocated += bytes;
+    if (g_heap.bytes > g_heap.peak) {
+        g_heap.peak = g_heap.bytes;
+    }
+    if (g_heap.allocated > GC_NURSERY_BYTES) {
+        g_heap.pending = true;
+    }
+    if (g_heap.limit && g_heap.bytes > g_heap.limit) {
+        heap_exhausted();
+    }
+}
+
+static void heap_release(GcKind kind, size_t bytes) {
+    g_heap.bytes -= bytes;
+    g_heap.kind_bytes[kind] -= bytes;
+}
+
+/* Makes the next safepoint collect fully and throw if that is not enough. */
+static void heap_exhausted(void) {
+    g_heap.exhausted = true;
+    g_heap.pending = true;
+}
+
+/* True if bytes more would still be within --max-heap. */
+static bool heap_fits(size_t bytes) {
+    return !g_heap.limit || (g_heap.bytes <= g_heap.limit && bytes <= g_heap.limit - g_heap.bytes);
+}
+
+static void gc_link(GcHeader *h, GcKind kind, size_t size) {
+    h->next = g_heap.young;
+    h->size = size;
+    h->kind = kind;
+    h->marked = false;
+    h->old = false;
+    h->remembered = false;
+    g_heap.young = h;
+    heap_account(kind, size);
+}
+
+static void *gc_alloc(GcKind kind, size_t size) {
+    GcHeader *h = xmalloc(sizeof(GcHeader) + size);
+    gc_link(h, kind, size);
+    return h + 1;
+}
+
+static GcHeader *gc_header(void *obj) {
+    return (GcHeader *)obj - 1;
+}
+
+static void gc_mark_value(Value v);
+
+/* True if v points at a tracked object that has not been promoted yet. */
+static bool gc_is_young(Value v) {
+    if (!value_is_tagged(v)) {
+        return false;
+    }
+    switch (value_tag(v)) {
+    case VALUE_TAG_STRING:
+        return !as_string(v)->interned && !gc_header(as_string(v))->old;
+    case VALUE_TAG_BIGINT:
+    case VALUE_TAG_TABLE:
+    case VALUE_TAG_ROPE:
+        return !gc_header(value_pointer(v))->old;
+    case VALUE_TAG_FUNCTION:
+        return !as_function(v)->is_native && !gc_header(as_function(v))->old;
+    default:
+        return false;
+    }
+}
+
+/* Write barrier: call after storing v into the tracked object owner. */
+static void gc_barrier(void *owner, Value v) {
+    GcHeader *h = gc_header(owner);
+    if (g_heap.marking && h->marked) {
+        gc_mark_value(v);
+    }
+    if (!h->old || h->remembered || !gc_is_young(v)) {
+        return;
+    }
+    if (g_heap.remembered_count == g_heap.remembered_cap) {
+        size_t cap = g_heap.remembered_cap ? g_heap.remembered_cap * 2 : 64;
+        g_heap.remembered = realloc(g_heap.remembered, cap * sizeof(GcHeader *));
+        if (!g_heap.remembered) {
+            runtime_fatal("out of memory");
+        }
+        g_heap.remembered_cap = cap;
+    }
+    h->remembered = true;
+    g_heap.remembered[g_heap.remembered_count++] = h;
+}
+
 static uint32_t hash_bytes(const uint8_t *data, size_t len) {
     uint32_t hash = 2166136261u;
     for (size_t i = 0; i < len; i++) {
@@ -247,279 +466,842 @@ static uint32_t hash_bytes(const uint8_t *data, size_t len) {
     return hash;
 }
 
+String *string_new(size_t len) {
+    String *str = gc_alloc(GC_STRING, sizeof(String) + len + 1);
+    str->len = len;
+    str->interned = false;
+    return str;
+}
+
+static void gc_full(void);
+
+static String *string_oom(EvalResult *err) {
+    err->is_exception = true;
+    err->value = make_string_value("out of memory", 13);
+    return NULL;
+}
+
+String *string_try_new(size_t len, EvalResult *err) {
+    if (len > SIZE_MAX - sizeof(GcHeader) - sizeof(String) - 1) {
+        return string_oom(err);
+    }
+    size_t size = sizeof(String) + len + 1;
+    if (!heap_fits(size)) {
+        gc_full();
+        if (!heap_fits(size)) {
+            return string_oom(err);
+        }
+    }
+    GcHeader *h = malloc(sizeof(GcHeader) + size);
+    if (!h) {
+        return string_oom(err);
+    }
+    gc_link(h, GC_STRING, size);
+    String *str = (String *)(h + 1);
+    str->len = len;
+    str->interned = false;
+    return str;
+}
+
 static String *make_string(const char *s, size_t len) {
-    String *str = xmalloc(sizeof(String));
-    str->data = xstrndup(s, len);
+    String *str = string_new(len);
+    memcpy(str->data, s, len);
+    str->data[len] = '\0';
+    str->hash = hash_bytes((const uint8_t *)s, len);
+    return str;
+}
+
+/*
+ * Intern table: one canonical String per distinct byte sequence, used for
+ * identifiers, field names, literals and library keys. Interned strings are
+ * never freed, and two of them are equal exactly when they are the same
+ * pointer.
+ */
+typedef struct {
+    String **slots;
+    size_t capacity;
+    size_t count;
+} InternTable;
+
+static InternTable g_interns;
+
+static void intern_grow(void) {
+    size_t old_cap = g_interns.capacity;
+    String **old = g_interns.slots;
+    g_interns.capacity = old_cap ? old_cap * 2 : 256;
+    g_interns.slots = calloc(g_interns.capacity, sizeof(String *));
+    if (!g_interns.slots) {
+        runtime_fatal("out of memory");
+    }
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i]) {
+            size_t idx = old[i]->hash & (g_interns.capacity - 1);
+            while (g_interns.slots[idx]) {
+                idx = (idx + 1) & (g_interns.capacity - 1);
+            }
+            g_interns.slots[idx] = old[i];
+        }
+    }
+    free(old);
+}
+
+static String *intern_string(const char *s, size_t len) {
+    if ((g_interns.count + 1) * 2 > g_interns.capacity) {
+        intern_grow();
+    }
+    uint32_t hash = hash_bytes((const uint8_t *)s, len);
+    size_t idx = hash & (g_interns.capacity - 1);
+    while (g_interns.slots[idx]) {
+        String *cur = g_interns.slots[idx];
+        if (cur->hash == hash && cur->len == len && memcmp(cur->data, s, len) == 0) {
+            return cur;
+        }
+        idx = (idx + 1) & (g_interns.capacity - 1);
+    }
+    String *str = xmalloc(sizeof(String) + len + 1);
+    memcpy(str->data, s, len);
+    str->data[len] = '\0';
     str->len = len;
-    str->hash = hash_bytes((const uint8_t *)str->data, len);
+    str->hash = hash;
+    str->interned = true;
+    g_interns.slots[idx] = str;
+    g_interns.count++;
     return str;
 }
 
-Value make_int(int64_t v) {
+/* The interned copy of a string, or NULL if it has never been interned. */
+static String *intern_lookup(const char *s, size_t len, uint32_t hash) {
+    if (!g_interns.capacity) {
+        return NULL;
+    }
+    size_t idx = hash & (g_interns.capacity - 1);
+    while (g_interns.slots[idx]) {
+        String *cur = g_interns.slots[idx];
+        if (cur->hash == hash && cur->len == len && memcmp(cur->data, s, len) == 0) {
+            return cur;
+        }
+        idx = (idx + 1) & (g_interns.capacity - 1);
+    }
+    return NULL;
+}
+
+static Value value_from_bits(uint64_t bits) {
     Value val;
-    val.type = VAL_INT;
-    val.as.i = v;
+    val.bits = bits;
     return val;
 }
 
+/* Ints outside the 48-bit payload are boxed on the heap. */
+Value make_int(int64_t v) {
+    if (v >= -((int64_t)1 << 47) && v < ((int64_t)1 << 47)) {
+        return value_from_bits(VALUE_BITS(VALUE_TAG_INT, (uint64_t)v));
+    }
+    int64_t *box = gc_alloc(GC_BIGINT, sizeof(int64_t));
+    *box = v;
+    return value_from_bits(VALUE_BITS(VALUE_TAG_BIGINT, (uintptr_t)box));
+}
+
 Value make_float(double v) {
-    Value val;
-    val.type = VAL_FLOAT;
-    val.as.f = v;
-    return val;
+    uint64_t bits;
+    if (v != v) {
+        bits = 0x7FF8000000000000ull;
+    } else {
+        memcpy(&bits, &v, sizeof(bits));
+    }
+    return value_from_bits(bits);
 }
 
 Value make_bool(bool v) {
-    Value val;
-    val.type = VAL_BOOL;
-    val.as.b = v;
-    return val;
+    return value_from_bits(VALUE_SPECIAL_BITS(v ? VALUE_TRUE : VALUE_FALSE));
 }
 
 Value make_null(void) {
-    Value val;
-    val.type = VAL_NULL;
-    return val;
+    return value_from_bits(VALUE_SPECIAL_BITS(VALUE_NULL));
 }
 
 Value make_undefined(void) {
-    Value val;
-    val.type = VAL_UNDEFINED;
-    return val;
+    return value_from_bits(VALUE_SPECIAL_BITS(VALUE_UNDEFINED));
+}
+
+/* Env slots hold this until their first assignment, and table array holes
+ * hold it; it never escapes a slot. */
+static Value make_unbound(void) {
+    return value_from_bits(VALUE_SPECIAL_BITS(VALUE_UNBOUND));
+}
+
+static bool value_is_unbound(Value v) {
+    return v.bits == VALUE_SPECIAL_BITS(VALUE_UNBOUND);
+}
+
+/*
+ * The empty string and every one-byte string are interned on first use and
+ * shared from then on, so charAt, forEach and split never allocate them.
+ */
+static String *g_small_strings[257];
+
+static String *small_string(const char *s, size_t len) {
+    size_t idx = len ? (size_t)(uint8_t)s[0] + 1 : 0;
+    if (!g_small_strings[idx]) {
+        g_small_strings[idx] = intern_string(s, len);
+    }
+    return g_small_strings[idx];
 }
 
 Value make_string_value(const char *s, size_t len) {
-    Value val;
-    val.type = VAL_STRING;
-    val.as.str = make_string(s, len);
-    return val;
+    String *str = len <= 1 ? small_string(s, len) : make_string(s, len);
+    return value_from_bits(VALUE_BITS(VALUE_TAG_STRING, (uintptr_t)str));
+}
+
+Value string_seal(String *str) {
+    if (str->len <= 1) {
+        return make_string_value(str->data, str->len);
+    }
+    str->data[str->len] = '\0';
+    str->hash = hash_bytes((const uint8_t *)str->data, str->len);
+    return value_from_bits(VALUE_BITS(VALUE_TAG_STRING, (uintptr_t)str));
+}
+
+/*
+ * Ropes: `+` on strings links the operands under a Rope node instead of
+ * copying them, so building a long string piece by piece is linear. The
+ * bytes are produced by rope_flatten the first time anything reads them
+ * (as_string); the result is cached and the operands are dropped.
+ * Results shorter than ROPE_MIN_LEN are cheaper to copy right away.
+ */
+#define ROPE_MIN_LEN 64
+
+typedef struct Rope {
+    Value left;
+    Value right;
+    size_t len;
+    String *flat; /* set once flattened; left and right are null then */
+} Rope;
+
+static size_t string_value_len(Value v) {
+    if (value_tag(v) == VALUE_TAG_ROPE) {
+        return ((Rope *)value_pointer(v))->len;
+    }
+    return as_string(v)->len;
+}
+
+Value string_concat(Value a, Value b) {
+    size_t la = string_value_len(a);
+    size_t lb = string_value_len(b);
+    if (la == 0) {
+        return b;
+    }
+    if (lb == 0) {
+        return a;
+    }
+    if (la + lb < ROPE_MIN_LEN) {
+        String *out = string_new(la + lb);
+        memcpy(out->data, as_string(a)->data, la);
+        memcpy(out->data + la, as_string(b)->data, lb);
+        return string_seal(out);
+    }
+    Rope *rope = gc_alloc(GC_ROPE, sizeof(Rope));
+    rope->left = a;
+    rope->right = b;
+    rope->len = la + lb;
+    rope->flat = NULL;
+    return value_from_bits(VALUE_BITS(VALUE_TAG_ROPE, (uintptr_t)rope));
+}
+
+/* Copies the leaves left to right with an explicit stack; ropes can be very deep. */
+String *rope_flatten(Rope *rope) {
+    if (rope->flat) {
+        return rope->flat;
+    }
+    String *out = string_new(rope->len);
+    size_t cap = 64;
+    size_t count = 0;
+    Value *stack = xmalloc(cap * sizeof(Value));
+    stack[count++] = value_from_bits(VALUE_BITS(VALUE_TAG_ROPE, (uintptr_t)rope));
+    size_t pos = 0;
+    while (count > 0) {
+        Value v = stack[--count];
+        if (value_tag(v) == VALUE_TAG_ROPE && !((Rope *)value_pointer(v))->flat) {
+            if (count + 2 > cap) {
+                cap *= 2;
+                stack = realloc(stack, cap * sizeof(Value));
+                if (!stack) {
+                    runtime_fatal("out of memory");
+                }
+            }
+            stack[count++] = ((Rope *)value_pointer(v))->right;
+            stack[count++] = ((Rope *)value_pointer(v))->left;
+            continue;
+        }
+        String *leaf = as_string(v);
+        memcpy(out->data + pos, leaf->data, leaf->len);
+        pos += leaf->len;
+    }
+    free(stack);
+    Value flat = string_seal(out);
+    rope->flat = out;
+    rope->left = make_null();
+    rope->right = make_null();
+    gc_barrier(rope, flat);
+    return out;
+}
+
+Value make_interned_string(const char *s, size_t len) {
+    return value_from_bits(VALUE_BITS(VALUE_TAG_STRING, (uintptr_t)intern_string(s, len)));
 }
 
 Value make_table(Table *t) {
-    Value val;
-    val.type = VAL_TABLE;
-    val.as.table = t;
-    return val;
+    return value_from_bits(VALUE_BITS(VALUE_TAG_TABLE, (uintptr_t)t));
 }
 
 Value make_function(Function *fn) {
-    Value val;
-    val.type = VAL_FUNCTION;
-    val.as.fn = fn;
-    return val;
+    return value_from_bits(VALUE_BITS(VALUE_TAG_FUNCTION, (uintptr_t)fn));
 }
 
 static bool value_is_truthy(Value v) {
-    if (v.type == VAL_BOOL) {
-        return v.as.b;
-    }
-    if (v.type == VAL_NULL || v.type == VAL_UNDEFINED) {
-        return false;
-    }
-    return true;
+    return v.bits != VALUE_SPECIAL_BITS(VALUE_FALSE) && v.bits != VALUE_SPECIAL_BITS(VALUE_NULL) &&
+           v.bits != VALUE_SPECIAL_BITS(VALUE_UNDEFINED);
 }
 
 static bool value_equal(Value a, Value b) {
-    if (a.type != b.type) {
-        if ((a.type == VAL_INT && b.type == VAL_FLOAT) ||
-            (a.type == VAL_FLOAT && b.type == VAL_INT)) {
-            double av = (a.type == VAL_FLOAT) ? a.as.f : (double)a.as.i;
-            double bv = (b.type == VAL_FLOAT) ? b.as.f : (double)b.as.i;
+    if (a.bits == b.bits) {
+        return value_is_tagged(a) || as_float(a) == as_float(a);
+    }
+    ValueType ta = value_type(a);
+    ValueType tb = value_type(b);
+    if (ta != tb) {
+        if ((ta == VAL_INT && tb == VAL_FLOAT) || (ta == VAL_FLOAT && tb == VAL_INT)) {
+            double av = (ta == VAL_FLOAT) ? as_float(a) : (double)as_int(a);
+            double bv = (tb == VAL_FLOAT) ? as_float(b) : (double)as_int(b);
             return av == bv;
         }
         return false;
     }
-    switch (a.type) {
+    switch (ta) {
     case VAL_INT:
-        return a.as.i == b.as.i;
+        return as_int(a) == as_int(b);
     case VAL_FLOAT:
-        return a.as.f == b.as.f;
-    case VAL_BOOL:
-        return a.as.b == b.as.b;
-    case VAL_NULL:
-    case VAL_UNDEFINED:
-        return true;
-    case VAL_STRING:
-        if (a.as.str->len != b.as.str->len) {
+        return as_float(a) == as_float(b);
+    case VAL_STRING: {
+        String *sa = as_string(a);
+        String *sb = as_string(b);
+        if ((sa->interned && sb->interned) || sa->hash != sb->hash || sa->len != sb->len) {
             return false;
         }
-        return memcmp(a.as.str->data, b.as.str->data, a.as.str->len) == 0;
-    case VAL_TABLE:
-        return a.as.table == b.as.table;
-    case VAL_FUNCTION:
-        return a.as.fn == b.as.fn;
+        return memcmp(sa->data, sb->data, sa->len) == 0;
     }
-    return false;
+    default:
+        /* Everything else is equal exactly when the bits are. */
+        return false;
+    }
+}
+
+/* True if f is a whole number an int64 can hold; value_equal makes it equal to that int. */
+static bool float_is_int(double f, int64_t *out) {
+    if (!(f >= -9223372036854775808.0 && f < 9223372036854775808.0) || f != (double)(int64_t)f) {
+        return false;
+    }
+    *out = (int64_t)f;
+    return true;
 }
 
 static uint32_t value_hash(Value v) {
-    switch (v.type) {
+    int64_t i;
+    switch (value_type(v)) {
     case VAL_INT:
-        return (uint32_t)(v.as.i ^ (v.as.i >> 32));
-    case VAL_FLOAT: {
-        uint64_t bits;
-        memcpy(&bits, &v.as.f, sizeof(bits));
-        return (uint32_t)(bits ^ (bits >> 32));
-    }
+        i = as_int(v);
+        return (uint32_t)(i ^ (i >> 32));
+    case VAL_FLOAT:
+        if (float_is_int(as_float(v), &i)) {
+            return (uint32_t)(i ^ (i >> 32));
+        }
+        return (uint32_t)(v.bits ^ (v.bits >> 32));
     case VAL_BOOL:
-        return v.as.b ? 0x9e3779b1u : 0x85ebca6bu;
+        return as_bool(v) ? 0x9e3779b1u : 0x85ebca6bu;
     case VAL_NULL:
         return 0x27d4eb2du;
     case VAL_UNDEFINED:
         return 0x165667b1u;
     case VAL_STRING:
-        return v.as.str->hash;
+        return as_string(v)->hash;
     case VAL_TABLE:
-        return (uint32_t)(uintptr_t)v.as.table;
     case VAL_FUNCTION:
-        return (uint32_t)(uintptr_t)v.as.fn;
+        return (uint32_t)(uintptr_t)value_pointer(v);
     }
     return 0;
 }
 
 static bool value_is_number(Value v) {
-    return v.type == VAL_INT || v.type == VAL_FLOAT;
+    return value_type(v) == VAL_INT || value_type(v) == VAL_FLOAT;
 }
 
 static double value_as_double(Value v) {
-    return v.type == VAL_FLOAT ? v.as.f : (double)v.as.i;
+    return value_type(v) == VAL_FLOAT ? as_float(v) : (double)as_int(v);
+}
+
+/*
+ * Map probing. A key's hash picks a starting group (h1) and a 7-bit tag
+ * (h2) stored in the slot's control byte. Lookups compare all 16 control
+ * bytes of a group at once and only call value_equal on tag matches; a
+ * group with an empty slot ends the probe. Groups are visited in
+ * triangular order, which covers every group of a power-of-two table.
+ * Full plus deleted slots are kept under 7/8 so every probe terminates.
+ *
+ * Maps of at most MAP_SMALL slots skip all of that: a linear scan over a
+ * handful of keys is cheaper than hashing, and their full slots hold 0.
+ */
+#define MAP_GROUP 16
+#define MAP_SMALL 4
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+
+/* Bit i is set when ctrl byte i of the group equals b. */
+static inline uint32_t group_match(const uint8_t *group, uint8_t b) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)b)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < MAP_GROUP; i++) {
+        mask |= (uint32_t)(group[i] == b) << i;
+    }
+    return mask;
+#endif
+}
+
+/* Bit i is set when slot i of the group is empty or deleted. */
+static inline uint32_t group_match_free(const uint8_t *group) {
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < MAP_GROUP; i++) {
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+static inline unsigned lowest_bit(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_ctz(mask);
+#else
+    unsigned i = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+/* value_hash is close to the identity for ints; spread it over all bits. */
+static uint32_t map_hash(Value key) {
+    uint32_t h = value_hash(key);
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static bool map_slot_live(const Map *map, size_t i) {
+    return map->ctrl[i] < CTRL_EMPTY;
+}
+
+static size_t map_bytes(size_t capacity) {
+    return capacity * (2 * sizeof(Value) + 1);
+}
+
+static bool map_is_small(const Map *map) {
+    return map->capacity <= MAP_SMALL;
 }
 
-static void map_init(Map *map) {
-    map->capacity = 16;
+static void map_alloc(Map *map, size_t capacity) {
+    map->keys = capacity ? xmalloc(map_bytes(capacity)) : NULL;
+    heap_account(GC_ENTRIES, map_bytes(capacity));
+    map->values = map->keys + capacity;
+    map->ctrl = (uint8_t *)(map->values + capacity);
+    if (capacity) {
+        memset(map->ctrl, CTRL_EMPTY, capacity);
+    }
+    map->capacity = capacity;
     map->count = 0;
-    map->entries = calloc(map->capacity, sizeof(Entry));
-    if (!map->entries) {
-        runtime_fatal("out of memory");
+    map->tombstones = 0;
+    map->compact = false;
+}
+
+/* Smallest capacity that holds key_count keys. */
+static size_t map_capacity_for(size_t key_count) {
+    if (key_count <= MAP_SMALL) {
+        size_t capacity = 0;
+        while (capacity < key_count) {
+            capacity = capacity ? capacity * 2 : 1;
+        }
+        return capacity;
     }
+    size_t capacity = MAP_GROUP;
+    while (key_count * 8 > capacity * 7) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+static void map_init(Map *map, size_t key_count) {
+    map_alloc(map, map_capacity_for(key_count));
 }
 
 static void map_free(Map *map) {
-    free(map->entries);
-    map->entries = NULL;
+    heap_release(GC_ENTRIES, map_bytes(map->capacity));
+    free(map->keys);
+    map->keys = NULL;
+    map->values = NULL;
+    map->ctrl = NULL;
     map->capacity = 0;
     map->count = 0;
+    map->tombstones = 0;
+    map->compact = false;
 }
 
-static void map_resize(Map *map, size_t new_capacity) {
-    Entry *old = map->entries;
-    size_t old_cap = map->capacity;
+/* First empty or deleted slot on hash's probe sequence. */
+static size_t map_free_slot(const Map *map, uint32_t hash) {
+    if (map_is_small(map)) {
+        size_t idx = 0;
+        while (map_slot_live(map, idx)) {
+            idx++;
+        }
+        return idx;
+    }
+    size_t group_mask = map->capacity / MAP_GROUP - 1;
+    size_t g = (hash >> 7) & group_mask;
+    for (size_t step = 1;; step++) {
+        uint32_t free_slots = group_match_free(map->ctrl + g * MAP_GROUP);
+        if (free_slots) {
+            return g * MAP_GROUP + lowest_bit(free_slots);
+        }
+        g = (g + step) & group_mask;
+    }
+}
 
-    map->entries = calloc(new_capacity, sizeof(Entry));
-    if (!map->entries) {
-        runtime_fatal("out of memory");
+/* Stores a key known to be absent; the map must have a free slot. */
+static void map_place(Map *map, Value key, uint32_t hash, Value value) {
+    size_t idx = map_free_slot(map, hash);
+    if (map->ctrl[idx] == CTRL_DELETED) {
+        map->tombstones--;
     }
-    map->capacity = new_capacity;
-    map->count = 0;
+    map->ctrl[idx] = map_is_small(map) ? 0 : (uint8_t)(hash & 0x7F);
+    map->keys[idx] = key;
+    map->values[idx] = value;
+    map->count++;
+}
 
-    for (size_t i = 0; i < old_cap; i++) {
-        if (old[i].used && !old[i].tombstone) {
-            size_t idx = value_hash(old[i].key) % map->capacity;
-            while (map->entries[idx].used) {
-                idx = (idx + 1) % map->capacity;
+static void map_resize(Map *map, size_t new_capacity) {
+    Map old = *map;
+    map_alloc(map, new_capacity);
+    bool hashed = !map_is_small(map);
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (map_slot_live(&old, i)) {
+            map_place(map, old.keys[i], hashed ? map_hash(old.keys[i]) : 0, old.values[i]);
+        }
+    }
+    heap_release(GC_ENTRIES, map_bytes(old.capacity));
+    free(old.keys);
+}
+
+/* Returns the slot index holding key, or -1. */
+static size_t map_find_hashed(const Map *map, Value key, uint32_t hash) {
+    size_t group_mask = map->capacity / MAP_GROUP - 1;
+    size_t g = (hash >> 7) & group_mask;
+    uint8_t h2 = (uint8_t)(hash & 0x7F);
+    for (size_t step = 1;; step++) {
+        const uint8_t *group = map->ctrl + g * MAP_GROUP;
+        for (uint32_t m = group_match(group, h2); m; m &= m - 1) {
+            size_t idx = g * MAP_GROUP + lowest_bit(m);
+            if (map->keys[idx].bits == key.bits || value_equal(map->keys[idx], key)) {
+                return idx;
             }
-            map->entries[idx] = old[i];
-            map->count++;
         }
+        if (map->compact || group_match(group, CTRL_EMPTY)) {
+            return (size_t)-1;
+        }
+        g = (g + step) & group_mask;
     }
-    free(old);
 }
 
-static bool map_set(Map *map, Value key, Value value) {
-    if ((map->count + 1) * 100 / map->capacity > 70) {
-        map_resize(map, map->capacity * 2);
+static size_t map_find_small(const Map *map, Value key) {
+    for (size_t idx = 0; idx < map->capacity; idx++) {
+        if (map_slot_live(map, idx) &&
+            (map->keys[idx].bits == key.bits || value_equal(map->keys[idx], key))) {
+            return idx;
+        }
+    }
+    return (size_t)-1;
+}
+
+static size_t map_find(Map *map, Value key) {
+    if (map_is_small(map)) {
+        return map_find_small(map, key);
     }
-    size_t idx = value_hash(key) % map->capacity;
-    size_t first_tombstone = (size_t)-1;
+    return map_find_hashed(map, key, map_hash(key));
+}
 
-    while (map->entries[idx].used) {
-        if (!map->entries[idx].tombstone && value_equal(map->entries[idx].key, key)) {
-            map->entries[idx].value = value;
+static bool map_set(Map *map, Value key, Value value) {
+    if (map_is_small(map)) {
+        size_t idx = map_find_small(map, key);
+        if (idx != (size_t)-1) {
+            map->values[idx] = value;
             return false;
         }
-        if (map->entries[idx].tombstone && first_tombstone == (size_t)-1) {
-            first_tombstone = idx;
+        if (map->count == map->capacity) {
+            map_resize(map, map_capacity_for(map->count + 1));
         }
-        idx = (idx + 1) % map->capacity;
+        map_place(map, key, map_is_small(map) ? 0 : map_hash(key), value);
+        return true;
     }
-    size_t target = (first_tombstone != (size_t)-1) ? first_tombstone : idx;
-    map->entries[target].used = true;
-    map->entries[target].tombstone = false;
-    map->entries[target].key = key;
-    map->entries[target].value = value;
-    map->count++;
+    uint32_t hash = map_hash(key);
+    size_t idx = map_find_hashed(map, key, hash);
+    if (idx != (size_t)-1) {
+        map->values[idx] = value;
+        return false;
+    }
+    if ((map->count + map->tombstones + 1) * 8 > map->capacity * 7) {
+        /* Rehash in place when deleted slots, not live keys, fill the table. */
+        bool grow = (map->count + 1) * 16 > map->capacity * 7;
+        map_resize(map, grow ? map->capacity * 2 : map->capacity);
+    }
+    map_place(map, key, hash, value);
+    map->compact = false;
     return true;
 }
 
 static bool map_get(Map *map, Value key, Value *out) {
-    size_t idx = value_hash(key) % map->capacity;
-    while (map->entries[idx].used) {
-        if (!map->entries[idx].tombstone && value_equal(map->entries[idx].key, key)) {
-            *out = map->entries[idx].value;
-            return true;
-        }
-        idx = (idx + 1) % map->capacity;
+    size_t idx = map_find(map, key);
+    if (idx == (size_t)-1) {
+        return false;
     }
-    return false;
+    *out = map->values[idx];
+    return true;
 }
 
 static bool map_has(Map *map, Value key) {
-    Value out;
-    return map_get(map, key, &out);
+    return map_find(map, key) != (size_t)-1;
 }
 
-static bool map_delete(Map *map, Value key) {
-    size_t idx = value_hash(key) % map->capacity;
-    while (map->entries[idx].used) {
-        if (!map->entries[idx].tombstone && value_equal(map->entries[idx].key, key)) {
-            map->entries[idx].tombstone = true;
-            map->count--;
-            return true;
+/* True when every key sits in the group its probe sequence starts at. */
+static bool map_keys_at_home(const Map *map) {
+    size_t group_mask = map->capacity / MAP_GROUP - 1;
+    for (size_t i = 0; i < map->capacity; i++) {
+        if (map_slot_live(map, i) && ((map_hash(map->keys[i]) >> 7) & group_mask) != i / MAP_GROUP) {
+            return false;
         }
-        idx = (idx + 1) % map->capacity;
     }
-    return false;
-}
-
-Table *table_new(void) {
-    Table *t = xmalloc(sizeof(Table));
-    map_init(&t->map);
-    t->proto = NULL;
-    t->frozen = false;
-    t->thaw_count = 0;
-    return t;
+    return true;
 }
 
-static bool table_has_proto_cycle(Table *self, Table *candidate) {
-    for (Table *p = candidate; p != NULL; p = p->proto) {
-        if (p == self) {
-            return true;
+/*
+ * Re-lays out a map whose keys are about to stop changing, if at least half
+ * its slots are waste (tombstones, or capacity past the minimum for its
+ * keys); a right-sized map is left alone, so freezing it costs nothing. The
+ * new layout has no tombstones and, if the minimum capacity or twice it
+ * puts every key in its home group, uses that one. Lookups in such a
+ * compact map read a single group, hit or miss. Inserting a key turns the
+ * map back into an ordinary one.
+ */
+static void map_compact(Map *map) {
+    size_t base = map_capacity_for(map->count);
+    if (map->capacity < base || (map->capacity - base + map->tombstones) * 2 < map->capacity) {
+        return;
+    }
+    if (base <= MAP_SMALL) {
+        if (map->capacity != base) {
+            map_resize(map, base);
         }
+        return;
     }
-    return false;
+    for (size_t capacity = base; capacity <= base * 2; capacity *= 2) {
+        map_resize(map, capacity);
+        if (map_keys_at_home(map)) {
+            map->compact = true;
+            return;
+        }
+    }
+    map_resize(map, base);
 }
 
-static bool table_set_proto(Table *self, Value v) {
-    if (v.type == VAL_NULL) {
-        self->proto = NULL;
+/*
+ * A deleted slot only needs a tombstone if probes may have passed over its
+ * group, which cannot happen while the group still has an empty slot.
+ * When tombstones outnumber live keys the map is rehashed, and a map that
+ * has emptied down to an eighth of its slots shrinks, so probe chains stay
+ * short under delete-and-insert churn.
+ */
+static bool map_delete(Map *map, Value key) {
+    size_t idx = map_find(map, key);
+    if (idx == (size_t)-1) {
+        return false;
+    }
+    map->count--;
+    if (map_is_small(map)) {
+        map->ctrl[idx] = CTRL_EMPTY;
         return true;
     }
-    if (v.type != VAL_TABLE) {
-        return false;
+    if (group_match(map->ctrl + idx / MAP_GROUP * MAP_GROUP, CTRL_EMPTY)) {
+        map->ctrl[idx] = CTRL_EMPTY;
+    } else {
+        map->ctrl[idx] = CTRL_DELETED;
+        map->tombstones++;
     }
-    if (table_has_proto_cycle(self, v.as.table)) {
-        runtime_fatal("prototype cycle");
+    if (map->count * 8 < map->capacity) {
+        map_resize(map, map_capacity_for(map->count * 2));
+    } else if (map->tombstones > map->count && map->tombstones * 4 > map->capacity) {
+        map_resize(map, map->capacity);
     }
-    self->proto = v.as.table;
     return true;
 }
 
-static bool table_can_mutate(Table *t) {
-    return !t->frozen || t->thaw_count > 0;
-}
+/*
+ * Shapes.
+ *
+ * A shape names the set of string keys a table holds. Tables that gained
+ * the same string keys in the same order share a shape, found by following
+ * transitions from the empty root shape. Other key types never affect the
+ * shape, since a field lookup can only match a string key. Deleting a
+ * string key, or growing past SHAPE_MAX_KEYS, moves the table to the
+ * dictionary shape, which inline caches never trust.
+ */
+
+#define SHAPE_MAX_KEYS 64
+
+typedef struct Shape {
+    struct Shape *parent;
+    String *key; /* key added by the transition from parent */
+    int key_count;
+    bool dictionary;
+} Shape;
 
-void table_freeze(Table *t) {
-    t->frozen = true;
+typedef struct {
+    Shape *parent;
+    String *key;
+    Shape *child;
+} ShapeTransition;
+
+static struct {
+    ShapeTransition *slots;
+    size_t capacity;
+    size_t count;
+} g_transitions;
+
+static Shape g_root_shape = {NULL, NULL, 0, false};
+static Shape g_dictionary_shape = {NULL, NULL, 0, true};
+
+static size_t transition_hash(Shape *parent, String *key) {
+    return (size_t)(((uintptr_t)parent >> 4) * 31u) ^ key->hash;
+}
+
+static void transitions_grow(void) {
+    size_t old_cap = g_transitions.capacity;
+    ShapeTransition *old = g_transitions.slots;
+    g_transitions.capacity = old_cap ? old_cap * 2 : 256;
+    g_transitions.slots = calloc(g_transitions.capacity, sizeof(ShapeTransition));
+    if (!g_transitions.slots) {
+        runtime_fatal("out of memory");
+    }
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].child) {
+            size_t idx = transition_hash(old[i].parent, old[i].key) & (g_transitions.capacity - 1);
+            while (g_transitions.slots[idx].child) {
+                idx = (idx + 1) & (g_transitions.capacity - 1);
+            }
+            g_transitions.slots[idx] = old[i];
+        }
+    }
+    free(old);
+}
+
+/* Returns the shape of a table with shape parent after it gains key. */
+static Shape *shape_add(Shape *parent, String *key) {
+    if (parent->dictionary || parent->key_count >= SHAPE_MAX_KEYS) {
+        return &g_dictionary_shape;
+    }
+    if ((g_transitions.count + 1) * 2 > g_transitions.capacity) {
+        transitions_grow();
+    }
+    size_t idx = transition_hash(parent, key) & (g_transitions.capacity - 1);
+    while (g_transitions.slots[idx].child) {
+        ShapeTransition *tr = &g_transitions.slots[idx];
+        if (tr->parent == parent && tr->key == key) {
+            return tr->child;
+        }
+        idx = (idx + 1) & (g_transitions.capacity - 1);
+    }
+    Shape *child = xmalloc(sizeof(Shape));
+    child->parent = parent;
+    child->key = key;
+    child->key_count = parent->key_count + 1;
+    child->dictionary = false;
+    g_transitions.slots[idx].parent = parent;
+    g_transitions.slots[idx].key = key;
+    g_transitions.slots[idx].child = child;
+    g_transitions.count++;
+    return child;
+}
+
+/* Moves whenever a cached proto-chain lookup could have changed. */
+static uint64_t g_chain_version = 1;
+
+Table *table_new(void) {
+    return table_new_sized(0);
+}
+
+Table *table_new_sized(size_t key_count) {
+    Table *t = gc_alloc(GC_TABLE, sizeof(Table));
+    map_init(&t->map, key_count);
+    t->array = NULL;
+    t->array_len = 0;
+    t->array_cap = 0;
+    t->array_count = 0;
+    t->shape = &g_root_shape;
+    t->proto = NULL;
+    t->is_proto = false;
+    t->frozen = false;
+    t->thaw_epoch = 0;
+    return t;
+}
+
+static bool table_has_proto_cycle(Table *self, Table *candidate) {
+    for (Table *p = candidate; p != NULL; p = p->proto) {
+        if (p == self) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool table_set_proto(Table *self, Value v) {
+    if (self->is_proto) {
+        g_chain_version++;
+    }
+    if (value_type(v) == VAL_NULL) {
+        self->proto = NULL;
+        return true;
+    }
+    if (value_type(v) != VAL_TABLE) {
+        return false;
+    }
+    if (table_has_proto_cycle(self, as_table(v))) {
+        runtime_fatal("prototype cycle");
+    }
+    self->proto = as_table(v);
+    self->proto->is_proto = true;
+    gc_barrier(self, v);
+    return true;
+}
+
+void table_freeze(Table *t) {
+    if (!t->frozen) {
+        map_compact(&t->map);
+    }
+    t->frozen = true;
 }
 
 typedef struct {
@@ -544,12 +1326,61 @@ static Table *stack_pop(TableStack *stack) {
     return stack->items[--stack->count];
 }
 
-static void table_adjust_thaw(Table *root, int delta) {
+/*
+ * Thawing. Inside `mutate root { ... }` root and every table it reaches
+ * may be written even if frozen. Entering and leaving a block only pushes
+ * and pops a ThawScope with a fresh epoch. The first write to a frozen
+ * table checks the active scopes and, once per scope, walks the graph from
+ * its root, stamping every table reached with the scope's epoch. A stamp
+ * counts while its scope is on the stack. A walk keeps the stamp of an
+ * enclosing scope that is still active, but replaces the stamp of a scope
+ * nested inside its own: that scope ends first, and the walk will not run
+ * again. A walk must see the tables reachable when its block began, so a
+ * write that adds, replaces or removes a table-valued slot first runs the
+ * walks still pending.
+ */
+typedef struct {
+    Table *root;
+    uint64_t epoch;
+    bool walked;
+} ThawScope;
+
+static ThawScope *g_thaw;
+static size_t g_thaw_count;
+static size_t g_thaw_capacity;
+static uint64_t g_thaw_epoch;
+
+static void table_thaw_begin(Table *root) {
+    if (g_thaw_count == g_thaw_capacity) {
+        size_t cap = g_thaw_capacity ? g_thaw_capacity * 2 : 16;
+        g_thaw = realloc(g_thaw, cap * sizeof(ThawScope));
+        if (!g_thaw) {
+            runtime_fatal("out of memory");
+        }
+        g_thaw_capacity = cap;
+    }
+    g_thaw[g_thaw_count++] = (ThawScope){root, ++g_thaw_epoch, false};
+}
+
+static void table_thaw_end(void) {
+    g_thaw_count--;
+}
+
+static bool thaw_epoch_active(uint64_t epoch) {
+    for (size_t i = g_thaw_count; i-- > 0;) {
+        if (g_thaw[i].epoch == epoch) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void thaw_scope_walk(ThawScope *scope) {
     TableStack stack = {0};
     Map visited;
-    map_init(&visited);
+    map_init(&visited, 0);
 
-    stack_push(&stack, root);
+    stack_push(&stack, scope->root);
     while (stack.count > 0) {
         Table *t = stack_pop(&stack);
         Value key = make_table(t);
@@ -557,84 +1388,463 @@ static void table_adjust_thaw(Table *root, int delta) {
             continue;
         }
         map_set(&visited, key, make_bool(true));
-        t->thaw_count += delta;
+        /* Epochs grow inward, so a larger active one is a nested scope. */
+        if (t->thaw_epoch > scope->epoch || !thaw_epoch_active(t->thaw_epoch)) {
+            t->thaw_epoch = scope->epoch;
+        }
 
         for (size_t i = 0; i < t->map.capacity; i++) {
-            Entry *e = &t->map.entries[i];
-            if (e->used && !e->tombstone && e->value.type == VAL_TABLE) {
-                stack_push(&stack, e->value.as.table);
+            if (map_slot_live(&t->map, i) && value_type(t->map.values[i]) == VAL_TABLE) {
+                stack_push(&stack, as_table(t->map.values[i]));
+            }
+        }
+        for (size_t i = 0; i < t->array_len; i++) {
+            if (value_type(t->array[i]) == VAL_TABLE) {
+                stack_push(&stack, as_table(t->array[i]));
             }
         }
     }
 
     map_free(&visited);
     free(stack.items);
+    scope->walked = true;
+}
+
+static bool table_is_thawed(Table *t) {
+    if (thaw_epoch_active(t->thaw_epoch)) {
+        return true;
+    }
+    for (size_t i = g_thaw_count; i-- > 0;) {
+        if (!g_thaw[i].walked) {
+            thaw_scope_walk(&g_thaw[i]);
+            if (thaw_epoch_active(t->thaw_epoch)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool table_can_mutate(Table *t) {
+    return !t->frozen || table_is_thawed(t);
+}
+
+/* Walks every scope still pending, before a write changes what its root reaches. */
+static void thaw_walk_pending(void) {
+    for (size_t i = 0; i < g_thaw_count; i++) {
+        if (!g_thaw[i].walked) {
+            thaw_scope_walk(&g_thaw[i]);
+        }
+    }
+}
+
+static bool thaw_walk_is_pending(void) {
+    for (size_t i = g_thaw_count; i-- > 0;) {
+        if (!g_thaw[i].walked) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Array part. Appending key array_len grows the array and pulls any keys
+ * that now follow it out of the map, so an int key is never in both parts.
+ * Deleting inside the array leaves a hole holding the unbound marker;
+ * holes at the end are trimmed, and once fewer than half the slots are
+ * live the remaining keys move to the map, so deleting from the front
+ * (queues, sliding windows) cannot grow the array without bound. A whole
+ * float key means the same slot as the int it equals, and is stored as
+ * that int.
+ */
+#define ARRAY_SPILL_MIN 16
+
+static Value *table_array_slot(Table *t, Value key) {
+    int64_t i;
+    if (value_is_small_int(key)) {
+        i = as_int(key);
+    } else if (value_type(key) != VAL_FLOAT || !float_is_int(as_float(key), &i)) {
+        return NULL;
+    }
+    if (i >= 0 && (uint64_t)i < t->array_len) {
+        return &t->array[i];
+    }
+    return NULL;
+}
+
+static void table_array_resize(Table *t, size_t cap) {
+    Value *array = cap ? xmalloc(cap * sizeof(Value)) : NULL;
+    if (t->array_len) {
+        memcpy(array, t->array, t->array_len * sizeof(Value));
+    }
+    free(t->array);
+    heap_release(GC_ENTRIES, t->array_cap * sizeof(Value));
+    heap_account(GC_ENTRIES, cap * sizeof(Value));
+    t->array = array;
+    t->array_cap = cap;
+}
+
+static void table_array_append(Table *t, Value value) {
+    if (t->array_len == t->array_cap) {
+        table_array_resize(t, t->array_cap ? t->array_cap * 2 : 4);
+    }
+    t->array[t->array_len++] = value;
+    t->array_count++;
+    Value next;
+    while (t->map.count > 0 && map_get(&t->map, make_int((int64_t)t->array_len), &next)) {
+        map_delete(&t->map, make_int((int64_t)t->array_len));
+        if (t->array_len == t->array_cap) {
+            table_array_resize(t, t->array_cap * 2);
+        }
+        t->array[t->array_len++] = next;
+        t->array_count++;
+    }
+}
+
+/* Moves the live array slots into the map and drops the array. */
+static void table_array_spill(Table *t) {
+    for (size_t i = 0; i < t->array_len; i++) {
+        if (!value_is_unbound(t->array[i])) {
+            map_set(&t->map, make_int((int64_t)i), t->array[i]);
+        }
+    }
+    t->array_len = 0;
+    t->array_count = 0;
+    table_array_resize(t, 0);
+}
+
+static void table_array_delete(Table *t, Value *slot) {
+    if (value_is_unbound(*slot)) {
+        return;
+    }
+    *slot = make_unbound();
+    t->array_count--;
+    while (t->array_len > 0 && value_is_unbound(t->array[t->array_len - 1])) {
+        t->array_len--;
+    }
+    if (t->array_len >= ARRAY_SPILL_MIN && t->array_count * 2 < t->array_len) {
+        table_array_spill(t);
+    } else if (t->array_len < t->array_cap / 4) {
+        table_array_resize(t, t->array_len ? t->array_cap / 2 : 0);
+    }
+}
+
+/* The value t itself holds for key, ignoring its proto chain. */
+static Value table_get_local(Table *t, Value key) {
+    Value out;
+    Value *slot = table_array_slot(t, key);
+    if (slot) {
+        return value_is_unbound(*slot) ? make_undefined() : *slot;
+    }
+    return map_get(&t->map, key, &out) ? out : make_undefined();
+}
+
+/* Runs pending thaw walks if writing value over t[key] relinks a table. */
+static void thaw_before_write(Table *t, Value key, Value value) {
+    if (thaw_walk_is_pending() &&
+        (value_type(value) == VAL_TABLE || value_type(table_get_local(t, key)) == VAL_TABLE)) {
+        thaw_walk_pending();
+    }
 }
 
 bool table_set(Table *t, Value key, Value value) {
     if (!table_can_mutate(t)) {
         return false;
     }
-    map_set(&t->map, key, value);
+    thaw_before_write(t, key, value);
+    table_put(t, key, value);
     return true;
 }
 
+/*
+ * String keys are stored as their interned copy when there is one, so
+ * shapes and caches can match them by pointer, and whole float keys as
+ * the ints they equal. A string built at run time that was never interned
+ * is stored as it is and moves the table to the dictionary shape; interning
+ * it would keep the key, and a shape for it, alive for good.
+ */
+void table_put(Table *t, Value key, Value value) {
+    int64_t i;
+    if (value_type(key) == VAL_STRING && !as_string(key)->interned) {
+        String *str = as_string(key);
+        String *interned = intern_lookup(str->data, str->len, str->hash);
+        key = value_from_bits(VALUE_BITS(VALUE_TAG_STRING, (uintptr_t)(interned ? interned : str)));
+    } else if (value_type(key) == VAL_FLOAT && float_is_int(as_float(key), &i)) {
+        key = make_int(i);
+    }
+    Value *slot = table_array_slot(t, key);
+    if (slot) {
+        if (value_is_unbound(*slot)) {
+            t->array_count++;
+            if (t->is_proto) {
+                g_chain_version++;
+            }
+        }
+        *slot = value;
+    } else if (value_is_small_int(key) && as_int(key) == (int64_t)t->array_len) {
+        table_array_append(t, value);
+        if (t->is_proto) {
+            g_chain_version++;
+        }
+    } else if (map_set(&t->map, key, value)) {
+        if (t->is_proto) {
+            g_chain_version++;
+        }
+        if (value_type(key) == VAL_STRING) {
+            String *str = as_string(key);
+            t->shape = str->interned ? shape_add(t->shape, str) : &g_dictionary_shape;
+        }
+    }
+    gc_barrier(t, key);
+    gc_barrier(t, value);
+}
+
 static bool table_delete(Table *t, Value key) {
     if (!table_can_mutate(t)) {
         return false;
     }
-    map_delete(&t->map, key);
+    thaw_before_write(t, key, make_undefined());
+    if (t->is_proto) {
+        g_chain_version++;
+    }
+    Value *slot = table_array_slot(t, key);
+    if (slot) {
+        table_array_delete(t, slot);
+    } else if (map_delete(&t->map, key) && value_type(key) == VAL_STRING) {
+        t->shape = &g_dictionary_shape;
+    }
     return true;
 }
 
-static Value table_get(Table *t, Value key) {
+/*
+ * Proto-chain cache. Lookups that reach a table serving as some table's
+ * proto go through a direct-mapped cache from (that table, key) to the
+ * table and map slot holding the key, so a hit costs one probe however
+ * deep the chain. Entries carry g_chain_version, which moves whenever a
+ * proto gains or loses a key or changes its own proto, and whenever the
+ * collector frees a table. A hit also re-checks that the slot still
+ * holds the key, since freezing re-lays out maps in place.
+ */
+#define CHAIN_CACHE_SIZE 1024
+
+typedef struct {
+    Table *start;
+    uint64_t key;
+    Table *holder;
+    uint32_t index;
+    uint64_t version;
+} ChainEntry;
+
+static ChainEntry g_chain_cache[CHAIN_CACHE_SIZE];
+
+static ChainEntry *chain_cache_entry(Table *start, Value key) {
+    uint64_t h = ((uintptr_t)start >> 4) ^ key.bits ^ (key.bits >> 29);
+    h *= 0x9e3779b97f4a7c15ull;
+    return &g_chain_cache[h >> 54];
+}
+
+/* Keys whose bits identify them, so entries can compare bits. */
+static bool chain_cacheable_key(Value key) {
+    if (!value_is_tagged(key)) {
+        return true;
+    }
+    if (value_tag(key) == VALUE_TAG_ROPE) {
+        return false;
+    }
+    return value_tag(key) != VALUE_TAG_STRING || as_string(key)->interned;
+}
+
+static Value table_chain_get(Table *start, Value key) {
+    bool cacheable = chain_cacheable_key(key);
+    ChainEntry *e = NULL;
+    if (cacheable) {
+        e = chain_cache_entry(start, key);
+        if (e->version == g_chain_version && e->start == start && e->key == key.bits) {
+            Map *map = &e->holder->map;
+            if (e->index < map->capacity && map_slot_live(map, e->index) && map->keys[e->index].bits == key.bits) {
+                return map->values[e->index];
+            }
+        }
+    }
+    for (Table *cur = start; cur != NULL; cur = cur->proto) {
+        Value *slot = table_array_slot(cur, key);
+        if (slot) {
+            if (!value_is_unbound(*slot)) {
+                return *slot;
+            }
+            continue;
+        }
+        size_t idx = map_find(&cur->map, key);
+        if (idx != (size_t)-1) {
+            if (cacheable) {
+                *e = (ChainEntry){start, key.bits, cur, (uint32_t)idx, g_chain_version};
+            }
+            return cur->map.values[idx];
+        }
+    }
+    return make_undefined();
+}
+
+Value table_get(Table *t, Value key) {
     Value out;
     for (Table *cur = t; cur != NULL; cur = cur->proto) {
-        if (map_get(&cur->map, key, &out)) {
+        if (cur->is_proto) {
+            return table_chain_get(cur, key);
+        }
+        Value *slot = table_array_slot(cur, key);
+        if (slot) {
+            if (!value_is_unbound(*slot)) {
+                return *slot;
+            }
+        } else if (map_get(&cur->map, key, &out)) {
             return out;
         }
     }
     return make_undefined();
 }
 
-static bool table_has_local(Table *t, Value key) {
-    return map_has(&t->map, key);
-}
+/*
+ * Inline caches.
+ *
+ * Each field access site owns an InlineCache that remembers, for up to
+ * IC_WAYS receiver shapes, how deep in the proto chain the field was found
+ * and at which entry index of the holder's map. A hit re-checks the shape
+ * of every table down to the holder and that the holder's entry still has
+ * the key, so it never hashes. Anything that could change the result
+ * either changes a shape (adding or deleting a string key), swaps a table
+ * in the chain (set_proto, which the walk sees), or moves the entry
+ * (a rehash); each of these makes the hit checks fail.
+ */
+
+#define IC_WAYS 4
+#define IC_MAX_DEPTH 4
 
-static Env *env_new(Env *parent) {
-    Env *env = xmalloc(sizeof(Env));
-    map_init(&env->map);
-    env->parent = parent;
-    return env;
-}
+typedef struct {
+    Shape *shapes[IC_MAX_DEPTH + 1]; /* receiver first, holder last */
+    uint32_t depth;
+    uint32_t index;
+} ICEntry;
 
-static bool env_get(Env *env, const char *name, Value *out) {
-    Value key = make_string_value(name, strlen(name));
-    for (Env *cur = env; cur != NULL; cur = cur->parent) {
-        if (map_get(&cur->map, key, out)) {
-            return true;
+typedef struct {
+    ICEntry entries[IC_WAYS];
+    uint32_t count;
+    uint32_t next; /* entry to replace once full */
+} InlineCache;
+
+/* The cached field's value slot if the entry hits, else NULL. */
+static Value *ic_probe(ICEntry *e, Table *t, String *key) {
+    for (uint32_t d = 0;; d++) {
+        if (t->shape != e->shapes[d]) {
+            return NULL;
+        }
+        if (d == e->depth) {
+            break;
+        }
+        t = t->proto;
+        if (!t) {
+            return NULL;
         }
     }
-    return false;
+    if (e->index >= t->map.capacity) {
+        return NULL;
+    }
+    if (!map_slot_live(&t->map, e->index) ||
+        t->map.keys[e->index].bits != VALUE_BITS(VALUE_TAG_STRING, (uintptr_t)key)) {
+        return NULL;
+    }
+    return &t->map.values[e->index];
 }
 
-static void env_define(Env *env, const char *name, Value value) {
-    Value key = make_string_value(name, strlen(name));
-    map_set(&env->map, key, value);
+static void ic_insert(InlineCache *ic, const ICEntry *e) {
+    if (ic->count < IC_WAYS) {
+        ic->entries[ic->count++] = *e;
+        return;
+    }
+    ic->entries[ic->next] = *e;
+    ic->next = (ic->next + 1) % IC_WAYS;
 }
 
-static bool env_assign(Env *env, const char *name, Value value) {
-    Value key = make_string_value(name, strlen(name));
-    for (Env *cur = env; cur != NULL; cur = cur->parent) {
-        if (map_has(&cur->map, key)) {
-            map_set(&cur->map, key, value);
-            return true;
+/* table_get for an interned string key, through the site's cache. */
+static Value table_get_cached(InlineCache *ic, Table *t, Value key) {
+    for (uint32_t i = 0; i < ic->count; i++) {
+        Value *slot = ic_probe(&ic->entries[i], t, as_string(key));
+        if (slot) {
+            return *slot;
+        }
+    }
+    ICEntry fill;
+    uint32_t depth = 0;
+    for (Table *cur = t; cur != NULL; cur = cur->proto, depth++) {
+        if (depth > IC_MAX_DEPTH || cur->shape->dictionary) {
+            return table_get(cur, key);
+        }
+        fill.shapes[depth] = cur->shape;
+        size_t idx = map_find(&cur->map, key);
+        if (idx != (size_t)-1) {
+            fill.depth = depth;
+            fill.index = (uint32_t)idx;
+            ic_insert(ic, &fill);
+            return cur->map.values[idx];
+        }
+    }
+    return make_undefined();
+}
+
+/* table_set for an interned string key; caches updates of existing fields. */
+static bool table_set_cached(InlineCache *ic, Table *t, Value key, Value value) {
+    if (!table_can_mutate(t)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < ic->count; i++) {
+        if (ic->entries[i].depth == 0) {
+            Value *slot = ic_probe(&ic->entries[i], t, as_string(key));
+            if (slot) {
+                if (thaw_walk_is_pending() && (value_type(value) == VAL_TABLE || value_type(*slot) == VAL_TABLE)) {
+                    thaw_walk_pending();
+                }
+                *slot = value;
+                gc_barrier(t, value);
+                return true;
+            }
         }
     }
-    map_set(&env->map, key, value);
+    Shape *before = t->shape;
+    table_set(t, key, value);
+    if (t->shape == before && !before->dictionary) {
+        ICEntry fill;
+        fill.shapes[0] = before;
+        fill.depth = 0;
+        fill.index = (uint32_t)map_find(&t->map, key);
+        ic_insert(ic, &fill);
+    }
     return true;
 }
 
+static bool table_has_local(Table *t, Value key) {
+    Value *slot = table_array_slot(t, key);
+    if (slot) {
+        return !value_is_unbound(*slot);
+    }
+    return map_has(&t->map, key);
+}
+
+static Env *env_new(Env *parent, size_t size) {
+    Env *env = gc_alloc(GC_ENV, sizeof(Env) + size * sizeof(Value));
+    env->parent = parent;
+    env->size = size;
+    for (size_t i = 0; i < size; i++) {
+        env->slots[i] = make_unbound();
+    }
+    return env;
+}
+
+static Env *env_at(Env *env, uint32_t depth) {
+    while (depth-- > 0) {
+        env = env->parent;
+    }
+    return env;
+}
+
 static EvalResult ok(Value v) {
     EvalResult r;
     r.is_exception = false;
@@ -654,15 +1864,15 @@ static EvalResult error_msg(const char *msg) {
 }
 
 void print_value_to(FILE *out, Value v) {
-    switch (v.type) {
+    switch (value_type(v)) {
     case VAL_INT:
-        fprintf(out, "%lld", (long long)v.as.i);
+        fprintf(out, "%lld", (long long)as_int(v));
         break;
     case VAL_FLOAT:
-        fprintf(out, "%f", v.as.f);
+        fprintf(out, "%f", as_float(v));
         break;
     case VAL_BOOL:
-        fprintf(out, v.as.b ? "true" : "false");
+        fprintf(out, as_bool(v) ? "true" : "false");
         break;
     case VAL_NULL:
         fprintf(out, "null");
@@ -671,7 +1881,7 @@ void print_value_to(FILE *out, Value v) {
         fprintf(out, "undefined");
         break;
     case VAL_STRING:
-        fprintf(out, "%s", v.as.str->data);
+        fprintf(out, "%s", as_string(v)->data);
         break;
     case VAL_TABLE:
         fprintf(out, "<table>");
@@ -1306,7 +2516,7 @@ static Node *parse_primary(Parser *p) {
     }
     if (match(p, TOK_STRING)) {
         Node *node = node_new(NODE_LITERAL, tok->line, tok->col);
-        node->as.literal = make_string_value(tok->lexeme, strlen(tok->lexeme));
+        node->as.literal = make_interned_string(tok->lexeme, strlen(tok->lexeme));
         return node;
     }
     if (match(p, TOK_TRUE)) {
@@ -1434,7 +2644,7 @@ static Node *parse_unary(Parser *p) {
     if (match(p, TOK_NOT) || match(p, TOK_MINUS)) {
         Token *op = previous(p);
         Node *node = node_new(NODE_UNARY, op->line, op->col);
-        node->as.unary.op = op->lexeme ? op->lexeme : (op->type == TOK_NOT ? "!" : "-");
+        node->as.unary.op = op->type == TOK_NOT ? UNARY_NOT : UNARY_NEG;
         node->as.unary.expr = parse_unary(p);
         return node;
     }
@@ -1446,7 +2656,7 @@ static Node *parse_factor(Parser *p) {
     while (match(p, TOK_STAR) || match(p, TOK_SLASH)) {
         Token *op = previous(p);
         Node *node = node_new(NODE_BINARY, op->line, op->col);
-        node->as.binary.op = op->type == TOK_STAR ? "*" : "/";
+        node->as.binary.op = op->type == TOK_STAR ? BIN_MUL : BIN_DIV;
         node->as.binary.left = expr;
         node->as.binary.right = parse_unary(p);
         expr = node;
@@ -1459,7 +2669,7 @@ static Node *parse_term(Parser *p) {
     while (match(p, TOK_PLUS) || match(p, TOK_MINUS)) {
         Token *op = previous(p);
         Node *node = node_new(NODE_BINARY, op->line, op->col);
-        node->as.binary.op = op->type == TOK_PLUS ? "+" : "-";
+        node->as.binary.op = op->type == TOK_PLUS ? BIN_ADD : BIN_SUB;
         node->as.binary.left = expr;
         node->as.binary.right = parse_factor(p);
         expr = node;
@@ -1474,16 +2684,16 @@ static Node *parse_comparison(Parser *p) {
         Node *node = node_new(NODE_BINARY, op->line, op->col);
         switch (op->type) {
         case TOK_LT:
-            node->as.binary.op = "<";
+            node->as.binary.op = BIN_LT;
             break;
         case TOK_LE:
-            node->as.binary.op = "<=";
+            node->as.binary.op = BIN_LE;
             break;
         case TOK_GT:
-            node->as.binary.op = ">";
+            node->as.binary.op = BIN_GT;
             break;
         case TOK_GE:
-            node->as.binary.op = ">=";
+            node->as.binary.op = BIN_GE;
             break;
         default:
             break;
@@ -1500,7 +2710,7 @@ static Node *parse_equality(Parser *p) {
     while (match(p, TOK_EQ) || match(p, TOK_NE)) {
         Token *op = previous(p);
         Node *node = node_new(NODE_BINARY, op->line, op->col);
-        node->as.binary.op = op->type == TOK_EQ ? "==" : "!=";
+        node->as.binary.op = op->type == TOK_EQ ? BIN_EQ : BIN_NE;
         node->as.binary.left = expr;
         node->as.binary.right = parse_comparison(p);
         expr = node;
@@ -1513,7 +2723,7 @@ static Node *parse_and(Parser *p) {
     while (match(p, TOK_AND)) {
         Token *op = previous(p);
         Node *node = node_new(NODE_BINARY, op->line, op->col);
-        node->as.binary.op = "&&";
+        node->as.binary.op = BIN_AND;
         node->as.binary.left = expr;
         node->as.binary.right = parse_equality(p);
         expr = node;
@@ -1526,7 +2736,7 @@ static Node *parse_or(Parser *p) {
     while (match(p, TOK_OR)) {
         Token *op = previous(p);
         Node *node = node_new(NODE_BINARY, op->line, op->col);
-        node->as.binary.op = "||";
+        node->as.binary.op = BIN_OR;
         node->as.binary.left = expr;
         node->as.binary.right = parse_and(p);
         expr = node;
@@ -1629,8 +2839,6 @@ static Node *parse_program(Parser *p) {
     return node;
 }
 
-static EvalResult eval_node(Node *node, Env *env, const char *module_dir);
-
 static FILE *try_open_module(const char *path, const char *module_dir, char *full, size_t full_sz) {
     FILE *f = NULL;
     if (path[0] == '/') {
@@ -1669,455 +2877,4026 @@ static FILE *try_open_module(const char *path, const char *module_dir, char *ful
     return fopen(full, "rb");
 }
 
-static EvalResult eval_block(Node *node, Env *env, const char *module_dir, bool new_scope) {
-    Env *scope = env;
-    if (new_scope) {
-        scope = env_new(env);
-    }
-    Value last = make_null();
-    for (size_t i = 0; i < node->as.block.statements.count; i++) {
-        EvalResult r = eval_node(node->as.block.statements.items[i], scope, module_dir);
-        if (r.is_exception) {
-            return r;
+/*
+ * Resolver.
+ *
+ * Binds every variable reference to a (depth, slot) pair before compilation:
+ * depth counts scope hops outward from the reference and slot indexes that
+ * scope's Env. A scope owns the names it imports and the names assigned
+ * directly in it that no enclosing scope owns yet; function parameters take
+ * the first slots of the function's scope. Enclosing scopes are declared
+ * before nested ones, so an assignment in a nested block updates the
+ * outer binding. The root scope holds the builtins.
+ */
+
+typedef struct Scope {
+    struct Scope *parent;
+    StrList names;
+} Scope;
+
+static void root_scope_init(Scope *s);
+
+static void scope_init(Scope *s, Scope *parent) {
+    s->parent = parent;
+    str_list_init(&s->names);
+}
+
+static void scope_free(Scope *s) {
+    free(s->names.items);
+}
+
+/* Searches from the end so a repeated parameter name binds the last one. */
+static int scope_find_local(Scope *s, const char *name) {
+    for (size_t i = s->names.count; i > 0; i--) {
+        if (strcmp(s->names.items[i - 1], name) == 0) {
+            return (int)(i - 1);
         }
-        last = r.value;
     }
-    return ok(last);
+    return -1;
 }
 
-static EvalResult eval_binary(const char *op, Value left, Value right) {
-    if (strcmp(op, "+") == 0) {
-        if (left.type == VAL_STRING || right.type == VAL_STRING) {
-            return error_msg("string concatenation not implemented");
-        }
-        if (!value_is_number(left) || !value_is_number(right)) {
-            return error_msg("non-numeric '+'");
-        }
-        if (left.type == VAL_FLOAT || right.type == VAL_FLOAT) {
-            return ok(make_float(value_as_double(left) + value_as_double(right)));
-        }
-        return ok(make_int(left.as.i + right.as.i));
+static int scope_declare(Scope *s, char *name) {
+    int slot = scope_find_local(s, name);
+    if (slot >= 0) {
+        return slot;
     }
-    if (strcmp(op, "-") == 0) {
-        if (!value_is_number(left) || !value_is_number(right)) {
-            return error_msg("non-numeric '-'");
-        }
-        if (left.type == VAL_FLOAT || right.type == VAL_FLOAT) {
-            return ok(make_float(value_as_double(left) - value_as_double(right)));
+    str_list_push(&s->names, name);
+    return (int)s->names.count - 1;
+}
+
+static bool scope_lookup(Scope *s, const char *name, int *depth, int *slot) {
+    int d = 0;
+    for (Scope *cur = s; cur != NULL; cur = cur->parent, d++) {
+        int i = scope_find_local(cur, name);
+        if (i >= 0) {
+            *depth = d;
+            *slot = i;
+            return true;
         }
-        return ok(make_int(left.as.i - right.as.i));
     }
-    if (strcmp(op, "*") == 0) {
-        if (!value_is_number(left) || !value_is_number(right)) {
-            return error_msg("non-numeric '*'");
-        }
-        if (left.type == VAL_FLOAT || right.type == VAL_FLOAT) {
-            return ok(make_float(value_as_double(left) * value_as_double(right)));
+    return false;
+}
+
+/* Declares the names s owns in node, without entering nested scopes. */
+static void declare_names(Scope *s, Node *node) {
+    int depth, slot;
+    switch (node->type) {
+    case NODE_ASSIGN: {
+        Node *target = node->as.assign.target;
+        declare_names(s, node->as.assign.value);
+        if (target->type == NODE_VAR) {
+            if (!scope_lookup(s, target->as.var.name, &depth, &slot)) {
+                scope_declare(s, target->as.var.name);
+            }
+        } else {
+            declare_names(s, target);
         }
-        return ok(make_int(left.as.i * right.as.i));
+        return;
     }
-    if (strcmp(op, "/") == 0) {
-        if (!value_is_number(left) || !value_is_number(right)) {
-            return error_msg("non-numeric '/'");
+    case NODE_IMPORT:
+        scope_declare(s, node->as.import_stmt.name);
+        return;
+    case NODE_BINARY:
+        declare_names(s, node->as.binary.left);
+        declare_names(s, node->as.binary.right);
+        return;
+    case NODE_UNARY:
+        declare_names(s, node->as.unary.expr);
+        return;
+    case NODE_CALL:
+        declare_names(s, node->as.call.callee);
+        for (size_t i = 0; i < node->as.call.args.count; i++) {
+            declare_names(s, node->as.call.args.items[i]);
         }
-        if (left.type == VAL_FLOAT || right.type == VAL_FLOAT) {
-            return ok(make_float(value_as_double(left) / value_as_double(right)));
+        return;
+    case NODE_DOT:
+        declare_names(s, node->as.dot.object);
+        return;
+    case NODE_INDEX:
+        declare_names(s, node->as.index.object);
+        declare_names(s, node->as.index.index);
+        return;
+    case NODE_IF:
+        declare_names(s, node->as.if_expr.cond);
+        if (node->as.if_expr.else_branch && node->as.if_expr.else_branch->type == NODE_IF) {
+            declare_names(s, node->as.if_expr.else_branch);
         }
-        if (right.as.i == 0) {
-            return error_msg("division by zero");
+        return;
+    case NODE_MUTATE:
+        declare_names(s, node->as.mutate.target);
+        return;
+    case NODE_UNDEFINE:
+        declare_names(s, node->as.undefine.target);
+        return;
+    case NODE_THROW:
+        declare_names(s, node->as.throw_expr.expr);
+        return;
+    case NODE_TABLE:
+        for (size_t i = 0; i < node->as.table.items.count; i++) {
+            declare_names(s, node->as.table.items.values[i]);
         }
-        return ok(make_int(left.as.i / right.as.i));
-    }
-    if (strcmp(op, "==") == 0) {
-        return ok(make_bool(value_equal(left, right)));
-    }
-    if (strcmp(op, "!=") == 0) {
-        return ok(make_bool(!value_equal(left, right)));
-    }
-    if (strcmp(op, "<") == 0) {
-        if (!value_is_number(left) || !value_is_number(right)) {
-            return error_msg("non-numeric '<'");
+        return;
+    case NODE_BLOCK:
+        for (size_t i = 0; i < node->as.block.statements.count; i++) {
+            declare_names(s, node->as.block.statements.items[i]);
         }
-        return ok(make_bool(value_as_double(left) < value_as_double(right)));
+        return;
+    case NODE_LITERAL:
+    case NODE_VAR:
+    case NODE_FN:
+    case NODE_TRY:
+        return;
     }
-    if (strcmp(op, "<=") == 0) {
+}
+
+static void resolve_node(Scope *s, Node *node);
+
+static void resolve_statements(Scope *s, Node *block) {
+    NodeList *stmts = &block->as.block.statements;
+    for (size_t i = 0; i < stmts->count; i++) {
+        resolve_node(s, stmts->items[i]);
+    }
+}
+
+static void resolve_body(Scope *s, Node *block) {
+    declare_names(s, block);
+    resolve_statements(s, block);
+}
+
+/*
+ * Resolves a block that opens its own scope inside s. A block that binds
+ * nothing is resolved straight into s and opens no scope at run time.
+ */
+static void resolve_scope(Scope *s, Node *block) {
+    Scope inner;
+    scope_init(&inner, s);
+    declare_names(&inner, block);
+    if (inner.names.count == 0) {
+        resolve_statements(s, block);
+    } else {
+        resolve_statements(&inner, block);
+    }
+    block->as.block.slots = (int)inner.names.count;
+    scope_free(&inner);
+}
+
+static void resolve_branch(Scope *s, Node *node) {
+    if (node->type == NODE_BLOCK) {
+        resolve_scope(s, node);
+    } else {
+        resolve_node(s, node);
+    }
+}
+
+static void resolve_node(Scope *s, Node *node) {
+    switch (node->type) {
+    case NODE_LITERAL:
+        return;
+    case NODE_VAR:
+        if (!scope_lookup(s, node->as.var.name, &node->as.var.depth, &node->as.var.slot)) {
+            node->as.var.depth = -1;
+            node->as.var.slot = -1;
+        }
+        return;
+    case NODE_ASSIGN:
+        resolve_node(s, node->as.assign.value);
+        resolve_node(s, node->as.assign.target);
+        return;
+    case NODE_BINARY:
+        resolve_node(s, node->as.binary.left);
+        resolve_node(s, node->as.binary.right);
+        return;
+    case NODE_UNARY:
+        resolve_node(s, node->as.unary.expr);
+        return;
+    case NODE_CALL:
+        resolve_node(s, node->as.call.callee);
+        for (size_t i = 0; i < node->as.call.args.count; i++) {
+            resolve_node(s, node->as.call.args.items[i]);
+        }
+        return;
+    case NODE_DOT:
+        resolve_node(s, node->as.dot.object);
+        return;
+    case NODE_INDEX:
+        resolve_node(s, node->as.index.object);
+        resolve_node(s, node->as.index.index);
+        return;
+    case NODE_IF:
+        resolve_node(s, node->as.if_expr.cond);
+        resolve_branch(s, node->as.if_expr.then_branch);
+        if (node->as.if_expr.else_branch) {
+            resolve_branch(s, node->as.if_expr.else_branch);
+        }
+        return;
+    case NODE_FN: {
+        Scope fn_scope;
+        scope_init(&fn_scope, s);
+        StrList *params = &node->as.fn.params;
+        for (size_t i = 0; i < params->count; i++) {
+            str_list_push(&fn_scope.names, params->items[i]);
+        }
+        resolve_body(&fn_scope, node->as.fn.body);
+        node->as.fn.slots = (int)fn_scope.names.count;
+        scope_free(&fn_scope);
+        return;
+    }
+    case NODE_IMPORT:
+        node->as.import_stmt.slot = scope_find_local(s, node->as.import_stmt.name);
+        return;
+    case NODE_MUTATE:
+        resolve_node(s, node->as.mutate.target);
+        resolve_scope(s, node->as.mutate.body);
+        return;
+    case NODE_UNDEFINE:
+        resolve_node(s, node->as.undefine.target);
+        return;
+    case NODE_TRY:
+        resolve_scope(s, node->as.try_expr.try_block);
+        if (node->as.try_expr.catch_block) {
+            if (node->as.try_expr.catch_any) {
+                resolve_scope(s, node->as.try_expr.catch_block);
+            } else {
+                Scope catch_scope;
+                scope_init(&catch_scope, s);
+                str_list_push(&catch_scope.names, node->as.try_expr.catch_name);
+                resolve_scope(&catch_scope, node->as.try_expr.catch_block);
+                scope_free(&catch_scope);
+            }
+        }
+        if (node->as.try_expr.finally_block) {
+            resolve_scope(s, node->as.try_expr.finally_block);
+        }
+        return;
+    case NODE_THROW:
+        resolve_node(s, node->as.throw_expr.expr);
+        return;
+    case NODE_TABLE:
+        for (size_t i = 0; i < node->as.table.items.count; i++) {
+            resolve_node(s, node->as.table.items.values[i]);
+        }
+        return;
+    case NODE_BLOCK:
+        resolve_body(s, node);
+        return;
+    }
+}
+
+/* A program or module runs in its own scope directly under the root. */
+static void resolve_program(Node *program) {
+    Scope root, top;
+    root_scope_init(&root);
+    scope_init(&top, &root);
+    resolve_body(&top, program);
+    program->as.block.slots = (int)top.names.count;
+    scope_free(&top);
+    scope_free(&root);
+}
+
+/*
+ * Bytecode.
+ *
+ * Every function body (and every program or module) is lowered to a Proto:
+ * a flat array of 32-bit words where each opcode is followed by its
+ * operands. The VM below is a stack machine; every expression leaves
+ * exactly one value on the stack.
+ */
+
+#define PROTOLEX_OPCODES(X) \
+    X(OP_CONST)             \
+    X(OP_NULL)              \
+    X(OP_POP)               \
+    X(OP_GET_LOCAL)         \
+    X(OP_SET_LOCAL)         \
+    X(OP_GET_VAR)           \
+    X(OP_SET_VAR)           \
+    X(OP_CHECK_ASSIGN)      \
+    X(OP_PUSH_SCOPE)        \
+    X(OP_POP_SCOPE)         \
+    X(OP_GET_FIELD)         \
+    X(OP_SET_FIELD)         \
+    X(OP_SET_PROTO)         \
+    X(OP_GET_INDEX)         \
+    X(OP_SET_INDEX)         \
+    X(OP_UNDEFINE_FIELD)    \
+    X(OP_UNDEFINE_PROTO)    \
+    X(OP_UNDEFINE_INDEX)    \
+    X(OP_NEW_TABLE)         \
+    X(OP_INIT_FIELD)        \
+    X(OP_INIT_PROTO)        \
+    X(OP_ADD)               \
+    X(OP_SUB)               \
+    X(OP_MUL)               \
+    X(OP_DIV)               \
+    X(OP_EQ)                \
+    X(OP_NE)                \
+    X(OP_LT)                \
+    X(OP_LE)                \
+    X(OP_GT)                \
+    X(OP_GE)                \
+    X(OP_AND)               \
+    X(OP_OR)                \
+    X(OP_NOT)               \
+    X(OP_NEG)               \
+    X(OP_JUMP)              \
+    X(OP_JUMP_IF_FALSE)     \
+    X(OP_CALL)              \
+    X(OP_TAIL_CALL)         \
+    X(OP_CLOSURE)           \
+    X(OP_IMPORT)            \
+    X(OP_MUTATE_BEGIN)      \
+    X(OP_MUTATE_END)        \
+    X(OP_TRY_BEGIN)         \
+    X(OP_TRY_END)           \
+    X(OP_FINALLY_BEGIN)     \
+    X(OP_FINALLY_END)       \
+    X(OP_THROW)             \
+    X(OP_THROW_MSG)         \
+    X(OP_RETURN)
+
+typedef enum {
+#define X(op) op,
+    PROTOLEX_OPCODES(X)
+#undef X
+    OP_COUNT
+} OpCode;
+
+typedef struct Proto {
+    uint32_t *code;
+    size_t code_len;
+    size_t code_cap;
+    Value *consts;
+    size_t const_count;
+    size_t const_cap;
+    struct Proto **protos;
+    size_t proto_count;
+    size_t proto_cap;
+    InlineCache *ics;
+    size_t ic_count;
+    size_t ic_cap;
+    int arity;
+    int slot_count; /* size of the Env a call (or module run) allocates */
+    int max_stack;
+    bool captures_env; /* creates closures or imports: its env may escape */
+    const char *module_dir;
+    uint32_t calls;   /* counted only while the JIT is enabled */
+    struct Jit *jit;  /* native code, once the proto is hot */
+} Proto;
+
+/* Operand words that follow op in the code. */
+static size_t op_operand_count(OpCode op) {
+    switch (op) {
+    case OP_GET_VAR:
+    case OP_SET_VAR:
+    case OP_GET_FIELD:
+    case OP_SET_FIELD:
+        return 2;
+    case OP_CONST:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_PUSH_SCOPE:
+    case OP_UNDEFINE_FIELD:
+    case OP_INIT_FIELD:
+    case OP_NEW_TABLE:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CLOSURE:
+    case OP_IMPORT:
+    case OP_TRY_BEGIN:
+    case OP_THROW_MSG:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+typedef struct {
+    Proto *proto;
+    int depth;
+} Compiler;
+
+/* Every proto ever compiled; their constants are GC roots. */
+static Proto **g_protos;
+static size_t g_proto_count;
+static size_t g_proto_cap;
+
+static Proto *proto_new(const char *module_dir) {
+    Proto *proto = xmalloc(sizeof(Proto));
+    if (g_proto_count == g_proto_cap) {
+        g_proto_cap = g_proto_cap ? g_proto_cap * 2 : 64;
+        g_protos = realloc(g_protos, g_proto_cap * sizeof(Proto *));
+        if (!g_protos) {
+            runtime_fatal("out of memory");
+        }
+    }
+    g_protos[g_proto_count++] = proto;
+    proto->code = NULL;
+    proto->code_len = 0;
+    proto->code_cap = 0;
+    proto->consts = NULL;
+    proto->const_count = 0;
+    proto->const_cap = 0;
+    proto->protos = NULL;
+    proto->proto_count = 0;
+    proto->proto_cap = 0;
+    proto->ics = NULL;
+    proto->ic_count = 0;
+    proto->ic_cap = 0;
+    proto->arity = 0;
+    proto->slot_count = 0;
+    proto->max_stack = 0;
+    proto->captures_env = false;
+    proto->module_dir = module_dir;
+    proto->calls = 0;
+    proto->jit = NULL;
+    return proto;
+}
+
+/* Frees the protos made since g_proto_count was mark, none of which has run. */
+static void proto_drop_since(size_t mark) {
+    while (g_proto_count > mark) {
+        Proto *proto = g_protos[--g_proto_count];
+        free(proto->code);
+        free(proto->consts);
+        free(proto->protos);
+        free(proto->ics);
+        free(proto);
+    }
+}
+
+static void emit(Compiler *c, uint32_t word) {
+    Proto *proto = c->proto;
+    if (proto->code_len == proto->code_cap) {
+        size_t cap = proto->code_cap ? proto->code_cap * 2 : 64;
+        proto->code = realloc(proto->code, cap * sizeof(uint32_t));
+        if (!proto->code) {
+            runtime_fatal("out of memory");
+        }
+        proto->code_cap = cap;
+    }
+    proto->code[proto->code_len++] = word;
+}
+
+static void adjust_depth(Compiler *c, int effect) {
+    c->depth += effect;
+    if (c->depth > c->proto->max_stack) {
+        c->proto->max_stack = c->depth;
+    }
+}
+
+static void emit_op(Compiler *c, OpCode op, int effect) {
+    emit(c, (uint32_t)op);
+    adjust_depth(c, effect);
+}
+
+static void emit_op_arg(Compiler *c, OpCode op, uint32_t arg, int effect) {
+    emit(c, (uint32_t)op);
+    emit(c, arg);
+    adjust_depth(c, effect);
+}
+
+static size_t emit_jump(Compiler *c, OpCode op, int effect) {
+    emit_op_arg(c, op, 0, effect);
+    return c->proto->code_len - 1;
+}
+
+static void patch_jump(Compiler *c, size_t at) {
+    c->proto->code[at] = (uint32_t)c->proto->code_len;
+}
+
+static uint32_t add_const(Compiler *c, Value v) {
+    Proto *proto = c->proto;
+    if (proto->const_count == proto->const_cap) {
+        size_t cap = proto->const_cap ? proto->const_cap * 2 : 16;
+        proto->consts = realloc(proto->consts, cap * sizeof(Value));
+        if (!proto->consts) {
+            runtime_fatal("out of memory");
+        }
+        proto->const_cap = cap;
+    }
+    proto->consts[proto->const_count] = v;
+    return (uint32_t)proto->const_count++;
+}
+
+static uint32_t add_name(Compiler *c, const char *name) {
+    Value key = make_interned_string(name, strlen(name));
+    Proto *proto = c->proto;
+    for (size_t i = 0; i < proto->const_count; i++) {
+        Value k = proto->consts[i];
+        if (value_type(k) == VAL_STRING && as_string(k) == as_string(key)) {
+            return (uint32_t)i;
+        }
+    }
+    return add_const(c, key);
+}
+
+static uint32_t add_proto(Compiler *c, Proto *child) {
+    Proto *proto = c->proto;
+    if (proto->proto_count == proto->proto_cap) {
+        size_t cap = proto->proto_cap ? proto->proto_cap * 2 : 8;
+        proto->protos = realloc(proto->protos, cap * sizeof(Proto *));
+        if (!proto->protos) {
+            runtime_fatal("out of memory");
+        }
+        proto->proto_cap = cap;
+    }
+    proto->protos[proto->proto_count] = child;
+    return (uint32_t)proto->proto_count++;
+}
+
+static uint32_t add_ic(Compiler *c) {
+    Proto *proto = c->proto;
+    if (proto->ic_count == proto->ic_cap) {
+        size_t cap = proto->ic_cap ? proto->ic_cap * 2 : 8;
+        proto->ics = realloc(proto->ics, cap * sizeof(InlineCache));
+        if (!proto->ics) {
+            runtime_fatal("out of memory");
+        }
+        proto->ic_cap = cap;
+    }
+    memset(&proto->ics[proto->ic_count], 0, sizeof(InlineCache));
+    return (uint32_t)proto->ic_count++;
+}
+
+static OpCode binary_opcode(BinaryOp op) {
+    switch (op) {
+    case BIN_ADD:
+        return OP_ADD;
+    case BIN_SUB:
+        return OP_SUB;
+    case BIN_MUL:
+        return OP_MUL;
+    case BIN_DIV:
+        return OP_DIV;
+    case BIN_EQ:
+        return OP_EQ;
+    case BIN_NE:
+        return OP_NE;
+    case BIN_LT:
+        return OP_LT;
+    case BIN_LE:
+        return OP_LE;
+    case BIN_GT:
+        return OP_GT;
+    case BIN_GE:
+        return OP_GE;
+    case BIN_AND:
+        return OP_AND;
+    case BIN_OR:
+        return OP_OR;
+    }
+    runtime_fatal("unknown binary op");
+    return OP_COUNT;
+}
+
+/*
+ * Folding.
+ *
+ * Runs over the tree before the resolver. Unary and binary operators whose
+ * operands are literals are replaced by their result, unless evaluating
+ * them would throw; the error is left for run time. An if whose condition
+ * folds to a literal keeps only the branch that runs, rewritten as
+ * `if true { ... }` so the branch still opens its own scope.
+ */
+
+static EvalResult binary_op(OpCode op, Value left, Value right);
+
+static void fold_node(Node *node);
+
+static void fold_list(NodeList *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        fold_node(list->items[i]);
+    }
+}
+
+static void set_literal(Node *node, Value v) {
+    node->type = NODE_LITERAL;
+    node->as.literal = v;
+}
+
+static void fold_if(Node *node) {
+    Node *cond = node->as.if_expr.cond;
+    fold_node(cond);
+    fold_node(node->as.if_expr.then_branch);
+    if (node->as.if_expr.else_branch) {
+        fold_node(node->as.if_expr.else_branch);
+    }
+    if (cond->type != NODE_LITERAL) {
+        return;
+    }
+    if (value_is_truthy(cond->as.literal)) {
+        node->as.if_expr.else_branch = NULL;
+        return;
+    }
+    Node *other = node->as.if_expr.else_branch;
+    if (!other) {
+        set_literal(node, make_null());
+    } else if (other->type == NODE_IF) {
+        *node = *other;
+    } else {
+        set_literal(cond, make_bool(true));
+        node->as.if_expr.then_branch = other;
+        node->as.if_expr.else_branch = NULL;
+    }
+}
+
+static void fold_node(Node *node) {
+    switch (node->type) {
+    case NODE_LITERAL:
+    case NODE_VAR:
+    case NODE_IMPORT:
+        return;
+    case NODE_ASSIGN:
+        fold_node(node->as.assign.target);
+        fold_node(node->as.assign.value);
+        return;
+    case NODE_BINARY: {
+        Node *left = node->as.binary.left;
+        Node *right = node->as.binary.right;
+        fold_node(left);
+        fold_node(right);
+        if (left->type == NODE_LITERAL && right->type == NODE_LITERAL) {
+            EvalResult r = binary_op(binary_opcode(node->as.binary.op), left->as.literal,
+                                     right->as.literal);
+            if (!r.is_exception && value_type(r.value) == VAL_STRING) {
+                /* Literal strings are interned; keep folded ones that way. */
+                String *str = as_string(r.value);
+                set_literal(node, make_interned_string(str->data, str->len));
+            } else if (!r.is_exception) {
+                set_literal(node, r.value);
+            }
+        }
+        return;
+    }
+    case NODE_UNARY: {
+        Node *expr = node->as.unary.expr;
+        fold_node(expr);
+        if (expr->type != NODE_LITERAL) {
+            return;
+        }
+        Value v = expr->as.literal;
+        if (node->as.unary.op == UNARY_NOT) {
+            set_literal(node, make_bool(!value_is_truthy(v)));
+        } else if (value_type(v) == VAL_INT) {
+            set_literal(node, make_int(-as_int(v)));
+        } else if (value_type(v) == VAL_FLOAT) {
+            set_literal(node, make_float(-as_float(v)));
+        }
+        return;
+    }
+    case NODE_CALL:
+        fold_node(node->as.call.callee);
+        fold_list(&node->as.call.args);
+        return;
+    case NODE_DOT:
+        fold_node(node->as.dot.object);
+        return;
+    case NODE_INDEX:
+        fold_node(node->as.index.object);
+        fold_node(node->as.index.index);
+        return;
+    case NODE_IF:
+        fold_if(node);
+        return;
+    case NODE_FN:
+        fold_node(node->as.fn.body);
+        return;
+    case NODE_MUTATE:
+        fold_node(node->as.mutate.target);
+        fold_node(node->as.mutate.body);
+        return;
+    case NODE_UNDEFINE:
+        fold_node(node->as.undefine.target);
+        return;
+    case NODE_TRY:
+        fold_node(node->as.try_expr.try_block);
+        if (node->as.try_expr.catch_block) {
+            fold_node(node->as.try_expr.catch_block);
+        }
+        if (node->as.try_expr.finally_block) {
+            fold_node(node->as.try_expr.finally_block);
+        }
+        return;
+    case NODE_THROW:
+        fold_node(node->as.throw_expr.expr);
+        return;
+    case NODE_TABLE:
+        for (size_t i = 0; i < node->as.table.items.count; i++) {
+            fold_node(node->as.table.items.values[i]);
+        }
+        return;
+    case NODE_BLOCK:
+        fold_list(&node->as.block.statements);
+        return;
+    }
+}
+
+static void compile_node(Compiler *c, Node *node);
+static Proto *compile_function(Node *node, const char *module_dir);
+
+static void compile_tail(Compiler *c, Node *node);
+
+static void compile_block(Compiler *c, Node *node, bool new_scope, bool tail) {
+    NodeList *stmts = &node->as.block.statements;
+    new_scope = new_scope && node->as.block.slots > 0;
+    if (new_scope) {
+        emit_op_arg(c, OP_PUSH_SCOPE, (uint32_t)node->as.block.slots, 0);
+    }
+    if (stmts->count == 0) {
+        emit_op(c, OP_NULL, 1);
+    }
+    for (size_t i = 0; i < stmts->count; i++) {
+        if (i + 1 < stmts->count) {
+            compile_node(c, stmts->items[i]);
+            emit_op(c, OP_POP, -1);
+        } else if (tail) {
+            compile_tail(c, stmts->items[i]);
+        } else {
+            compile_node(c, stmts->items[i]);
+        }
+    }
+    if (new_scope) {
+        emit_op(c, OP_POP_SCOPE, 0);
+    }
+}
+
+/* An if/else branch is either a block or, for `else if`, another if. */
+static void compile_branch(Compiler *c, Node *node, bool tail) {
+    if (node->type == NODE_BLOCK) {
+        compile_block(c, node, true, tail);
+    } else if (tail) {
+        compile_tail(c, node);
+    } else {
+        compile_node(c, node);
+    }
+}
+
+static void compile_if(Compiler *c, Node *node, bool tail) {
+    int depth = c->depth;
+    if (node->as.if_expr.cond->type == NODE_LITERAL) {
+        /* Folded: only the branch that runs is left. */
+        compile_branch(c, node->as.if_expr.then_branch, tail);
+        return;
+    }
+    compile_node(c, node->as.if_expr.cond);
+    size_t to_else = emit_jump(c, OP_JUMP_IF_FALSE, -1);
+    compile_branch(c, node->as.if_expr.then_branch, tail);
+    size_t to_end = emit_jump(c, OP_JUMP, 0);
+    patch_jump(c, to_else);
+    c->depth = depth;
+    if (node->as.if_expr.else_branch) {
+        compile_branch(c, node->as.if_expr.else_branch, tail);
+    } else {
+        emit_op(c, OP_NULL, 1);
+    }
+    patch_jump(c, to_end);
+}
+
+static void compile_call(Compiler *c, Node *node, bool tail) {
+    size_t argc = node->as.call.args.count;
+    compile_node(c, node->as.call.callee);
+    for (size_t i = 0; i < argc; i++) {
+        compile_node(c, node->as.call.args.items[i]);
+    }
+    emit_op_arg(c, tail ? OP_TAIL_CALL : OP_CALL, (uint32_t)argc, -(int)argc);
+}
+
+/*
+ * Compiles an expression whose value becomes the function's result, so a
+ * call there can replace the current frame. Tail position reaches through
+ * if/else branches but not into try or mutate, which have work to do after
+ * their body.
+ */
+static void compile_tail(Compiler *c, Node *node) {
+    switch (node->type) {
+    case NODE_CALL:
+        compile_call(c, node, true);
+        return;
+    case NODE_IF:
+        compile_if(c, node, true);
+        return;
+    case NODE_BLOCK:
+        compile_block(c, node, false, true);
+        return;
+    default:
+        compile_node(c, node);
+        return;
+    }
+}
+
+static void compile_get_var(Compiler *c, Node *node) {
+    if (node->as.var.depth < 0) {
+        emit_op_arg(c, OP_THROW_MSG, add_name(c, "undefined variable"), 1);
+    } else if (node->as.var.depth == 0) {
+        emit_op_arg(c, OP_GET_LOCAL, (uint32_t)node->as.var.slot, 1);
+    } else {
+        emit_op_arg(c, OP_GET_VAR, (uint32_t)node->as.var.depth, 1);
+        emit(c, (uint32_t)node->as.var.slot);
+    }
+}
+
+static void compile_set_var(Compiler *c, Node *node) {
+    if (node->as.var.depth == 0) {
+        emit_op_arg(c, OP_SET_LOCAL, (uint32_t)node->as.var.slot, 0);
+    } else {
+        emit_op_arg(c, OP_SET_VAR, (uint32_t)node->as.var.depth, 0);
+        emit(c, (uint32_t)node->as.var.slot);
+    }
+}
+
+static void compile_assign(Compiler *c, Node *node) {
+    Node *target = node->as.assign.target;
+    compile_node(c, node->as.assign.value);
+    emit_op(c, OP_CHECK_ASSIGN, 0);
+    switch (target->type) {
+    case NODE_VAR:
+        compile_set_var(c, target);
+        break;
+    case NODE_DOT:
+        compile_node(c, target->as.dot.object);
+        if (strcmp(target->as.dot.name, "proto") == 0) {
+            emit_op(c, OP_SET_PROTO, -1);
+        } else {
+            emit_op_arg(c, OP_SET_FIELD, add_name(c, target->as.dot.name), -1);
+            emit(c, add_ic(c));
+        }
+        break;
+    case NODE_INDEX:
+        compile_node(c, target->as.index.object);
+        compile_node(c, target->as.index.index);
+        emit_op(c, OP_SET_INDEX, -2);
+        break;
+    default:
+        emit_op_arg(c, OP_THROW_MSG, add_name(c, "invalid assignment"), 0);
+        break;
+    }
+}
+
+static void compile_undefine(Compiler *c, Node *node) {
+    Node *target = node->as.undefine.target;
+    if (target->type == NODE_DOT) {
+        compile_node(c, target->as.dot.object);
+        if (strcmp(target->as.dot.name, "proto") == 0) {
+            emit_op(c, OP_UNDEFINE_PROTO, 0);
+        } else {
+            emit_op_arg(c, OP_UNDEFINE_FIELD, add_name(c, target->as.dot.name), 0);
+        }
+    } else if (target->type == NODE_INDEX) {
+        compile_node(c, target->as.index.object);
+        compile_node(c, target->as.index.index);
+        emit_op(c, OP_UNDEFINE_INDEX, -1);
+    } else {
+        emit_op(c, OP_NULL, 1);
+        emit_op_arg(c, OP_THROW_MSG, add_name(c, "undefine target must be slot"), 0);
+    }
+}
+
+/*
+ * try/catch/finally layout:
+ *
+ *         TRY_BEGIN catch
+ *         <try block>
+ *         TRY_END
+ *         JUMP normal
+ *   catch:                       exception on the stack
+ *         [bind or drop it, run the catch block under TRY_BEGIN fin_exc]
+ *         JUMP normal
+ *   fin_exc:                     exception on the stack
+ *         <finally block>
+ *         THROW
+ *   normal:                      result on the stack
+ *         <finally block>
+ *
+ * Finally blocks run between FINALLY_BEGIN/END; an exception escaping one
+ * is fatal.
+ */
+static void compile_finally(Compiler *c, Node *block) {
+    emit_op(c, OP_FINALLY_BEGIN, 0);
+    compile_block(c, block, true, false);
+    emit_op(c, OP_POP, -1);
+    emit_op(c, OP_FINALLY_END, 0);
+}
+
+static void compile_try(Compiler *c, Node *node) {
+    Node *catch_block = node->as.try_expr.catch_block;
+    Node *finally_block = node->as.try_expr.finally_block;
+    bool named = catch_block && !node->as.try_expr.catch_any;
+    int depth = c->depth;
+
+    size_t to_catch = emit_jump(c, OP_TRY_BEGIN, 0);
+    compile_block(c, node->as.try_expr.try_block, true, false);
+    emit_op(c, OP_TRY_END, 0);
+    size_t try_done = emit_jump(c, OP_JUMP, 0);
+
+    patch_jump(c, to_catch);
+    c->depth = depth + 1;
+    size_t catch_done = 0;
+    if (catch_block) {
+        if (named) {
+            emit_op_arg(c, OP_PUSH_SCOPE, 1, 0);
+            emit_op_arg(c, OP_SET_LOCAL, 0, 0);
+        }
+        emit_op(c, OP_POP, -1);
+        size_t to_fin_exc = 0;
+        if (finally_block) {
+            to_fin_exc = emit_jump(c, OP_TRY_BEGIN, 0);
+        }
+        compile_block(c, catch_block, true, false);
+        if (finally_block) {
+            emit_op(c, OP_TRY_END, 0);
+        }
+        if (named) {
+            emit_op(c, OP_POP_SCOPE, 0);
+        }
+        catch_done = emit_jump(c, OP_JUMP, 0);
+        if (finally_block) {
+            patch_jump(c, to_fin_exc);
+            c->depth = depth + 1;
+            if (named) {
+                emit_op(c, OP_POP_SCOPE, 0);
+            }
+        }
+    }
+    if (finally_block || !catch_block) {
+        if (finally_block) {
+            compile_finally(c, finally_block);
+        }
+        emit_op(c, OP_THROW, -1);
+    }
+
+    patch_jump(c, try_done);
+    if (catch_block) {
+        patch_jump(c, catch_done);
+    }
+    c->depth = depth + 1;
+    if (finally_block) {
+        compile_finally(c, finally_block);
+    }
+}
+
+static void compile_table(Compiler *c, Node *node) {
+    TableLiteral *items = &node->as.table.items;
+    uint32_t key_count = 0;
+    for (size_t i = 0; i < items->count; i++) {
+        if (strcmp(items->keys[i], "proto") != 0) {
+            key_count++;
+        }
+    }
+    emit_op_arg(c, OP_NEW_TABLE, key_count, 1);
+    for (size_t i = 0; i < items->count; i++) {
+        compile_node(c, items->values[i]);
+        if (strcmp(items->keys[i], "proto") == 0) {
+            emit_op(c, OP_INIT_PROTO, -1);
+        } else {
+            emit_op_arg(c, OP_INIT_FIELD, add_name(c, items->keys[i]), -1);
+        }
+    }
+}
+
+static void compile_node(Compiler *c, Node *node) {
+    switch (node->type) {
+    case NODE_LITERAL:
+        emit_op_arg(c, OP_CONST, add_const(c, node->as.literal), 1);
+        return;
+    case NODE_VAR:
+        compile_get_var(c, node);
+        return;
+    case NODE_ASSIGN:
+        compile_assign(c, node);
+        return;
+    case NODE_BINARY:
+        compile_node(c, node->as.binary.left);
+        compile_node(c, node->as.binary.right);
+        emit_op(c, binary_opcode(node->as.binary.op), -1);
+        return;
+    case NODE_UNARY:
+        compile_node(c, node->as.unary.expr);
+        emit_op(c, node->as.unary.op == UNARY_NOT ? OP_NOT : OP_NEG, 0);
+        return;
+    case NODE_CALL:
+        compile_call(c, node, false);
+        return;
+    case NODE_DOT:
+        compile_node(c, node->as.dot.object);
+        emit_op_arg(c, OP_GET_FIELD, add_name(c, node->as.dot.name), 0);
+        emit(c, add_ic(c));
+        return;
+    case NODE_INDEX:
+        compile_node(c, node->as.index.object);
+        compile_node(c, node->as.index.index);
+        emit_op(c, OP_GET_INDEX, -1);
+        return;
+    case NODE_IF:
+        compile_if(c, node, false);
+        return;
+    case NODE_FN: {
+        c->proto->captures_env = true;
+        Proto *child = compile_function(node, c->proto->module_dir);
+        emit_op_arg(c, OP_CLOSURE, add_proto(c, child), 1);
+        return;
+    }
+    case NODE_IMPORT:
+        c->proto->captures_env = true;
+        emit_op_arg(c, OP_IMPORT, add_name(c, node->as.import_stmt.path), 1);
+        emit_op_arg(c, OP_SET_LOCAL, (uint32_t)node->as.import_stmt.slot, 0);
+        return;
+    case NODE_MUTATE:
+        compile_node(c, node->as.mutate.target);
+        emit_op(c, OP_MUTATE_BEGIN, -1);
+        compile_block(c, node->as.mutate.body, true, false);
+        emit_op(c, OP_MUTATE_END, 0);
+        return;
+    case NODE_UNDEFINE:
+        compile_undefine(c, node);
+        return;
+    case NODE_TRY:
+        compile_try(c, node);
+        return;
+    case NODE_THROW:
+        compile_node(c, node->as.throw_expr.expr);
+        emit_op(c, OP_THROW, 0);
+        return;
+    case NODE_TABLE:
+        compile_table(c, node);
+        return;
+    case NODE_BLOCK:
+        compile_block(c, node, false, false);
+        return;
+    }
+    runtime_fatal("unknown node");
+}
+
+/* Parameters and body locals share the call's environment. */
+static Proto *compile_function(Node *node, const char *module_dir) {
+    Compiler c;
+    c.proto = proto_new(module_dir);
+    c.depth = 0;
+    c.proto->arity = (int)node->as.fn.params.count;
+    c.proto->slot_count = node->as.fn.slots;
+    compile_block(&c, node->as.fn.body, false, true);
+    emit_op(&c, OP_RETURN, -1);
+    return c.proto;
+}
+
+static Proto *compile_program(Node *program, const char *module_dir) {
+    Compiler c;
+    c.proto = proto_new(module_dir);
+    c.depth = 0;
+    fold_node(program);
+    resolve_program(program);
+    c.proto->slot_count = program->as.block.slots;
+    compile_block(&c, program, false, true);
+    emit_op(&c, OP_RETURN, -1);
+    return c.proto;
+}
+
+/*
+ * Compiled-module cache. The bytecode compiled from foo.plx is kept in
+ * foo.plxc next to it, so later runs skip lexing, parsing, resolving and
+ * compiling. The file starts with a header naming the cache format and the
+ * interpreter build, the length and FNV-1a hash of the source it was
+ * compiled from, and the hash of the bytecode that follows. Any mismatch,
+ * a short or malformed file, or bytecode that fails the checks below means
+ * the source is compiled as usual and the cache rewritten. Writes go to a
+ * temporary file that is renamed into place, so concurrent runs never read
+ * half a cache. --no-cache turns all of this off.
+ */
+#define PLXC_FORMAT 1
+#define PLXC_MAX_DEPTH 256
+
+static size_t root_env_size(void);
+
+typedef struct {
+    char magic[4];
+    uint32_t format;
+    char build[24]; /* __DATE__ " " __TIME__ of this interpreter */
+    uint64_t source_len;
+    uint64_t source_hash;
+    uint64_t body_hash;
+} PlxcHeader;
+
+enum {
+    PLXC_INT,
+    PLXC_STRING,
+    PLXC_BITS /* floats and specials, stored as their Value bits */
+};
+
+static bool g_module_cache = true;
+
+static void plxc_header(PlxcHeader *h, size_t source_len, uint64_t source_hash) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, "PLXC", 4);
+    h->format = PLXC_FORMAT;
+    snprintf(h->build, sizeof(h->build), "%s %s", __DATE__, __TIME__);
+    h->source_len = source_len;
+    h->source_hash = source_hash;
+}
+
+static uint64_t plxc_hash(const void *data, size_t len) {
+    const uint8_t *bytes = data;
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= bytes[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+/* foo.plx -> foo.plxc; other names get .plxc appended. */
+static char *plxc_path(const char *path) {
+    size_t len = strlen(path);
+    bool plx = len >= 4 && strcmp(path + len - 4, ".plx") == 0;
+    char *out = xmalloc(len + 6);
+    snprintf(out, len + 6, plx ? "%sc" : "%s.plxc", path);
+    return out;
+}
+
+typedef struct {
+    uint8_t *bytes;
+    size_t len;
+    size_t cap;
+} PlxcWriter;
+
+static void plxc_write(PlxcWriter *w, const void *data, size_t n) {
+    if (w->len + n > w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 4096;
+        while (cap < w->len + n) {
+            cap *= 2;
+        }
+        w->bytes = realloc(w->bytes, cap);
+        if (!w->bytes) {
+            runtime_fatal("out of memory");
+        }
+        w->cap = cap;
+    }
+    memcpy(w->bytes + w->len, data, n);
+    w->len += n;
+}
+
+static void plxc_write_u32(PlxcWriter *w, uint32_t v) {
+    plxc_write(w, &v, sizeof(v));
+}
+
+static void plxc_write_proto(PlxcWriter *w, const Proto *proto) {
+    plxc_write_u32(w, (uint32_t)proto->arity);
+    plxc_write_u32(w, (uint32_t)proto->slot_count);
+    plxc_write_u32(w, (uint32_t)proto->max_stack);
+    plxc_write_u32(w, proto->captures_env);
+    plxc_write_u32(w, (uint32_t)proto->code_len);
+    plxc_write_u32(w, (uint32_t)proto->const_count);
+    plxc_write_u32(w, (uint32_t)proto->proto_count);
+    plxc_write_u32(w, (uint32_t)proto->ic_count);
+    plxc_write(w, proto->code, proto->code_len * sizeof(uint32_t));
+    for (size_t i = 0; i < proto->const_count; i++) {
+        Value v = proto->consts[i];
+        if (value_type(v) == VAL_INT) {
+            int64_t n = as_int(v);
+            plxc_write_u32(w, PLXC_INT);
+            plxc_write(w, &n, sizeof(n));
+        } else if (value_type(v) == VAL_STRING) {
+            String *str = as_string(v);
+            plxc_write_u32(w, PLXC_STRING);
+            plxc_write_u32(w, (uint32_t)str->len);
+            plxc_write(w, str->data, str->len);
+        } else {
+            plxc_write_u32(w, PLXC_BITS);
+            plxc_write(w, &v.bits, sizeof(v.bits));
+        }
+    }
+    for (size_t i = 0; i < proto->proto_count; i++) {
+        plxc_write_proto(w, proto->protos[i]);
+    }
+}
+
+static void plxc_store(const char *cache_path, PlxcHeader *header, const Proto *proto) {
+    PlxcWriter w = {NULL, 0, 0};
+    plxc_write_proto(&w, proto);
+    header->body_hash = plxc_hash(w.bytes, w.len);
+    size_t tmp_size = strlen(cache_path) + 32;
+    char *tmp = xmalloc(tmp_size);
+    snprintf(tmp, tmp_size, "%s.%ld.tmp", cache_path, (long)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (f) {
+        bool ok = fwrite(header, 1, sizeof(*header), f) == sizeof(*header) && fwrite(w.bytes, 1, w.len, f) == w.len;
+        if (fclose(f) != 0 || !ok || rename(tmp, cache_path) != 0) {
+            remove(tmp);
+        }
+    }
+    free(tmp);
+    free(w.bytes);
+}
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+} PlxcReader;
+
+static bool plxc_read(PlxcReader *r, void *out, size_t n) {
+    if ((size_t)(r->end - r->p) < n) {
+        return false;
+    }
+    memcpy(out, r->p, n);
+    r->p += n;
+    return true;
+}
+
+static bool plxc_read_u32(PlxcReader *r, uint32_t *out) {
+    return plxc_read(r, out, sizeof(*out));
+}
+
+/* NULL on malformed input; the caller drops the protos read so far. */
+static Proto *plxc_read_proto(PlxcReader *r, const char *module_dir, int depth) {
+    uint32_t f[8];
+    for (int i = 0; i < 8; i++) {
+        if (!plxc_read_u32(r, &f[i])) {
+            return NULL;
+        }
+    }
+    size_t remaining = (size_t)(r->end - r->p);
+    if (depth > PLXC_MAX_DEPTH || f[4] > remaining / sizeof(uint32_t) || f[5] > remaining ||
+        f[6] > remaining || f[7] > remaining) {
+        return NULL;
+    }
+    Proto *proto = proto_new(module_dir);
+    proto->arity = (int)f[0];
+    proto->slot_count = (int)f[1];
+    proto->max_stack = (int)f[2];
+    proto->captures_env = f[3] != 0;
+    proto->code = xmalloc((f[4] ? f[4] : 1) * sizeof(uint32_t));
+    proto->code_cap = f[4];
+    if (!plxc_read(r, proto->code, f[4] * sizeof(uint32_t))) {
+        return NULL;
+    }
+    proto->code_len = f[4];
+    proto->consts = xmalloc((f[5] ? f[5] : 1) * sizeof(Value));
+    proto->const_cap = f[5];
+    for (uint32_t i = 0; i < f[5]; i++) {
+        uint32_t kind;
+        Value v;
+        if (!plxc_read_u32(r, &kind)) {
+            return NULL;
+        }
+        if (kind == PLXC_INT) {
+            int64_t n;
+            if (!plxc_read(r, &n, sizeof(n))) {
+                return NULL;
+            }
+            v = make_int(n);
+        } else if (kind == PLXC_STRING) {
+            uint32_t len;
+            if (!plxc_read_u32(r, &len) || len > (size_t)(r->end - r->p)) {
+                return NULL;
+            }
+            v = make_interned_string((const char *)r->p, len);
+            r->p += len;
+        } else if (kind == PLXC_BITS) {
+            /* Only floats and the four language constants; internal markers
+               such as VALUE_UNBOUND never appear in a constant pool. */
+            if (!plxc_read(r, &v.bits, sizeof(v.bits)) ||
+                (value_is_tagged(v) && v.bits != VALUE_SPECIAL_BITS(VALUE_NULL) &&
+                 v.bits != VALUE_SPECIAL_BITS(VALUE_FALSE) && v.bits != VALUE_SPECIAL_BITS(VALUE_TRUE) &&
+                 v.bits != VALUE_SPECIAL_BITS(VALUE_UNDEFINED))) {
+                return NULL;
+            }
+        } else {
+            return NULL;
+        }
+        proto->consts[proto->const_count++] = v;
+    }
+    proto->protos = xmalloc((f[6] ? f[6] : 1) * sizeof(Proto *));
+    proto->proto_cap = f[6];
+    for (uint32_t i = 0; i < f[6]; i++) {
+        Proto *child = plxc_read_proto(r, module_dir, depth + 1);
+        if (!child) {
+            return NULL;
+        }
+        proto->protos[proto->proto_count++] = child;
+    }
+    if (f[7]) {
+        proto->ics = xmalloc(f[7] * sizeof(InlineCache));
+        memset(proto->ics, 0, f[7] * sizeof(InlineCache));
+    }
+    proto->ic_count = f[7];
+    proto->ic_cap = f[7];
+    return proto;
+}
+
+/*
+ * Checking loaded bytecode. A cache file is only as trustworthy as the
+ * directory it sits in, so a loaded proto is checked before it can run.
+ * Every instruction reachable from the entry is given the stack depth,
+ * open block scopes and open handlers it runs with, and all paths into an
+ * instruction must agree on them. Operands must name an existing constant,
+ * proto, inline cache, env slot or instruction start; the stack must stay
+ * within max_stack; handlers must close in the order they opened. Table
+ * literals are tracked as well, since INIT_FIELD and INIT_PROTO trust the
+ * slot under them to hold the table NEW_TABLE pushed. A closure's proto is
+ * checked against the envs open where it is created. Anything that fails
+ * sends the source back to the compiler.
+ */
+#define PLXC_MAX_SLOTS (1 << 16)
+#define PLXC_MAX_STACK (1 << 16)
+
+enum { PLXC_TRY, PLXC_MUTATE, PLXC_FINALLY };
+
+typedef struct {
+    int depth;
+    uint32_t scope_count;
+    uint32_t handler_count;
+    uint32_t table_count;
+    uint32_t scopes[PLXC_MAX_DEPTH];   /* sizes of open block scopes, innermost last */
+    uint32_t handlers[PLXC_MAX_DEPTH]; /* kinds of open handlers */
+    uint32_t tables[PLXC_MAX_DEPTH];   /* stack slots holding a NEW_TABLE result */
+} PlxcFlow;
+
+/* The flow recorded for one code offset; its lists sit back to back in the pool. */
+typedef struct {
+    int depth; /* -1 until reached */
+    uint32_t scope_count;
+    uint32_t handler_count;
+    uint32_t table_count;
+    size_t at;
+} PlxcMark;
+
+/* A closure to check once its parent is done, with the envs around it. */
+typedef struct {
+    Proto *proto;
+    uint32_t *outer;
+    size_t outer_count;
+} PlxcChild;
+
+typedef struct {
+    Proto *proto;
+    const uint32_t *outer; /* sizes of the envs around the proto's own, innermost first */
+    size_t outer_count;
+    bool *starts;
+    PlxcMark *marks;
+    uint32_t *pool;
+    size_t pool_len;
+    size_t pool_cap;
+    uint32_t *work;
+    size_t work_count;
+    PlxcChild *children;
+    size_t child_count;
+    size_t child_cap;
+} PlxcCheck;
+
+static void plxc_pool_add(PlxcCheck *c, const uint32_t *items, uint32_t count) {
+    if (c->pool_len + count > c->pool_cap) {
+        size_t cap = c->pool_cap * 2;
+        while (cap < c->pool_len + count) {
+            cap *= 2;
+        }
+        c->pool = realloc(c->pool, cap * sizeof(uint32_t));
+        if (!c->pool) {
+            runtime_fatal("out of memory");
+        }
+        c->pool_cap = cap;
+    }
+    memcpy(c->pool + c->pool_len, items, count * sizeof(uint32_t));
+    c->pool_len += count;
+}
+
+/* Records that f reaches target; false if it is not an instruction or disagrees with an earlier path. */
+static bool plxc_flow_to(PlxcCheck *c, uint32_t target, const PlxcFlow *f) {
+    if (target >= c->proto->code_len || !c->starts[target]) {
+        return false;
+    }
+    PlxcMark *m = &c->marks[target];
+    if (m->depth >= 0) {
+        const uint32_t *p = c->pool + m->at;
+        return m->depth == f->depth && m->scope_count == f->scope_count &&
+               m->handler_count == f->handler_count && m->table_count == f->table_count &&
+               memcmp(p, f->scopes, f->scope_count * sizeof(uint32_t)) == 0 &&
+               memcmp(p + f->scope_count, f->handlers, f->handler_count * sizeof(uint32_t)) == 0 &&
+               memcmp(p + f->scope_count + f->handler_count, f->tables, f->table_count * sizeof(uint32_t)) == 0;
+    }
+    m->depth = f->depth;
+    m->scope_count = f->scope_count;
+    m->handler_count = f->handler_count;
+    m->table_count = f->table_count;
+    m->at = c->pool_len;
+    plxc_pool_add(c, f->scopes, f->scope_count);
+    plxc_pool_add(c, f->handlers, f->handler_count);
+    plxc_pool_add(c, f->tables, f->table_count);
+    c->work[c->work_count++] = target;
+    return true;
+}
+
+static void plxc_flow_load(const PlxcCheck *c, uint32_t offset, PlxcFlow *f) {
+    const PlxcMark *m = &c->marks[offset];
+    const uint32_t *p = c->pool + m->at;
+    f->depth = m->depth;
+    f->scope_count = m->scope_count;
+    f->handler_count = m->handler_count;
+    f->table_count = m->table_count;
+    memcpy(f->scopes, p, m->scope_count * sizeof(uint32_t));
+    memcpy(f->handlers, p + m->scope_count, m->handler_count * sizeof(uint32_t));
+    memcpy(f->tables, p + m->scope_count + m->handler_count, m->table_count * sizeof(uint32_t));
+}
+
+/* Pops n values, forgetting any table literal among them. */
+static bool plxc_pop(PlxcFlow *f, uint32_t n) {
+    if ((uint32_t)f->depth < n) {
+        return false;
+    }
+    f->depth -= (int)n;
+    while (f->table_count > 0 && f->tables[f->table_count - 1] >= (uint32_t)f->depth) {
+        f->table_count--;
+    }
+    return true;
+}
+
+/* True if stack slot `slot` holds a table literal; the value above it may be one too. */
+static bool plxc_literal_at(const PlxcFlow *f, int slot) {
+    for (uint32_t i = f->table_count; i-- > 0 && (int)f->tables[i] >= slot;) {
+        if ((int)f->tables[i] == slot) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool plxc_push(PlxcCheck *c, PlxcFlow *f) {
+    return ++f->depth <= c->proto->max_stack;
+}
+
+/* The size of the env `depth` levels out from the current one. */
+static bool plxc_env_size(const PlxcCheck *c, const PlxcFlow *f, uint32_t depth, uint32_t *out) {
+    if (depth < f->scope_count) {
+        *out = f->scopes[f->scope_count - 1 - depth];
+    } else if (depth == f->scope_count) {
+        *out = (uint32_t)c->proto->slot_count;
+    } else if (depth - f->scope_count - 1 < c->outer_count) {
+        *out = c->outer[depth - f->scope_count - 1];
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool plxc_slot_ok(const PlxcCheck *c, const PlxcFlow *f, uint32_t depth, uint32_t slot) {
+    uint32_t size;
+    return plxc_env_size(c, f, depth, &size) && slot < size;
+}
+
+static bool plxc_name_ok(const PlxcCheck *c, uint32_t index) {
+    return index < c->proto->const_count && value_type(c->proto->consts[index]) == VAL_STRING;
+}
+
+static bool plxc_handler_close(PlxcFlow *f, uint32_t kind) {
+    if (f->handler_count == 0 || f->handlers[f->handler_count - 1] != kind) {
+        return false;
+    }
+    f->handler_count--;
+    return true;
+}
+
+static bool plxc_handler_open(PlxcFlow *f, uint32_t kind) {
+    if (f->handler_count == PLXC_MAX_DEPTH) {
+        return false;
+    }
+    f->handlers[f->handler_count++] = kind;
+    return true;
+}
+
+static bool plxc_add_child(PlxcCheck *c, const PlxcFlow *f, uint32_t index) {
+    if (!c->proto->captures_env) {
+        return false;
+    }
+    if (c->child_count == c->child_cap) {
+        c->child_cap = c->child_cap ? c->child_cap * 2 : 8;
+        c->children = realloc(c->children, c->child_cap * sizeof(PlxcChild));
+        if (!c->children) {
+            runtime_fatal("out of memory");
+        }
+    }
+    /* The compiler creates each closure at one place only. */
+    for (size_t i = 0; i < c->child_count; i++) {
+        if (c->children[i].proto == c->proto->protos[index]) {
+            return false;
+        }
+    }
+    PlxcChild *child = &c->children[c->child_count++];
+    child->proto = c->proto->protos[index];
+    child->outer_count = f->scope_count + 1 + c->outer_count;
+    child->outer = xmalloc(child->outer_count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < f->scope_count; i++) {
+        child->outer[i] = f->scopes[f->scope_count - 1 - i];
+    }
+    child->outer[f->scope_count] = (uint32_t)c->proto->slot_count;
+    memcpy(child->outer + f->scope_count + 1, c->outer, c->outer_count * sizeof(uint32_t));
+    return true;
+}
+
+/* Checks one instruction reached with flow f and passes f on to where it goes next. */
+static bool plxc_check_step(PlxcCheck *c, uint32_t offset, PlxcFlow *f, PlxcFlow *scratch) {
+    const Proto *proto = c->proto;
+    const uint32_t *ip = proto->code + offset;
+    OpCode op = (OpCode)ip[0];
+    uint32_t next = offset + 1 + (uint32_t)op_operand_count(op);
+    switch (op) {
+    case OP_CONST:
+        if (ip[1] >= proto->const_count || !plxc_push(c, f)) {
+            return false;
+        }
+        break;
+    case OP_NULL:
+        if (!plxc_push(c, f)) {
+            return false;
+        }
+        break;
+    case OP_POP:
+    case OP_JUMP_IF_FALSE:
+        if (!plxc_pop(f, 1)) {
+            return false;
+        }
+        if (op == OP_JUMP_IF_FALSE && !plxc_flow_to(c, ip[1], f)) {
+            return false;
+        }
+        break;
+    case OP_GET_LOCAL:
+        if (!plxc_slot_ok(c, f, 0, ip[1]) || !plxc_push(c, f)) {
+            return false;
+        }
+        break;
+    case OP_SET_LOCAL:
+        if (!plxc_slot_ok(c, f, 0, ip[1]) || f->depth < 1) {
+            return false;
+        }
+        break;
+    case OP_GET_VAR:
+        if (!plxc_slot_ok(c, f, ip[1], ip[2]) || !plxc_push(c, f)) {
+            return false;
+        }
+        break;
+    case OP_SET_VAR:
+        if (!plxc_slot_ok(c, f, ip[1], ip[2]) || f->depth < 1) {
+            return false;
+        }
+        break;
+    case OP_CHECK_ASSIGN:
+    case OP_UNDEFINE_PROTO:
+        if (f->depth < 1) {
+            return false;
+        }
+        break;
+    case OP_PUSH_SCOPE:
+        if (ip[1] > PLXC_MAX_SLOTS || f->scope_count == PLXC_MAX_DEPTH) {
+            return false;
+        }
+        f->scopes[f->scope_count++] = ip[1];
+        break;
+    case OP_POP_SCOPE:
+        if (f->scope_count == 0) {
+            return false;
+        }
+        f->scope_count--;
+        break;
+    case OP_GET_FIELD:
+    case OP_UNDEFINE_FIELD:
+        if (!plxc_name_ok(c, ip[1]) || (op == OP_GET_FIELD && ip[2] >= proto->ic_count) ||
+            !plxc_pop(f, 1) || !plxc_push(c, f)) {
+            return false;
+        }
+        break;
+    case OP_SET_FIELD:
+        if (!plxc_name_ok(c, ip[1]) || ip[2] >= proto->ic_count || f->depth < 2 || !plxc_pop(f, 1)) {
+            return false;
+        }
+        break;
+    case OP_SET_PROTO:
+        if (f->depth < 2 || !plxc_pop(f, 1)) {
+            return false;
+        }
+        break;
+    case OP_SET_INDEX:
+        if (f->depth < 3 || !plxc_pop(f, 2)) {
+            return false;
+        }
+        break;
+    case OP_GET_INDEX:
+    case OP_UNDEFINE_INDEX:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_EQ:
+    case OP_NE:
+    case OP_LT:
+    case OP_LE:
+    case OP_GT:
+    case OP_GE:
+    case OP_AND:
+    case OP_OR:
+        if (!plxc_pop(f, 2) || !plxc_push(c, f)) {
+            return false;
+        }
+        break;
+    case OP_NOT:
+    case OP_NEG:
+        if (!plxc_pop(f, 1) || !plxc_push(c, f)) {
+            return false;
+        }
+        break;
+    case OP_NEW_TABLE:
+        if (ip[1] > proto->code_len || f->table_count == PLXC_MAX_DEPTH) {
+            return false;
+        }
+        f->tables[f->table_count++] = (uint32_t)f->depth;
+        if (!plxc_push(c, f)) {
+            return false;
+        }
+        break;
+    case OP_INIT_FIELD:
+    case OP_INIT_PROTO:
+        if ((op == OP_INIT_FIELD && !plxc_name_ok(c, ip[1])) || !plxc_literal_at(f, f->depth - 2) ||
+            !plxc_pop(f, 1)) {
+            return false;
+        }
+        break;
+    case OP_JUMP:
+        return plxc_flow_to(c, ip[1], f);
+    case OP_CALL:
+        if (ip[1] >= PLXC_MAX_STACK || !plxc_pop(f, ip[1] + 1) || !plxc_push(c, f)) {
+            return false;
+        }
+        break;
+    case OP_TAIL_CALL:
+        return ip[1] < PLXC_MAX_STACK && (uint32_t)f->depth > ip[1] && f->handler_count == 0;
+    case OP_CLOSURE:
+        if (ip[1] >= proto->proto_count || !plxc_add_child(c, f, ip[1]) || !plxc_push(c, f)) {
+            return false;
+        }
+        break;
+    case OP_IMPORT:
+        if (!plxc_name_ok(c, ip[1]) || !proto->captures_env || !plxc_push(c, f)) {
+            return false;
+        }
+        break;
+    case OP_MUTATE_BEGIN:
+        if (!plxc_pop(f, 1) || !plxc_handler_open(f, PLXC_MUTATE)) {
+            return false;
+        }
+        break;
+    case OP_MUTATE_END:
+        if (!plxc_handler_close(f, PLXC_MUTATE)) {
+            return false;
+        }
+        break;
+    case OP_TRY_BEGIN:
+        /* A throw lands on the target with the stack, scopes and handlers of this point, plus the exception. */
+        *scratch = *f;
+        if (!plxc_push(c, scratch) || !plxc_flow_to(c, ip[1], scratch) || !plxc_handler_open(f, PLXC_TRY)) {
+            return false;
+        }
+        break;
+    case OP_TRY_END:
+        if (!plxc_handler_close(f, PLXC_TRY)) {
+            return false;
+        }
+        break;
+    case OP_FINALLY_BEGIN:
+        if (!plxc_handler_open(f, PLXC_FINALLY)) {
+            return false;
+        }
+        break;
+    case OP_FINALLY_END:
+        if (!plxc_handler_close(f, PLXC_FINALLY)) {
+            return false;
+        }
+        break;
+    case OP_THROW:
+        return f->depth >= 1;
+    case OP_THROW_MSG:
+        return ip[1] < proto->const_count;
+    case OP_RETURN:
+        return f->depth >= 1 && f->handler_count == 0;
+    default:
+        return false;
+    }
+    return plxc_flow_to(c, next, f);
+}
+
+static bool plxc_check_proto(Proto *proto, const uint32_t *outer, size_t outer_count) {
+    if (proto->code_len == 0 || proto->arity < 0 || proto->slot_count < proto->arity ||
+        proto->slot_count > PLXC_MAX_SLOTS || proto->max_stack < 0 || proto->max_stack > PLXC_MAX_STACK) {
+        return false;
+    }
+    PlxcCheck c = {0};
+    c.proto = proto;
+    c.outer = outer;
+    c.outer_count = outer_count;
+    c.starts = xmalloc(proto->code_len * sizeof(bool));
+    memset(c.starts, 0, proto->code_len * sizeof(bool));
+    bool ok = true;
+    for (size_t offset = 0; ok && offset < proto->code_len;) {
+        ok = proto->code[offset] < OP_COUNT;
+        if (ok) {
+            c.starts[offset] = true;
+            offset += 1 + op_operand_count((OpCode)proto->code[offset]);
+            ok = offset <= proto->code_len;
+        }
+    }
+    c.marks = xmalloc(proto->code_len * sizeof(PlxcMark));
+    for (size_t i = 0; i < proto->code_len; i++) {
+        c.marks[i].depth = -1;
+    }
+    c.work = xmalloc(proto->code_len * sizeof(uint32_t));
+    c.pool_cap = 256;
+    c.pool = xmalloc(c.pool_cap * sizeof(uint32_t));
+    PlxcFlow *flow = xmalloc(2 * sizeof(PlxcFlow));
+    memset(flow, 0, sizeof(PlxcFlow));
+    ok = ok && plxc_flow_to(&c, 0, flow);
+    while (ok && c.work_count > 0) {
+        uint32_t offset = c.work[--c.work_count];
+        plxc_flow_load(&c, offset, flow);
+        ok = plxc_check_step(&c, offset, flow, flow + 1);
+    }
+    free(flow);
+    free(c.work);
+    free(c.pool);
+    free(c.marks);
+    free(c.starts);
+    for (size_t i = 0; i < c.child_count; i++) {
+        ok = ok && plxc_check_proto(c.children[i].proto, c.children[i].outer, c.children[i].outer_count);
+        free(c.children[i].outer);
+    }
+    free(c.children);
+    return ok;
+}
+
+static Proto *plxc_load(const char *cache_path, const PlxcHeader *expected, const char *module_dir) {
+    FILE *f = fopen(cache_path, "rb");
+    if (!f) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (len < (long)sizeof(PlxcHeader)) {
+        fclose(f);
+        return NULL;
+    }
+    uint8_t *buf = xmalloc((size_t)len);
+    size_t got = fread(buf, 1, (size_t)len, f);
+    fclose(f);
+    Proto *proto = NULL;
+    PlxcHeader header;
+    memcpy(&header, buf, sizeof(header));
+    uint64_t body_hash = header.body_hash;
+    header.body_hash = 0;
+    if (got == (size_t)len && memcmp(&header, expected, sizeof(header)) == 0 &&
+        body_hash == plxc_hash(buf + sizeof(header), (size_t)len - sizeof(header))) {
+        PlxcReader r = {buf + sizeof(PlxcHeader), buf + len};
+        size_t mark = g_proto_count;
+        proto = plxc_read_proto(&r, module_dir, 0);
+        uint32_t root = (uint32_t)root_env_size();
+        if (!proto || r.p != r.end || !plxc_check_proto(proto, &root, 1)) {
+            proto_drop_since(mark);
+            proto = NULL;
+        }
+    }
+    free(buf);
+    return proto;
+}
+
+/* Compiles the program src read from path, through its .plxc cache. */
+static Proto *compile_source(const char *path, const char *src, const char *module_dir) {
+    size_t len = strlen(src);
+    PlxcHeader header;
+    char *cache_path = NULL;
+    if (g_module_cache) {
+        plxc_header(&header, len, plxc_hash(src, len));
+        cache_path = plxc_path(path);
+        Proto *cached = plxc_load(cache_path, &header, module_dir);
+        if (cached) {
+            free(cache_path);
+            return cached;
+        }
+    }
+    TokenList tokens = lex_source(src);
+    Parser parser;
+    parser.tokens = tokens;
+    parser.current = 0;
+    set_parse_context(&parser, path);
+    Node *program = parse_program(&parser);
+    clear_parse_context();
+    Proto *proto = compile_program(program, module_dir);
+    if (cache_path) {
+        plxc_store(cache_path, &header, proto);
+        free(cache_path);
+    }
+    return proto;
+}
+
+/*
+ * Module registry. Each file is compiled and evaluated once per process,
+ * keyed by its canonical path; later imports get the value its first run
+ * produced. A module imported again while its own run is still on the
+ * frame stack is an import cycle.
+ */
+typedef struct Module {
+    char *path;
+    Proto *proto;
+    Value value;
+    bool loaded;
+} Module;
+
+static Module **g_modules = NULL;
+static size_t g_module_count = 0;
+static size_t g_module_capacity = 0;
+
+static Module *module_find(const char *path) {
+    for (size_t i = 0; i < g_module_count; i++) {
+        if (strcmp(g_modules[i]->path, path) == 0) {
+            return g_modules[i];
+        }
+    }
+    return NULL;
+}
+
+static Module *module_add(char *path, Proto *proto) {
+    if (g_module_count == g_module_capacity) {
+        size_t cap = g_module_capacity ? g_module_capacity * 2 : 16;
+        g_modules = realloc(g_modules, cap * sizeof(Module *));
+        if (!g_modules) {
+            runtime_fatal("out of memory");
+        }
+        g_module_capacity = cap;
+    }
+    Module *module = xmalloc(sizeof(Module));
+    module->path = path;
+    module->proto = proto;
+    module->value = make_null();
+    module->loaded = false;
+    g_modules[g_module_count++] = module;
+    return module;
+}
+
+/* The registry entry for path, compiling the file on first use; NULL if it cannot be opened. */
+static Module *load_module(const char *path, const char *module_dir) {
+    char full[1024];
+    FILE *f = try_open_module(path, module_dir, full, sizeof(full));
+    if (!f) {
+        return NULL;
+    }
+    char *canonical = realpath(full, NULL);
+    if (!canonical) {
+        canonical = xstrndup(full, strlen(full));
+    }
+    Module *cached = module_find(canonical);
+    if (cached) {
+        free(canonical);
+        fclose(f);
+        return cached;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *src = xmalloc(len + 1);
+    fread(src, 1, len, f);
+    src[len] = '\0';
+    fclose(f);
+
+    char *dir = NULL;
+    char *slash = strrchr(full, '/');
+    if (slash) {
+        dir = xstrndup(full, (size_t)(slash - full));
+    }
+    return module_add(canonical, compile_source(full, src, dir));
+}
+
+static EvalResult binary_op(OpCode op, Value left, Value right) {
+    switch (op) {
+    case OP_ADD:
+        if (value_type(left) == VAL_STRING && value_type(right) == VAL_STRING) {
+            /* A rope only costs its length once flattened; refuse one that never could fit. */
+            if (g_heap.limit && string_value_len(left) + string_value_len(right) > g_heap.limit) {
+                return error_msg("out of memory");
+            }
+            return ok(string_concat(left, right));
+        }
+        if (!value_is_number(left) || !value_is_number(right)) {
+            return error_msg("non-numeric '+'");
+        }
+        if (value_type(left) == VAL_FLOAT || value_type(right) == VAL_FLOAT) {
+            return ok(make_float(value_as_double(left) + value_as_double(right)));
+        }
+        return ok(make_int(as_int(left) + as_int(right)));
+    case OP_SUB:
+        if (!value_is_number(left) || !value_is_number(right)) {
+            return error_msg("non-numeric '-'");
+        }
+        if (value_type(left) == VAL_FLOAT || value_type(right) == VAL_FLOAT) {
+            return ok(make_float(value_as_double(left) - value_as_double(right)));
+        }
+        return ok(make_int(as_int(left) - as_int(right)));
+    case OP_MUL:
+        if (!value_is_number(left) || !value_is_number(right)) {
+            return error_msg("non-numeric '*'");
+        }
+        if (value_type(left) == VAL_FLOAT || value_type(right) == VAL_FLOAT) {
+            return ok(make_float(value_as_double(left) * value_as_double(right)));
+        }
+        return ok(make_int(as_int(left) * as_int(right)));
+    case OP_DIV:
+        if (!value_is_number(left) || !value_is_number(right)) {
+            return error_msg("non-numeric '/'");
+        }
+        if (value_type(left) == VAL_FLOAT || value_type(right) == VAL_FLOAT) {
+            return ok(make_float(value_as_double(left) / value_as_double(right)));
+        }
+        if (as_int(right) == 0) {
+            return error_msg("division by zero");
+        }
+        return ok(make_int(as_int(left) / as_int(right)));
+    case OP_EQ:
+        return ok(make_bool(value_equal(left, right)));
+    case OP_NE:
+        return ok(make_bool(!value_equal(left, right)));
+    case OP_LT:
+        if (!value_is_number(left) || !value_is_number(right)) {
+            return error_msg("non-numeric '<'");
+        }
+        if (value_type(left) == VAL_INT && value_type(right) == VAL_INT) {
+            return ok(make_bool(as_int(left) < as_int(right)));
+        }
+        return ok(make_bool(value_as_double(left) < value_as_double(right)));
+    case OP_LE:
         if (!value_is_number(left) || !value_is_number(right)) {
             return error_msg("non-numeric '<='");
         }
-        return ok(make_bool(value_as_double(left) <= value_as_double(right)));
+        if (value_type(left) == VAL_INT && value_type(right) == VAL_INT) {
+            return ok(make_bool(as_int(left) <= as_int(right)));
+        }
+        return ok(make_bool(value_as_double(left) <= value_as_double(right)));
+    case OP_GT:
+        if (!value_is_number(left) || !value_is_number(right)) {
+            return error_msg("non-numeric '>'");
+        }
+        if (value_type(left) == VAL_INT && value_type(right) == VAL_INT) {
+            return ok(make_bool(as_int(left) > as_int(right)));
+        }
+        return ok(make_bool(value_as_double(left) > value_as_double(right)));
+    case OP_GE:
+        if (!value_is_number(left) || !value_is_number(right)) {
+            return error_msg("non-numeric '>='");
+        }
+        if (value_type(left) == VAL_INT && value_type(right) == VAL_INT) {
+            return ok(make_bool(as_int(left) >= as_int(right)));
+        }
+        return ok(make_bool(value_as_double(left) >= value_as_double(right)));
+    case OP_AND:
+        return ok(make_bool(value_is_truthy(left) && value_is_truthy(right)));
+    case OP_OR:
+        return ok(make_bool(value_is_truthy(left) || value_is_truthy(right)));
+    default:
+        break;
+    }
+    return error_msg("unknown binary op");
+}
+
+/*
+ * VM.
+ *
+ * A single value stack and call-frame stack shared by every activation.
+ * Protolex-to-Protolex calls push a frame instead of recursing in C; the
+ * C stack only grows when a native calls back into Protolex through
+ * call_function. Such re-entries push a boundary frame, and vm_run returns
+ * when that frame returns or when an exception escapes it.
+ *
+ * Envs of functions that never let them escape (no closures, no imports)
+ * live on a separate env stack and are popped with their frame, so such
+ * calls do not touch malloc at all.
+ */
+
+#define VM_STACK_MAX (1 << 20)
+#define VM_FRAMES_MAX (1 << 17)
+#define VM_ENV_STACK_MAX (1 << 20) /* in Values */
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(PROTOLEX_NO_COMPUTED_GOTO)
+#define PROTOLEX_COMPUTED_GOTO 1
+#endif
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(PROTOLEX_NO_JIT)
+#define PROTOLEX_JIT 1
+#endif
+
+typedef struct {
+    Proto *proto;
+    uint32_t *ip;
+    Value *base;
+    Env *env;
+    Env *locals; /* the call's own env; NULL for program and module frames */
+    size_t env_mark; /* env stack top when the frame was pushed */
+    bool boundary;
+    Module *module; /* set for a module's top level, which records its value on return */
+} CallFrame;
+
+typedef enum {
+    HANDLER_TRY,
+    HANDLER_MUTATE,
+    HANDLER_FINALLY
+} HandlerKind;
+
+typedef struct {
+    HandlerKind kind;
+    size_t frame_count;
+    Value *sp;
+    Env *env;
+    size_t env_top;
+    uint32_t *target;
+    Table *table;
+} Handler;
+
+typedef struct {
+    Value *stack;
+    Value *sp;
+    CallFrame *frames;
+    size_t frame_count;
+    Value *env_stack;
+    size_t env_top;
+    Handler *handlers;
+    size_t handler_count;
+    size_t handler_capacity;
+} VM;
+
+static VM vm;
+static Env *g_root_env;
+
+static void vm_init(void) {
+    if (vm.stack) {
+        return;
+    }
+    vm.stack = xmalloc(sizeof(Value) * VM_STACK_MAX);
+    vm.sp = vm.stack;
+    vm.frames = xmalloc(sizeof(CallFrame) * VM_FRAMES_MAX);
+    vm.frame_count = 0;
+    vm.env_stack = xmalloc(sizeof(Value) * VM_ENV_STACK_MAX);
+    vm.env_top = 0;
+}
+
+static Handler *vm_push_handler(HandlerKind kind) {
+    if (vm.handler_count == vm.handler_capacity) {
+        size_t cap = vm.handler_capacity ? vm.handler_capacity * 2 : 16;
+        vm.handlers = realloc(vm.handlers, cap * sizeof(Handler));
+        if (!vm.handlers) {
+            runtime_fatal("out of memory");
+        }
+        vm.handler_capacity = cap;
+    }
+    Handler *h = &vm.handlers[vm.handler_count++];
+    h->kind = kind;
+    h->frame_count = vm.frame_count;
+    h->sp = NULL;
+    h->env = NULL;
+    h->env_top = vm.env_top;
+    h->target = NULL;
+    h->table = NULL;
+    return h;
+}
+
+static bool vm_has_room(Proto *proto, Value *sp) {
+    return vm.frame_count < VM_FRAMES_MAX &&
+           sp + proto->max_stack + 1 <= vm.stack + VM_STACK_MAX;
+}
+
+/* Allocates an env on the env stack, or on the heap once that is full. */
+static Env *vm_env_push(Env *parent, size_t size) {
+    size_t words = (sizeof(Env) + sizeof(Value) - 1) / sizeof(Value) + size;
+    if (vm.env_top + words > VM_ENV_STACK_MAX) {
+        return env_new(parent, size);
+    }
+    Env *env = (Env *)(vm.env_stack + vm.env_top);
+    vm.env_top += words;
+    env->parent = parent;
+    env->size = size;
+    for (size_t i = 0; i < size; i++) {
+        env->slots[i] = make_unbound();
+    }
+    return env;
+}
+
+static bool vm_env_on_stack(Env *env) {
+    uintptr_t p = (uintptr_t)env;
+    return p >= (uintptr_t)vm.env_stack &&
+           p < (uintptr_t)(vm.env_stack + VM_ENV_STACK_MAX);
+}
+
+/* Env for a call to proto: on the env stack unless it can be captured. */
+static Env *vm_call_env(Proto *proto, Env *parent) {
+    if (proto->captures_env) {
+        return env_new(parent, (size_t)proto->slot_count);
+    }
+    return vm_env_push(parent, (size_t)proto->slot_count);
+}
+
+/* Block scopes follow their frame; program and module frames use the heap. */
+static Env *vm_scope_env(CallFrame *frame, size_t size) {
+    if (frame->locals && !frame->proto->captures_env) {
+        return vm_env_push(frame->env, size);
+    }
+    return env_new(frame->env, size);
+}
+
+static void vm_bind_args(Env *env, Function *fn, Value *base) {
+    memcpy(env->slots, base + 1, sizeof(Value) * (size_t)fn->arity);
+}
+
+/* Pushes a frame for fn; the callee and its arguments start at base. */
+static void vm_push_frame(Function *fn, Value *base, bool boundary) {
+    size_t env_mark = vm.env_top;
+    Env *env = vm_call_env(fn->proto, fn->env);
+    vm_bind_args(env, fn, base);
+    CallFrame *frame = &vm.frames[vm.frame_count++];
+    frame->proto = fn->proto;
+    frame->ip = fn->proto->code;
+    frame->base = base;
+    frame->env = env;
+    frame->locals = env;
+    frame->env_mark = env_mark;
+    frame->boundary = boundary;
+    frame->module = NULL;
+}
+
+/* A module whose top level is still running; importing it again is a cycle. */
+static bool vm_module_running(Module *module) {
+    for (size_t i = 0; i < vm.frame_count; i++) {
+        if (vm.frames[i].module == module) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static EvalResult call_native(Function *fn, int argc, Value *argv) {
+    EvalResult err;
+    err.is_exception = false;
+    err.value = make_null();
+    Value out = fn->native(argc, argv, &err);
+    if (err.is_exception) {
+        return err;
+    }
+    return ok(out);
+}
+
+/*
+ * Collector.
+ *
+ * A precise, stop-the-world mark-sweep. It only runs at VM safepoints (the
+ * start of a call), where every live value is reachable from the VM: the
+ * value stack, frame and handler envs, the root env, proto constants and the
+ * runtime's own roots (library tables, open files). Natives never reach a
+ * safepoint except through call_function, whose arguments are on the stack.
+ *
+ * A minor collection treats old objects as live without tracing them and
+ * adds the remembered set to the roots; survivors of either kind of
+ * collection are promoted.
+ */
+
+static bool g_gc_minor;
+
+typedef struct {
+    void **items;
+    size_t count;
+    size_t capacity;
+} GcGray;
+
+static GcGray g_gray;
+
+static void gc_push_gray(void *obj) {
+    if (g_gray.count == g_gray.capacity) {
+        size_t cap = g_gray.capacity ? g_gray.capacity * 2 : 256;
+        g_gray.items = realloc(g_gray.items, cap * sizeof(void *));
+        if (!g_gray.items) {
+            runtime_fatal("out of memory");
+        }
+        g_gray.capacity = cap;
+    }
+    g_gray.items[g_gray.count++] = obj;
+}
+
+/* Marks a tracked object; returns false if it needs no tracing. */
+static bool gc_mark_object(void *obj) {
+    GcHeader *h = gc_header(obj);
+    if (h->marked || (g_gc_minor && h->old)) {
+        return false;
+    }
+    h->marked = true;
+    return true;
+}
+
+static void gc_mark_value(Value v) {
+    switch (value_tag(v)) {
+    case VALUE_TAG_STRING:
+        if (value_is_tagged(v) && !as_string(v)->interned) {
+            gc_mark_object(as_string(v));
+        }
+        return;
+    case VALUE_TAG_BIGINT:
+        if (value_is_tagged(v)) {
+            gc_mark_object(value_pointer(v));
+        }
+        return;
+    case VALUE_TAG_TABLE:
+        if (value_is_tagged(v) && gc_mark_object(as_table(v))) {
+            gc_push_gray(gc_header(as_table(v)));
+        }
+        return;
+    case VALUE_TAG_FUNCTION:
+        if (value_is_tagged(v) && !as_function(v)->is_native && gc_mark_object(as_function(v))) {
+            gc_push_gray(gc_header(as_function(v)));
+        }
+        return;
+    case VALUE_TAG_ROPE:
+        if (value_is_tagged(v) && gc_mark_object(value_pointer(v))) {
+            gc_push_gray(gc_header(value_pointer(v)));
+        }
+        return;
+    default:
+        return;
+    }
+}
+
+void gc_mark_table(Table *t) {
+    if (t) {
+        gc_mark_value(make_table(t));
+    }
+}
+
+static void gc_mark_slots(Env *env) {
+    for (size_t i = 0; i < env->size; i++) {
+        gc_mark_value(env->slots[i]);
+    }
+}
+
+/* Env-stack envs carry no header; they are traced each time they are reached. */
+static void gc_mark_env(Env *env) {
+    while (env) {
+        if (!vm_env_on_stack(env) && !gc_mark_object(env)) {
+            return;
+        }
+        gc_mark_slots(env);
+        env = env->parent;
+    }
+}
+
+/* Env-slot write barrier; env-stack envs are always roots. */
+static void gc_env_barrier(Env *env, Value v) {
+    if (!vm_env_on_stack(env)) {
+        gc_barrier(env, v);
+    }
+}
+
+static void gc_trace(GcHeader *h) {
+    if (h->kind == GC_ENV) {
+        gc_mark_slots((Env *)(h + 1));
+    } else if (h->kind == GC_TABLE) {
+        Table *t = (Table *)(h + 1);
+        for (size_t i = 0; i < t->map.capacity; i++) {
+            if (map_slot_live(&t->map, i)) {
+                gc_mark_value(t->map.keys[i]);
+                gc_mark_value(t->map.values[i]);
+            }
+        }
+        for (size_t i = 0; i < t->array_len; i++) {
+            gc_mark_value(t->array[i]);
+        }
+        gc_mark_table(t->proto);
+    } else if (h->kind == GC_FUNCTION) {
+        gc_mark_env(((Function *)(h + 1))->env);
+    } else if (h->kind == GC_ROPE) {
+        Rope *rope = (Rope *)(h + 1);
+        gc_mark_value(rope->left);
+        gc_mark_value(rope->right);
+        if (rope->flat) {
+            gc_mark_object(rope->flat);
+        }
+    }
+}
+
+static void gc_mark_roots(void) {
+    for (Value *v = vm.stack; v < vm.sp; v++) {
+        gc_mark_value(*v);
+    }
+    for (size_t i = 0; i < vm.frame_count; i++) {
+        gc_mark_env(vm.frames[i].env);
+        gc_mark_env(vm.frames[i].locals);
+    }
+    for (size_t i = 0; i < vm.handler_count; i++) {
+        gc_mark_env(vm.handlers[i].env);
+        gc_mark_table(vm.handlers[i].table);
+    }
+    gc_mark_env(g_root_env);
+    for (size_t i = 0; i < g_proto_count; i++) {
+        for (size_t k = 0; k < g_protos[i]->const_count; k++) {
+            gc_mark_value(g_protos[i]->consts[k]);
+        }
+    }
+    for (size_t i = 0; i < g_module_count; i++) {
+        gc_mark_value(g_modules[i]->value);
+    }
+    runtime_mark_roots();
+    if (g_gc_minor) {
+        for (size_t i = 0; i < g_heap.remembered_count; i++) {
+            gc_trace(g_heap.remembered[i]);
+        }
+    }
+}
+
+/* Frees h and its out-of-line storage; returns the bytes released. */
+static size_t gc_free_object(GcHeader *h) {
+    size_t bytes = h->size;
+    heap_release(h->kind, h->size);
+    if (h->kind == GC_TABLE) {
+        Table *t = (Table *)(h + 1);
+        g_chain_version++;
+        bytes += map_bytes(t->map.capacity) + t->array_cap * sizeof(Value);
+        heap_release(GC_ENTRIES, map_bytes(t->map.capacity) + t->array_cap * sizeof(Value));
+        free(t->map.keys);
+        free(t->array);
+    }
+    free(h);
+    return bytes;
+}
+
+/*
+ * Frees the unmarked objects of *list. Survivors are unmarked and, when
+ * promote is set, moved to the old list. Returns the bytes freed.
+ */
+static size_t gc_sweep(GcHeader **list, bool promote) {
+    size_t freed = 0;
+    GcHeader **link = list;
+    while (*link) {
+        GcHeader *h = *link;
+        if (!h->marked) {
+            *link = h->next;
+            freed += gc_free_object(h);
+            continue;
+        }
+        h->marked = false;
+        if (promote) {
+            *link = h->next;
+            h->old = true;
+            h->next = g_heap.old;
+            g_heap.old = h;
+        } else {
+            link = &h->next;
+        }
+    }
+    return freed;
+}
+
+static void gc_drain(void) {
+    while (g_gray.count > 0) {
+        gc_trace(g_gray.items[--g_gray.count]);
+    }
+}
+
+/* Traces until the gray stack is empty or deadline (0 for none) passes; true when empty. */
+static bool gc_drain_until(clock_t deadline) {
+    while (g_gray.count > 0) {
+        for (int i = 0; i < 64 && g_gray.count > 0; i++) {
+            gc_trace(g_gray.items[--g_gray.count]);
+        }
+        if (deadline && clock() >= deadline) {
+            return g_gray.count == 0;
+        }
+    }
+    return true;
+}
+
+static void gc_forget_remembered(void) {
+    /* Every survivor ends up old, so nothing needs remembering afterwards. */
+    for (size_t i = 0; i < g_heap.remembered_count; i++) {
+        g_heap.remembered[i]->remembered = false;
+    }
+    g_heap.remembered_count = 0;
+}
+
+/* Sweeps after marking is complete and resets for the next cycle. */
+static void gc_finish(bool major) {
+    gc_forget_remembered();
+    size_t freed = 0;
+    if (major) {
+        freed += gc_sweep(&g_heap.old, false);
+    }
+    freed += gc_sweep(&g_heap.young, true);
+    if (major) {
+        g_heap.next_major = g_heap.bytes * 2 > GC_MIN_THRESHOLD ? g_heap.bytes * 2 : GC_MIN_THRESHOLD;
+        g_heap.major_collections++;
+    } else {
+        g_heap.minor_collections++;
+    }
+    g_heap.bytes_freed += freed;
+    g_heap.allocated = 0;
+}
+
+static void gc_note_pause(clock_t start) {
+    double ms = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+    g_heap.pause_total_ms += ms;
+    if (ms > g_heap.pause_max_ms) {
+        g_heap.pause_max_ms = ms;
+    }
+}
+
+/* Moves survivors of g_heap.sweeping to the old list until deadline; true when done. */
+static bool gc_sweep_until(clock_t deadline) {
+    size_t freed = 0;
+    bool done = false;
+    while (!done) {
+        for (int i = 0; i < 256 && g_heap.sweeping; i++) {
+            GcHeader *h = g_heap.sweeping;
+            g_heap.sweeping = h->next;
+            if (!h->marked) {
+                freed += gc_free_object(h);
+                continue;
+            }
+            h->marked = false;
+            h->next = g_heap.old;
+            g_heap.old = h;
+        }
+        done = g_heap.sweeping == NULL;
+        if (deadline && clock() >= deadline) {
+            break;
+        }
+    }
+    g_heap.bytes_freed += freed;
+    return done;
+}
+
+/*
+ * One incremental slice of a major collection. Once the gray stack runs
+ * dry the roots are rescanned (they change without barriers) and marking
+ * finishes in that pause; the young generation is swept with it, while the
+ * old one is detached and swept over the following slices.
+ */
+static void gc_major_slice(clock_t deadline) {
+    clock_t start = clock();
+    if (!g_heap.marking && !g_heap.sweeping) {
+        g_gc_minor = false;
+        g_heap.marking = true;
+        gc_mark_roots();
+    }
+    if (g_heap.marking && gc_drain_until(deadline)) {
+        gc_mark_roots();
+        gc_drain();
+        g_heap.marking = false;
+        gc_forget_remembered();
+        g_heap.sweeping = g_heap.old;
+        g_heap.old = NULL;
+        g_heap.bytes_freed += gc_sweep(&g_heap.young, true);
+        g_heap.allocated = 0;
+    }
+    if (!g_heap.marking && gc_sweep_until(deadline)) {
+        g_heap.next_major = g_heap.bytes * 2 > GC_MIN_THRESHOLD ? g_heap.bytes * 2 : GC_MIN_THRESHOLD;
+        g_heap.major_collections++;
+        g_heap.pending = false;
+    }
+    double us = (double)(clock() - start) * 1e6 / CLOCKS_PER_SEC;
+    g_heap.slices++;
+    g_heap.last_slice_us = us;
+    if (us > g_heap.max_slice_us) {
+        g_heap.max_slice_us = us;
+    }
+    gc_note_pause(start);
+}
+
+static void gc_atomic(bool major) {
+    clock_t start = clock();
+    g_gc_minor = !major;
+    gc_mark_roots();
+    gc_drain();
+    gc_finish(major);
+    g_heap.pending = false;
+    gc_note_pause(start);
+}
+
+/* Finishes any incremental major collection, then collects everything. */
+static void gc_full(void) {
+    if (g_heap.marking || g_heap.sweeping) {
+        gc_major_slice(0);
+    }
+    gc_atomic(true);
+}
+
+/*
+ * Runs the pending collection work at a safepoint. Returns false when the
+ * heap is exhausted even after a full collection, and the VM must throw.
+ */
+static bool gc_collect(void) {
+    if (g_heap.exhausted) {
+        gc_full();
+        g_heap.exhausted = false;
+        if (!g_malloc_reserve) {
+            g_malloc_reserve = malloc(MALLOC_RESERVE_BYTES);
+            return false;
+        }
+        return !g_heap.limit || g_heap.bytes <= g_heap.limit;
+    }
+    bool major = g_heap.bytes > g_heap.next_major;
+    if (g_heap.marking || g_heap.sweeping || (major && g_heap.pause_budget_us > 0)) {
+        clock_t budget = (clock_t)((double)g_heap.pause_budget_us * CLOCKS_PER_SEC / 1e6);
+        gc_major_slice(clock() + budget);
+    } else {
+        gc_atomic(major);
+    }
+    return true;
+}
+
+void heap_get_usage(HeapUsage *out) {
+    out->bytes = g_heap.bytes;
+    out->peak = g_heap.peak;
+    out->limit = g_heap.limit;
+    out->tables = g_heap.kind_bytes[GC_TABLE];
+    out->entries = g_heap.kind_bytes[GC_ENTRIES];
+    out->strings = g_heap.kind_bytes[GC_STRING] + g_heap.kind_bytes[GC_ROPE];
+    out->envs = g_heap.kind_bytes[GC_ENV];
+    out->functions = g_heap.kind_bytes[GC_FUNCTION];
+    out->bigints = g_heap.kind_bytes[GC_BIGINT];
+}
+
+void gc_get_stats(GcStats *out) {
+    out->bytes = g_heap.bytes;
+    out->minor_collections = g_heap.minor_collections;
+    out->major_collections = g_heap.major_collections;
+    out->slices = g_heap.slices;
+    out->last_slice_us = g_heap.last_slice_us;
+    out->max_slice_us = g_heap.max_slice_us;
+    out->pause_budget_us = g_heap.pause_budget_us;
+}
+
+static void gc_print_stats(void) {
+    fprintf(stderr,
+            "gc: %zu minor + %zu major collections, %.3f ms total pause, %.3f ms max pause, "
+            "%zu bytes freed, %zu bytes live\n",
+            g_heap.minor_collections, g_heap.major_collections, g_heap.pause_total_ms,
+            g_heap.pause_max_ms, g_heap.bytes_freed, g_heap.bytes);
+    if (g_heap.pause_budget_us > 0) {
+        fprintf(stderr, "gc: %zu incremental slices, %.1f us max slice (budget %ld us)\n", g_heap.slices,
+                g_heap.max_slice_us, g_heap.pause_budget_us);
+    }
+    fprintf(stderr,
+            "gc: %zu bytes peak; live tables %zu, map entries %zu, strings %zu, envs %zu, "
+            "functions %zu, big ints %zu\n",
+            g_heap.peak, g_heap.kind_bytes[GC_TABLE], g_heap.kind_bytes[GC_ENTRIES],
+            g_heap.kind_bytes[GC_STRING] + g_heap.kind_bytes[GC_ROPE], g_heap.kind_bytes[GC_ENV], g_heap.kind_bytes[GC_FUNCTION],
+            g_heap.kind_bytes[GC_BIGINT]);
+}
+
+/*
+ * Baseline JIT (x86-64 Linux, enabled with --jit).
+ *
+ * Once a function has been called JIT_HOT_CALLS times its bytecode is
+ * translated one instruction at a time into machine code. Locals, scoped
+ * variables, constants, jumps and small-int arithmetic and comparisons run
+ * inline; a few other operations call a C helper. Calls, tail calls and
+ * returns between compiled functions stay native: a helper does what the
+ * interpreter would to the VM frames and hands back the callee's (or the
+ * caller's) native entry, and the code jumps straight there. Everything
+ * else (table writes, exceptions, calls into code that is not compiled)
+ * exits back to vm_run at that instruction with the value stack intact, so
+ * the interpreter stays the single source of truth for semantics: an
+ * inline path that would throw simply exits and lets the interpreter
+ * throw. vm_run re-enters the native code whenever it enters or returns
+ * into a frame whose proto has some.
+ *
+ * Native code is called as code(&sp, frame, entry) and returns the bytecode
+ * offset to resume at in whichever frame is then on top. While it runs rbx
+ * holds sp, r12 &sp and r13 frame.
+ */
+
+#ifdef PROTOLEX_JIT
+#include <stddef.h>
+#include <sys/mman.h>
+
+#define JIT_HOT_CALLS 100
+
+static bool g_jit_enabled = false;
+
+typedef uint32_t (*JitCode)(Value **sp, CallFrame *frame, const void *entry);
+
+struct Jit {
+    JitCode code;
+    uint32_t *offsets; /* native offset of each instruction start */
+    const void *entry; /* native code for offset 0, where native calls land */
+};
+
+/* Where native code goes on after a call or return, returned in rax:rdx. */
+typedef struct {
+    const void *entry; /* NULL to exit to the interpreter instead */
+    CallFrame *frame;
+} JitTarget;
+
+static const void *jit_entry(Proto *proto, uint32_t offset) {
+    return (const uint8_t *)(uintptr_t)proto->jit->code + proto->jit->offsets[offset];
+}
+
+typedef struct {
+    uint8_t *bytes;
+    size_t len;
+    size_t cap;
+} JitBuf;
+
+/* A rel32 field to point at a bytecode offset once it has been emitted. */
+typedef struct {
+    size_t at;
+    uint32_t target;
+} JitPatch;
+
+typedef struct {
+    JitBuf buf;
+    JitPatch *patches;
+    size_t patch_count;
+    size_t patch_cap;
+} JitAsm;
+
+static void jit_byte(JitAsm *a, uint8_t b) {
+    JitBuf *buf = &a->buf;
+    if (buf->len == buf->cap) {
+        size_t cap = buf->cap ? buf->cap * 2 : 1024;
+        buf->bytes = realloc(buf->bytes, cap);
+        if (!buf->bytes) {
+            runtime_fatal("out of memory");
+        }
+        buf->cap = cap;
+    }
+    buf->bytes[buf->len++] = b;
+}
+
+static void jit_bytes(JitAsm *a, const char *bytes, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        jit_byte(a, (uint8_t)bytes[i]);
+    }
+}
+
+static void jit_u32(JitAsm *a, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        jit_byte(a, (uint8_t)(v >> (8 * i)));
+    }
+}
+
+static void jit_u64(JitAsm *a, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        jit_byte(a, (uint8_t)(v >> (8 * i)));
+    }
+}
+
+#define JIT_EMIT(a, s) jit_bytes((a), (s), sizeof(s) - 1)
+
+enum { JIT_RAX, JIT_RCX, JIT_RDX, JIT_RBX, JIT_RSP, JIT_RBP, JIT_RSI, JIT_RDI, JIT_R8, JIT_R9, JIT_R10, JIT_R11, JIT_R12, JIT_R13 };
+
+/* mov reg, imm64 */
+static void jit_mov_imm(JitAsm *a, int reg, uint64_t v) {
+    jit_byte(a, (uint8_t)(0x48 | (reg >= 8 ? 1 : 0)));
+    jit_byte(a, (uint8_t)(0xB8 + (reg & 7)));
+    jit_u64(a, v);
+}
+
+/*
+ * opcode with a [base + disp32] operand: reg is the other register, or the
+ * opcode extension for group opcodes such as 0x80 /7 (cmp byte, imm8).
+ * wide adds REX.W for a 64-bit operand.
+ */
+static void jit_mem(JitAsm *a, uint8_t opcode, int reg, int base, int32_t disp, bool wide) {
+    uint8_t rex = (uint8_t)((wide ? 0x48 : 0x40) | (reg >= 8 ? 4 : 0) | (base >= 8 ? 1 : 0));
+    if (rex != 0x40) {
+        jit_byte(a, rex);
+    }
+    jit_byte(a, opcode);
+    jit_byte(a, (uint8_t)(0x80 | ((reg & 7) << 3) | (base & 7)));
+    if ((base & 7) == JIT_RSP) {
+        jit_byte(a, 0x24); /* rsp and r12 need a SIB byte */
+    }
+    jit_u32(a, (uint32_t)disp);
+}
+
+/* opcode dst, src on 64-bit registers: 0x89 mov, 0x01 add, 0x39 cmp, 0x85 test. */
+static void jit_rr(JitAsm *a, uint8_t opcode, int dst, int src) {
+    jit_byte(a, (uint8_t)(0x48 | (src >= 8 ? 4 : 0) | (dst >= 8 ? 1 : 0)));
+    jit_byte(a, opcode);
+    jit_byte(a, (uint8_t)(0xC0 | ((src & 7) << 3) | (dst & 7)));
+}
+
+/* 0x81 group on a 64-bit register with imm32: ext 0 add, 5 sub, 7 cmp. */
+static void jit_ri(JitAsm *a, int ext, int reg, int32_t imm) {
+    jit_byte(a, (uint8_t)(0x48 | (reg >= 8 ? 1 : 0)));
+    jit_byte(a, 0x81);
+    jit_byte(a, (uint8_t)(0xC0 | (ext << 3) | (reg & 7)));
+    jit_u32(a, (uint32_t)imm);
+}
+
+/* shl reg, n */
+static void jit_shl(JitAsm *a, int reg, uint8_t n) {
+    jit_byte(a, (uint8_t)(0x48 | (reg >= 8 ? 1 : 0)));
+    jit_byte(a, 0xC1);
+    jit_byte(a, (uint8_t)(0xE0 | (reg & 7)));
+    jit_byte(a, n);
+}
+
+/* Emits a jcc/jmp with a zero rel32 and returns where the rel32 lives. */
+static size_t jit_jump(JitAsm *a, const char *opcode, size_t n) {
+    jit_bytes(a, opcode, n);
+    size_t at = a->buf.len;
+    jit_u32(a, 0);
+    return at;
+}
+
+#define JIT_JMP(a) jit_jump((a), "\xE9", 1)
+#define JIT_JE(a) jit_jump((a), "\x0F\x84", 2)
+#define JIT_JNE(a) jit_jump((a), "\x0F\x85", 2)
+#define JIT_JO(a) jit_jump((a), "\x0F\x80", 2)
+#define JIT_JA(a) jit_jump((a), "\x0F\x87", 2)
+#define JIT_JAE(a) jit_jump((a), "\x0F\x83", 2)
+
+static void jit_patch_here(JitAsm *a, size_t at) {
+    uint32_t rel = (uint32_t)(a->buf.len - (at + 4));
+    memcpy(a->buf.bytes + at, &rel, 4);
+}
+
+/* Points the rel32 at `at` back to native offset target. */
+static void jit_patch_back(JitAsm *a, size_t at, size_t target) {
+    uint32_t rel = (uint32_t)(target - (at + 4));
+    memcpy(a->buf.bytes + at, &rel, 4);
+}
+
+static void jit_jump_to(JitAsm *a, size_t at, uint32_t target) {
+    if (a->patch_count == a->patch_cap) {
+        size_t cap = a->patch_cap ? a->patch_cap * 2 : 32;
+        a->patches = realloc(a->patches, cap * sizeof(JitPatch));
+        if (!a->patches) {
+            runtime_fatal("out of memory");
+        }
+        a->patch_cap = cap;
     }
-    if (strcmp(op, ">") == 0) {
-        if (!value_is_number(left) || !value_is_number(right)) {
-            return error_msg("non-numeric '>'");
-        }
-        return ok(make_bool(value_as_double(left) > value_as_double(right)));
+    a->patches[a->patch_count].at = at;
+    a->patches[a->patch_count].target = target;
+    a->patch_count++;
+}
+
+/* Stores sp back and returns offset to vm_run. */
+static void jit_exit(JitAsm *a, uint32_t offset) {
+    JIT_EMIT(a, "\x49\x89\x1C\x24"); /* mov [r12], rbx */
+    jit_byte(a, 0xB8);               /* mov eax, offset */
+    jit_u32(a, offset);
+    JIT_EMIT(a, "\x41\x5D\x41\x5C\x5B\xC3"); /* pop r13; pop r12; pop rbx; ret */
+}
+
+/* Exits at offset when the flags say equal (or not equal). */
+static void jit_exit_if(JitAsm *a, bool equal, uint32_t offset) {
+    size_t skip = equal ? JIT_JNE(a) : JIT_JE(a);
+    jit_exit(a, offset);
+    jit_patch_here(a, skip);
+}
+
+/* Calls helper(&sp, frame, x, y) with sp stored back and reloaded around it. */
+static void jit_call(JitAsm *a, void *helper, uint32_t x, uint32_t y) {
+    JIT_EMIT(a, "\x49\x89\x1C\x24"); /* mov [r12], rbx */
+    JIT_EMIT(a, "\x4C\x89\xE7");     /* mov rdi, r12 */
+    JIT_EMIT(a, "\x4C\x89\xEE");     /* mov rsi, r13 */
+    jit_byte(a, 0xBA);               /* mov edx, x */
+    jit_u32(a, x);
+    jit_byte(a, 0xB9); /* mov ecx, y */
+    jit_u32(a, y);
+    jit_mov_imm(a, JIT_RAX, (uint64_t)(uintptr_t)helper);
+    JIT_EMIT(a, "\xFF\xD0");         /* call rax */
+    JIT_EMIT(a, "\x49\x8B\x1C\x24"); /* mov rbx, [r12] */
+}
+
+/*
+ * Calls helper(&sp, frame, x, y) and exits at offset if it returns false.
+ * Helpers only touch the stack through &sp and must not change anything
+ * when they fail, so the interpreter can redo the instruction.
+ */
+static void jit_call_helper(JitAsm *a, void *helper, uint32_t x, uint32_t y, uint32_t offset) {
+    jit_call(a, helper, x, y);
+    JIT_EMIT(a, "\x84\xC0"); /* test al, al */
+    jit_exit_if(a, true, offset);
+}
+
+/*
+ * Calls helper(&sp, frame, x, y) for a JitTarget and jumps to its entry
+ * with r13 set to its frame, or exits at offset if it has none. Like the
+ * others, such a helper changes nothing when it declines.
+ */
+static void jit_transfer(JitAsm *a, void *helper, uint32_t x, uint32_t y, uint32_t offset) {
+    jit_call(a, helper, x, y);
+    JIT_EMIT(a, "\x48\x85\xC0"); /* test rax, rax */
+    jit_exit_if(a, true, offset);
+    JIT_EMIT(a, "\x49\x89\xD5"); /* mov r13, rdx */
+    JIT_EMIT(a, "\xFF\xE0");     /* jmp rax */
+}
+
+/* rax = frame->env, walked up depth parents. */
+static void jit_load_env(JitAsm *a, uint32_t depth) {
+    JIT_EMIT(a, "\x49\x8B\x85"); /* mov rax, [r13 + env] */
+    jit_u32(a, (uint32_t)offsetof(CallFrame, env));
+    while (depth-- > 0) {
+        JIT_EMIT(a, "\x48\x8B\x80"); /* mov rax, [rax + parent] */
+        jit_u32(a, (uint32_t)offsetof(Env, parent));
     }
-    if (strcmp(op, ">=") == 0) {
-        if (!value_is_number(left) || !value_is_number(right)) {
-            return error_msg("non-numeric '>='");
-        }
-        return ok(make_bool(value_as_double(left) >= value_as_double(right)));
+}
+
+static uint32_t jit_slot_disp(uint32_t slot) {
+    return (uint32_t)(offsetof(Env, slots) + slot * sizeof(Value));
+}
+
+static void jit_get_var(JitAsm *a, uint32_t depth, uint32_t slot, uint32_t offset) {
+    jit_load_env(a, depth);
+    JIT_EMIT(a, "\x48\x8B\x80"); /* mov rax, [rax + slot] */
+    jit_u32(a, jit_slot_disp(slot));
+    jit_mov_imm(a, JIT_RDX, make_unbound().bits);
+    JIT_EMIT(a, "\x48\x39\xD0"); /* cmp rax, rdx */
+    jit_exit_if(a, true, offset);
+    JIT_EMIT(a, "\x48\x89\x03");     /* mov [rbx], rax */
+    JIT_EMIT(a, "\x48\x83\xC3\x08"); /* add rbx, 8 */
+}
+
+static bool jit_helper_env_barrier(Value **spp, CallFrame *frame, uint32_t depth, uint32_t slot) {
+    (void)spp;
+    Env *env = env_at(frame->env, depth);
+    gc_env_barrier(env, env->slots[slot]);
+    return true;
+}
+
+/* Stores the top of stack; pointer values also go through the GC barrier. */
+static void jit_set_var(JitAsm *a, uint32_t depth, uint32_t slot, uint32_t offset) {
+    jit_load_env(a, depth);
+    JIT_EMIT(a, "\x48\x8B\x4B\xF8"); /* mov rcx, [rbx - 8] */
+    JIT_EMIT(a, "\x48\x89\x88");     /* mov [rax + slot], rcx */
+    jit_u32(a, jit_slot_disp(slot));
+    JIT_EMIT(a, "\x48\x89\xCA");     /* mov rdx, rcx */
+    JIT_EMIT(a, "\x48\xC1\xEA\x30"); /* shr rdx, 48 */
+    JIT_EMIT(a, "\x81\xFA");         /* cmp edx, bigint tag */
+    jit_u32(a, (uint32_t)(VALUE_BITS(VALUE_TAG_BIGINT, 0) >> VALUE_TAG_SHIFT));
+    size_t is_number = jit_jump(a, "\x0F\x82", 2); /* jb: float or small int */
+    JIT_EMIT(a, "\x81\xFA");                       /* cmp edx, special tag */
+    jit_u32(a, (uint32_t)(VALUE_BITS(VALUE_TAG_SPECIAL, 0) >> VALUE_TAG_SHIFT));
+    size_t is_special = JIT_JE(a);
+    jit_call_helper(a, (void *)jit_helper_env_barrier, depth, slot, offset);
+    jit_patch_here(a, is_number);
+    jit_patch_here(a, is_special);
+}
+
+/* Jumps to the returned patch site unless reg (rax or rcx) is a small int. */
+static size_t jit_guard_small_int(JitAsm *a, int reg) {
+    if (reg == JIT_RAX) {
+        JIT_EMIT(a, "\x48\x89\xC2"); /* mov rdx, rax */
+    } else {
+        JIT_EMIT(a, "\x48\x89\xCA"); /* mov rdx, rcx */
     }
-    if (strcmp(op, "&&") == 0) {
-        return ok(make_bool(value_is_truthy(left) && value_is_truthy(right)));
+    JIT_EMIT(a, "\x48\xC1\xEA\x30"); /* shr rdx, 48 */
+    JIT_EMIT(a, "\x81\xFA");         /* cmp edx, int tag */
+    jit_u32(a, (uint32_t)(VALUE_TAGGED >> VALUE_TAG_SHIFT));
+    return JIT_JNE(a);
+}
+
+static bool jit_helper_binary(Value **spp, CallFrame *frame, uint32_t op, uint32_t unused) {
+    (void)frame;
+    (void)unused;
+    Value *sp = *spp;
+    EvalResult r = binary_op((OpCode)op, sp[-2], sp[-1]);
+    if (r.is_exception) {
+        return false;
     }
-    if (strcmp(op, "||") == 0) {
-        return ok(make_bool(value_is_truthy(left) || value_is_truthy(right)));
+    sp[-2] = r.value;
+    *spp = sp - 1;
+    return true;
+}
+
+/*
+ * Small-int fast path for an arithmetic or comparison opcode, falling back
+ * to binary_op through a helper.
+ */
+static void jit_binary(JitAsm *a, OpCode op, uint32_t offset) {
+    size_t slow[4];
+    int slow_count = 0;
+    JIT_EMIT(a, "\x48\x8B\x43\xF0"); /* mov rax, [rbx - 16] */
+    JIT_EMIT(a, "\x48\x8B\x4B\xF8"); /* mov rcx, [rbx - 8] */
+    slow[slow_count++] = jit_guard_small_int(a, JIT_RAX);
+    slow[slow_count++] = jit_guard_small_int(a, JIT_RCX);
+    if (op == OP_EQ || op == OP_NE) {
+        JIT_EMIT(a, "\x48\x39\xC8"); /* cmp rax, rcx */
+    } else {
+        JIT_EMIT(a, "\x48\xC1\xE0\x10\x48\xC1\xF8\x10"); /* sign-extend rax */
+        JIT_EMIT(a, "\x48\xC1\xE1\x10\x48\xC1\xF9\x10"); /* sign-extend rcx */
     }
-    return error_msg("unknown binary op");
+    switch (op) {
+    case OP_ADD:
+        JIT_EMIT(a, "\x48\x01\xC8"); /* add rax, rcx */
+        break;
+    case OP_SUB:
+        JIT_EMIT(a, "\x48\x29\xC8"); /* sub rax, rcx */
+        break;
+    case OP_MUL:
+        JIT_EMIT(a, "\x48\x0F\xAF\xC1"); /* imul rax, rcx */
+        slow[slow_count++] = JIT_JO(a);
+        break;
+    case OP_EQ:
+        JIT_EMIT(a, "\x0F\x94\xC0"); /* sete al */
+        break;
+    case OP_NE:
+        JIT_EMIT(a, "\x0F\x95\xC0"); /* setne al */
+        break;
+    case OP_LT:
+        JIT_EMIT(a, "\x48\x39\xC8\x0F\x9C\xC0"); /* cmp rax, rcx; setl al */
+        break;
+    case OP_LE:
+        JIT_EMIT(a, "\x48\x39\xC8\x0F\x9E\xC0"); /* cmp rax, rcx; setle al */
+        break;
+    case OP_GT:
+        JIT_EMIT(a, "\x48\x39\xC8\x0F\x9F\xC0"); /* cmp rax, rcx; setg al */
+        break;
+    case OP_GE:
+        JIT_EMIT(a, "\x48\x39\xC8\x0F\x9D\xC0"); /* cmp rax, rcx; setge al */
+        break;
+    default:
+        runtime_fatal("jit: not an inline binary op");
+    }
+    if (op == OP_ADD || op == OP_SUB || op == OP_MUL) {
+        /* The result must fit in 48 bits to stay a small int. */
+        JIT_EMIT(a, "\x48\x89\xC2");                     /* mov rdx, rax */
+        JIT_EMIT(a, "\x48\xC1\xE2\x10\x48\xC1\xFA\x10"); /* sign-extend rdx */
+        JIT_EMIT(a, "\x48\x39\xC2");                     /* cmp rdx, rax */
+        slow[slow_count++] = JIT_JNE(a);
+        jit_mov_imm(a, JIT_RDX, VALUE_PAYLOAD);
+        JIT_EMIT(a, "\x48\x21\xD0"); /* and rax, rdx */
+        jit_mov_imm(a, JIT_RDX, make_int(0).bits);
+        JIT_EMIT(a, "\x48\x09\xD0"); /* or rax, rdx */
+    } else {
+        JIT_EMIT(a, "\x0F\xB6\xC0"); /* movzx eax, al */
+        jit_mov_imm(a, JIT_RDX, make_bool(false).bits);
+        JIT_EMIT(a, "\x48\x01\xD0"); /* add rax, rdx */
+    }
+    JIT_EMIT(a, "\x48\x89\x43\xF0"); /* mov [rbx - 16], rax */
+    JIT_EMIT(a, "\x48\x83\xEB\x08"); /* sub rbx, 8 */
+    size_t done = JIT_JMP(a);
+    for (int i = 0; i < slow_count; i++) {
+        jit_patch_here(a, slow[i]);
+    }
+    jit_call_helper(a, (void *)jit_helper_binary, (uint32_t)op, 0, offset);
+    jit_patch_here(a, done);
 }
 
-static EvalResult eval_call(Value callee, int argc, Value *argv, const char *module_dir) {
-    if (callee.type != VAL_FUNCTION) {
-        return error_msg("call on non-function");
+static bool jit_helper_unary(Value **spp, CallFrame *frame, uint32_t op, uint32_t unused) {
+    (void)frame;
+    (void)unused;
+    Value *sp = *spp;
+    Value v = sp[-1];
+    if (op == OP_NOT) {
+        sp[-1] = make_bool(!value_is_truthy(v));
+    } else if (value_type(v) == VAL_FLOAT) {
+        sp[-1] = make_float(-as_float(v));
+    } else if (value_type(v) == VAL_INT) {
+        sp[-1] = make_int(-as_int(v));
+    } else {
+        return false;
     }
-    Function *fn = callee.as.fn;
-    if (fn->is_native) {
-        EvalResult err;
-        err.is_exception = false;
-        err.value = make_null();
-        Value out = fn->native(argc, argv, &err);
-        if (err.is_exception) {
-            return err;
-        }
-        return ok(out);
+    return true;
+}
+
+static bool jit_helper_push_scope(Value **spp, CallFrame *frame, uint32_t size, uint32_t unused) {
+    (void)spp;
+    (void)unused;
+    frame->env = vm_scope_env(frame, size);
+    return true;
+}
+
+static bool jit_helper_pop_scope(Value **spp, CallFrame *frame, uint32_t unused1, uint32_t unused2) {
+    (void)spp;
+    (void)unused1;
+    (void)unused2;
+    Env *env = frame->env;
+    frame->env = env->parent;
+    if (vm_env_on_stack(env)) {
+        vm.env_top = (size_t)((Value *)env - vm.env_stack);
     }
-    if (argc != fn->arity) {
-        return error_msg("arity mismatch");
+    return true;
+}
+
+static bool jit_helper_get_field(Value **spp, CallFrame *frame, uint32_t key, uint32_t ic) {
+    Value *sp = *spp;
+    if (value_type(sp[-1]) != VAL_TABLE) {
+        return false;
+    }
+    sp[-1] = table_get_cached(&frame->proto->ics[ic], as_table(sp[-1]), frame->proto->consts[key]);
+    return true;
+}
+
+/* OP_CALL of a compiled function: the interpreter's frame push. */
+static JitTarget jit_helper_call(Value **spp, CallFrame *frame, uint32_t argc, uint32_t resume) {
+    JitTarget none = {NULL, NULL};
+    Value *base = *spp - argc - 1;
+    if (g_heap.pending || value_type(*base) != VAL_FUNCTION) {
+        return none;
     }
-    Env *call_env = env_new(fn->env);
-    for (int i = 0; i < fn->arity; i++) {
-        env_define(call_env, fn->params.items[i], argv[i]);
+    Function *fn = as_function(*base);
+    if (fn->is_native || !fn->proto->jit || (int)argc != fn->arity || !vm_has_room(fn->proto, *spp)) {
+        return none;
     }
-    return eval_block(fn->body, call_env, module_dir, true);
+    frame->ip = frame->proto->code + resume;
+    vm_push_frame(fn, base, false);
+    JitTarget to = {jit_entry(fn->proto, 0), &vm.frames[vm.frame_count - 1]};
+    return to;
 }
 
-EvalResult call_function(Value callee, int argc, Value *argv, const char *module_dir) {
-    return eval_call(callee, argc, argv, module_dir);
+/* OP_TAIL_CALL of a compiled function: slides it over the current frame. */
+static JitTarget jit_helper_tail_call(Value **spp, CallFrame *frame, uint32_t argc, uint32_t unused) {
+    (void)unused;
+    JitTarget none = {NULL, NULL};
+    Value *base = *spp - argc - 1;
+    if (g_heap.pending || value_type(*base) != VAL_FUNCTION) {
+        return none;
+    }
+    Function *fn = as_function(*base);
+    Value *dst = frame->base;
+    if (fn->is_native || !fn->proto->jit || (int)argc != fn->arity ||
+        dst + argc + 1 + fn->proto->max_stack + 1 > vm.stack + VM_STACK_MAX) {
+        return none;
+    }
+    memmove(dst, base, sizeof(Value) * (argc + 1));
+    *spp = dst + argc + 1;
+    vm.env_top = frame->env_mark;
+    Env *env = vm_call_env(fn->proto, fn->env);
+    vm_bind_args(env, fn, dst);
+    frame->proto = fn->proto;
+    frame->env = env;
+    frame->locals = env;
+    JitTarget to = {jit_entry(fn->proto, 0), frame};
+    return to;
 }
 
-static EvalResult eval_undefine(Node *node, Env *env, const char *module_dir) {
-    Node *target = node->as.undefine.target;
-    if (target->type != NODE_DOT && target->type != NODE_INDEX) {
-        return error_msg("undefine target must be slot");
+/* OP_RETURN into a compiled caller in the same vm_run. */
+static JitTarget jit_helper_return(Value **spp, CallFrame *frame, uint32_t unused1, uint32_t unused2) {
+    (void)unused1;
+    (void)unused2;
+    JitTarget none = {NULL, NULL};
+    CallFrame *caller = frame - 1;
+    if (frame->boundary || frame->module || !caller->proto->jit) {
+        return none;
     }
-    if (target->type == NODE_DOT) {
-        EvalResult obj_r = eval_node(target->as.dot.object, env, module_dir);
-        if (obj_r.is_exception) {
-            return obj_r;
-        }
-        if (obj_r.value.type != VAL_TABLE) {
-            return error_msg("undefine on non-table");
-        }
-        if (strcmp(target->as.dot.name, "proto") == 0) {
-            return error_msg("cannot undefine proto");
-        }
-        Value key = make_string_value(target->as.dot.name, strlen(target->as.dot.name));
-        if (!table_delete(obj_r.value.as.table, key)) {
-            return error_msg("object is frozen");
+    Value result = (*spp)[-1];
+    *frame->base = result;
+    *spp = frame->base + 1;
+    vm.env_top = frame->env_mark;
+    vm.frame_count--;
+    JitTarget to = {jit_entry(caller->proto, (uint32_t)(caller->ip - caller->proto->code)), caller};
+    return to;
+}
+
+/*
+ * Native call sequences. For a compiled callee whose env goes on the env
+ * stack, these do inline what vm_push_frame, the OP_TAIL_CALL slide and
+ * vm_return do, then jump to the native code that runs next. Any guard
+ * that fails falls back to the helpers above, which handle the rest of the
+ * compiled callees and otherwise exit to the interpreter.
+ */
+#define JIT_ENV_WORDS ((int32_t)((sizeof(Env) + sizeof(Value) - 1) / sizeof(Value)))
+
+/*
+ * Checks that the callee below argc arguments is a compiled function of
+ * that arity with a stack env and that no collection is pending. Leaves
+ * rax = Function, rcx = Proto, rdx = Jit and r10 = &vm.
+ */
+static void jit_call_guards(JitAsm *a, uint32_t argc, size_t *slow, int *slow_count) {
+    jit_mem(a, 0x8B, JIT_RAX, JIT_RBX, -(int32_t)(8 * (argc + 1)), true); /* mov rax, callee */
+    JIT_EMIT(a, "\x48\x89\xC2");                                           /* mov rdx, rax */
+    JIT_EMIT(a, "\x48\xC1\xEA\x30");                                       /* shr rdx, 48 */
+    JIT_EMIT(a, "\x81\xFA");                                               /* cmp edx, function tag */
+    jit_u32(a, (uint32_t)(VALUE_BITS(VALUE_TAG_FUNCTION, 0) >> VALUE_TAG_SHIFT));
+    slow[(*slow_count)++] = JIT_JNE(a);
+    jit_mov_imm(a, JIT_RDX, VALUE_PAYLOAD);
+    JIT_EMIT(a, "\x48\x21\xD0"); /* and rax, rdx */
+    jit_mem(a, 0x80, 7, JIT_RAX, (int32_t)offsetof(Function, is_native), false); /* cmp byte, 0 */
+    jit_byte(a, 0);
+    slow[(*slow_count)++] = JIT_JNE(a);
+    jit_mem(a, 0x81, 7, JIT_RAX, (int32_t)offsetof(Function, arity), false); /* cmp dword, argc */
+    jit_u32(a, argc);
+    slow[(*slow_count)++] = JIT_JNE(a);
+    jit_mem(a, 0x8B, JIT_RCX, JIT_RAX, (int32_t)offsetof(Function, proto), true);
+    jit_mem(a, 0x8B, JIT_RDX, JIT_RCX, (int32_t)offsetof(Proto, jit), true);
+    JIT_EMIT(a, "\x48\x85\xD2"); /* test rdx, rdx */
+    slow[(*slow_count)++] = JIT_JE(a);
+    jit_mem(a, 0x80, 7, JIT_RCX, (int32_t)offsetof(Proto, captures_env), false);
+    jit_byte(a, 0);
+    slow[(*slow_count)++] = JIT_JNE(a);
+    jit_mov_imm(a, JIT_R10, (uint64_t)(uintptr_t)&g_heap.pending);
+    jit_mem(a, 0x80, 7, JIT_R10, 0, false);
+    jit_byte(a, 0);
+    slow[(*slow_count)++] = JIT_JNE(a);
+    jit_mov_imm(a, JIT_R10, (uint64_t)(uintptr_t)&vm);
+}
+
+/*
+ * With r8 = the env stack top to push at, checks the callee's env fits.
+ * Leaves r11 = slot_count and rdi = the new top.
+ */
+static void jit_env_room(JitAsm *a, size_t *slow, int *slow_count) {
+    jit_mem(a, 0x63, JIT_R11, JIT_RCX, (int32_t)offsetof(Proto, slot_count), true); /* movsxd */
+    JIT_EMIT(a, "\x4C\x89\xC7");                                                 /* mov rdi, r8 */
+    jit_rr(a, 0x01, JIT_RDI, JIT_R11);                                            /* add rdi, r11 */
+    jit_ri(a, 0, JIT_RDI, JIT_ENV_WORDS);
+    jit_ri(a, 7, JIT_RDI, VM_ENV_STACK_MAX);
+    slow[(*slow_count)++] = JIT_JA(a);
+}
+
+/*
+ * Claims the env at r8 as the new top rdi and fills it like vm_call_env
+ * and vm_bind_args: parent from the Function in rax, r11 slots, the
+ * arguments from [src + disp] first. Leaves r9 = env; clobbers rdi, r8, r11.
+ */
+static void jit_push_env(JitAsm *a, uint32_t argc, int src, int32_t disp) {
+    jit_mem(a, 0x89, JIT_RDI, JIT_R10, (int32_t)offsetof(VM, env_top), true);
+    JIT_EMIT(a, "\x4D\x89\xC1"); /* mov r9, r8 */
+    jit_shl(a, JIT_R9, 3);
+    jit_mem(a, 0x03, JIT_R9, JIT_R10, (int32_t)offsetof(VM, env_stack), true); /* add r9, [..] */
+    jit_mem(a, 0x8B, JIT_RDI, JIT_RAX, (int32_t)offsetof(Function, env), true);
+    jit_mem(a, 0x89, JIT_RDI, JIT_R9, (int32_t)offsetof(Env, parent), true);
+    jit_mem(a, 0x89, JIT_R11, JIT_R9, (int32_t)offsetof(Env, size), true);
+    for (uint32_t i = 0; i < argc; i++) {
+        jit_mem(a, 0x8B, JIT_RDI, src, disp + (int32_t)(8 * i), true);
+        jit_mem(a, 0x89, JIT_RDI, JIT_R9, (int32_t)jit_slot_disp(i), true);
+    }
+    /* The other slots start unbound: r8 walks them up to r11. */
+    jit_shl(a, JIT_R11, 3);
+    jit_rr(a, 0x01, JIT_R11, JIT_R9);
+    jit_ri(a, 0, JIT_R11, (int32_t)offsetof(Env, slots));
+    jit_mem(a, 0x8D, JIT_R8, JIT_R9, (int32_t)jit_slot_disp(argc), true); /* lea r8, [r9 + slot] */
+    jit_mov_imm(a, JIT_RDI, make_unbound().bits);
+    size_t loop = a->buf.len;
+    jit_rr(a, 0x39, JIT_R8, JIT_R11); /* cmp r8, r11 */
+    size_t done = JIT_JAE(a);
+    jit_mem(a, 0x89, JIT_RDI, JIT_R8, 0, true); /* mov [r8], rdi */
+    jit_ri(a, 0, JIT_R8, 8);
+    jit_patch_back(a, JIT_JMP(a), loop);
+    jit_patch_here(a, done);
+}
+
+static void jit_native_call(JitAsm *a, Proto *proto, uint32_t argc, uint32_t offset) {
+    size_t slow[16];
+    int slow_count = 0;
+    uint32_t resume = offset + 2;
+    jit_call_guards(a, argc, slow, &slow_count);
+    jit_mem(a, 0x8B, JIT_RSI, JIT_R10, (int32_t)offsetof(VM, frame_count), true);
+    jit_ri(a, 7, JIT_RSI, VM_FRAMES_MAX);
+    slow[slow_count++] = JIT_JAE(a);
+    /* vm_has_room: sp + max_stack + 1 stays inside the value stack. */
+    jit_mem(a, 0x63, JIT_RDI, JIT_RCX, (int32_t)offsetof(Proto, max_stack), true); /* movsxd */
+    jit_shl(a, JIT_RDI, 3);
+    jit_rr(a, 0x01, JIT_RDI, JIT_RBX);
+    jit_ri(a, 0, JIT_RDI, (int32_t)sizeof(Value));
+    jit_mem(a, 0x8B, JIT_R8, JIT_R10, (int32_t)offsetof(VM, stack), true);
+    jit_ri(a, 0, JIT_R8, (int32_t)(VM_STACK_MAX * sizeof(Value)));
+    jit_rr(a, 0x39, JIT_RDI, JIT_R8); /* cmp rdi, r8 */
+    slow[slow_count++] = JIT_JA(a);
+    jit_mem(a, 0x8B, JIT_R8, JIT_R10, (int32_t)offsetof(VM, env_top), true);
+    jit_env_room(a, slow, &slow_count);
+
+    /* The call goes ahead: save the caller's resume point, push the frame. */
+    jit_mov_imm(a, JIT_RSI, (uint64_t)(uintptr_t)(proto->code + resume));
+    jit_mem(a, 0x89, JIT_RSI, JIT_R13, (int32_t)offsetof(CallFrame, ip), true);
+    jit_mem(a, 0x8B, JIT_RSI, JIT_R10, (int32_t)offsetof(VM, frame_count), true);
+    jit_mem(a, 0x83, 0, JIT_R10, (int32_t)offsetof(VM, frame_count), true); /* add qword, 1 */
+    jit_byte(a, 1);
+    JIT_EMIT(a, "\x48\x69\xF6"); /* imul rsi, rsi, sizeof(CallFrame) */
+    jit_u32(a, (uint32_t)sizeof(CallFrame));
+    jit_mem(a, 0x03, JIT_RSI, JIT_R10, (int32_t)offsetof(VM, frames), true); /* add rsi, [..] */
+    jit_mem(a, 0x89, JIT_R8, JIT_RSI, (int32_t)offsetof(CallFrame, env_mark), true);
+    jit_push_env(a, argc, JIT_RBX, -(int32_t)(8 * argc));
+    jit_mem(a, 0x89, JIT_RCX, JIT_RSI, (int32_t)offsetof(CallFrame, proto), true);
+    jit_mem(a, 0x8B, JIT_RDI, JIT_RCX, (int32_t)offsetof(Proto, code), true);
+    jit_mem(a, 0x89, JIT_RDI, JIT_RSI, (int32_t)offsetof(CallFrame, ip), true);
+    jit_mem(a, 0x8D, JIT_RDI, JIT_RBX, -(int32_t)(8 * (argc + 1)), true); /* lea rdi, callee */
+    jit_mem(a, 0x89, JIT_RDI, JIT_RSI, (int32_t)offsetof(CallFrame, base), true);
+    jit_mem(a, 0x89, JIT_R9, JIT_RSI, (int32_t)offsetof(CallFrame, env), true);
+    jit_mem(a, 0x89, JIT_R9, JIT_RSI, (int32_t)offsetof(CallFrame, locals), true);
+    jit_mem(a, 0xC6, 0, JIT_RSI, (int32_t)offsetof(CallFrame, boundary), false); /* mov byte, 0 */
+    jit_byte(a, 0);
+    JIT_EMIT(a, "\x31\xFF"); /* xor edi, edi */
+    jit_mem(a, 0x89, JIT_RDI, JIT_RSI, (int32_t)offsetof(CallFrame, module), true);
+    JIT_EMIT(a, "\x49\x89\xF5");                                         /* mov r13, rsi */
+    jit_mem(a, 0xFF, 4, JIT_RDX, (int32_t)offsetof(struct Jit, entry), false); /* jmp [rdx + entry] */
+
+    for (int i = 0; i < slow_count; i++) {
+        jit_patch_here(a, slow[i]);
+    }
+    jit_transfer(a, (void *)jit_helper_call, argc, resume, offset);
+}
+
+static void jit_native_tail_call(JitAsm *a, uint32_t argc, uint32_t offset) {
+    size_t slow[16];
+    int slow_count = 0;
+    jit_call_guards(a, argc, slow, &slow_count);
+    /* The callee and its arguments slide down to the frame's base. */
+    jit_mem(a, 0x8B, JIT_RSI, JIT_R13, (int32_t)offsetof(CallFrame, base), true);
+    jit_mem(a, 0x63, JIT_RDI, JIT_RCX, (int32_t)offsetof(Proto, max_stack), true); /* movsxd */
+    jit_shl(a, JIT_RDI, 3);
+    jit_rr(a, 0x01, JIT_RDI, JIT_RSI);
+    jit_ri(a, 0, JIT_RDI, (int32_t)(sizeof(Value) * (argc + 2)));
+    jit_mem(a, 0x8B, JIT_R8, JIT_R10, (int32_t)offsetof(VM, stack), true);
+    jit_ri(a, 0, JIT_R8, (int32_t)(VM_STACK_MAX * sizeof(Value)));
+    jit_rr(a, 0x39, JIT_RDI, JIT_R8); /* cmp rdi, r8 */
+    slow[slow_count++] = JIT_JA(a);
+    jit_mem(a, 0x8B, JIT_R8, JIT_R13, (int32_t)offsetof(CallFrame, env_mark), true);
+    jit_env_room(a, slow, &slow_count);
+
+    for (uint32_t i = 0; i <= argc; i++) {
+        jit_mem(a, 0x8B, JIT_R9, JIT_RBX, -(int32_t)(8 * (argc + 1 - i)), true);
+        jit_mem(a, 0x89, JIT_R9, JIT_RSI, (int32_t)(8 * i), true);
+    }
+    jit_mem(a, 0x8D, JIT_RBX, JIT_RSI, (int32_t)(8 * (argc + 1)), true); /* lea rbx, [..] */
+    jit_push_env(a, argc, JIT_RSI, 8);
+    jit_mem(a, 0x89, JIT_RCX, JIT_R13, (int32_t)offsetof(CallFrame, proto), true);
+    jit_mem(a, 0x89, JIT_R9, JIT_R13, (int32_t)offsetof(CallFrame, env), true);
+    jit_mem(a, 0x89, JIT_R9, JIT_R13, (int32_t)offsetof(CallFrame, locals), true);
+    jit_mem(a, 0xFF, 4, JIT_RDX, (int32_t)offsetof(struct Jit, entry), false); /* jmp [rdx + entry] */
+
+    for (int i = 0; i < slow_count; i++) {
+        jit_patch_here(a, slow[i]);
+    }
+    jit_transfer(a, (void *)jit_helper_tail_call, argc, 0, offset);
+}
+
+static void jit_native_return(JitAsm *a, uint32_t offset) {
+    size_t slow[4];
+    int slow_count = 0;
+    jit_mem(a, 0x80, 7, JIT_R13, (int32_t)offsetof(CallFrame, boundary), false); /* cmp byte, 0 */
+    jit_byte(a, 0);
+    slow[slow_count++] = JIT_JNE(a);
+    jit_mem(a, 0x83, 7, JIT_R13, (int32_t)offsetof(CallFrame, module), true); /* cmp qword, 0 */
+    jit_byte(a, 0);
+    slow[slow_count++] = JIT_JNE(a);
+    JIT_EMIT(a, "\x4C\x89\xEE"); /* mov rsi, r13 */
+    jit_ri(a, 5, JIT_RSI, (int32_t)sizeof(CallFrame));
+    jit_mem(a, 0x8B, JIT_RCX, JIT_RSI, (int32_t)offsetof(CallFrame, proto), true);
+    jit_mem(a, 0x8B, JIT_RDX, JIT_RCX, (int32_t)offsetof(Proto, jit), true);
+    JIT_EMIT(a, "\x48\x85\xD2"); /* test rdx, rdx */
+    slow[slow_count++] = JIT_JE(a);
+
+    /* The caller is compiled: pop the frame and resume it natively. */
+    JIT_EMIT(a, "\x48\x8B\x43\xF8"); /* mov rax, [rbx - 8] */
+    jit_mem(a, 0x8B, JIT_RBX, JIT_R13, (int32_t)offsetof(CallFrame, base), true);
+    JIT_EMIT(a, "\x48\x89\x03\x48\x83\xC3\x08"); /* mov [rbx], rax; add rbx, 8 */
+    jit_mov_imm(a, JIT_R10, (uint64_t)(uintptr_t)&vm);
+    jit_mem(a, 0x8B, JIT_RDI, JIT_R13, (int32_t)offsetof(CallFrame, env_mark), true);
+    jit_mem(a, 0x89, JIT_RDI, JIT_R10, (int32_t)offsetof(VM, env_top), true);
+    jit_mem(a, 0x83, 5, JIT_R10, (int32_t)offsetof(VM, frame_count), true); /* sub qword, 1 */
+    jit_byte(a, 1);
+    /* Entry = code + offsets[ip - proto->code]; both sides count 4-byte words. */
+    jit_mem(a, 0x8B, JIT_RDI, JIT_RSI, (int32_t)offsetof(CallFrame, ip), true);
+    jit_mem(a, 0x2B, JIT_RDI, JIT_RCX, (int32_t)offsetof(Proto, code), true); /* sub rdi, [..] */
+    jit_mem(a, 0x03, JIT_RDI, JIT_RDX, (int32_t)offsetof(struct Jit, offsets), true);
+    jit_mem(a, 0x8B, JIT_RDI, JIT_RDI, 0, false); /* mov edi, [rdi] */
+    jit_mem(a, 0x03, JIT_RDI, JIT_RDX, (int32_t)offsetof(struct Jit, code), true);
+    JIT_EMIT(a, "\x49\x89\xF5"); /* mov r13, rsi */
+    JIT_EMIT(a, "\xFF\xE7");     /* jmp rdi */
+
+    for (int i = 0; i < slow_count; i++) {
+        jit_patch_here(a, slow[i]);
+    }
+    jit_transfer(a, (void *)jit_helper_return, 0, 0, offset);
+}
+
+static void jit_instruction(JitAsm *a, Proto *proto, uint32_t offset) {
+    uint32_t *ip = proto->code + offset;
+    OpCode op = (OpCode)ip[0];
+    switch (op) {
+    case OP_CONST:
+        jit_mov_imm(a, JIT_RAX, proto->consts[ip[1]].bits);
+        JIT_EMIT(a, "\x48\x89\x03\x48\x83\xC3\x08"); /* mov [rbx], rax; add rbx, 8 */
+        return;
+    case OP_NULL:
+        jit_mov_imm(a, JIT_RAX, make_null().bits);
+        JIT_EMIT(a, "\x48\x89\x03\x48\x83\xC3\x08"); /* mov [rbx], rax; add rbx, 8 */
+        return;
+    case OP_POP:
+        JIT_EMIT(a, "\x48\x83\xEB\x08"); /* sub rbx, 8 */
+        return;
+    case OP_GET_LOCAL:
+        jit_get_var(a, 0, ip[1], offset);
+        return;
+    case OP_SET_LOCAL:
+        jit_set_var(a, 0, ip[1], offset);
+        return;
+    case OP_GET_VAR:
+        jit_get_var(a, ip[1], ip[2], offset);
+        return;
+    case OP_SET_VAR:
+        jit_set_var(a, ip[1], ip[2], offset);
+        return;
+    case OP_CHECK_ASSIGN:
+        JIT_EMIT(a, "\x48\x8B\x43\xF8"); /* mov rax, [rbx - 8] */
+        jit_mov_imm(a, JIT_RDX, make_undefined().bits);
+        JIT_EMIT(a, "\x48\x39\xD0"); /* cmp rax, rdx */
+        jit_exit_if(a, true, offset);
+        return;
+    case OP_PUSH_SCOPE:
+        jit_call_helper(a, (void *)jit_helper_push_scope, ip[1], 0, offset);
+        return;
+    case OP_POP_SCOPE:
+        jit_call_helper(a, (void *)jit_helper_pop_scope, 0, 0, offset);
+        return;
+    case OP_GET_FIELD:
+        jit_call_helper(a, (void *)jit_helper_get_field, ip[1], ip[2], offset);
+        return;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_EQ:
+    case OP_NE:
+    case OP_LT:
+    case OP_LE:
+    case OP_GT:
+    case OP_GE:
+        jit_binary(a, op, offset);
+        return;
+    case OP_DIV:
+    case OP_AND:
+    case OP_OR:
+        jit_call_helper(a, (void *)jit_helper_binary, (uint32_t)op, 0, offset);
+        return;
+    case OP_NOT:
+    case OP_NEG:
+        jit_call_helper(a, (void *)jit_helper_unary, (uint32_t)op, 0, offset);
+        return;
+    case OP_CALL:
+        jit_native_call(a, proto, ip[1], offset);
+        return;
+    case OP_TAIL_CALL:
+        jit_native_tail_call(a, ip[1], offset);
+        return;
+    case OP_RETURN:
+        jit_native_return(a, offset);
+        return;
+    case OP_JUMP:
+        jit_jump_to(a, JIT_JMP(a), ip[1]);
+        return;
+    case OP_JUMP_IF_FALSE: {
+        static const uint32_t falsy[] = {VALUE_FALSE, VALUE_NULL, VALUE_UNDEFINED};
+        JIT_EMIT(a, "\x48\x8B\x43\xF8"); /* mov rax, [rbx - 8] */
+        JIT_EMIT(a, "\x48\x83\xEB\x08"); /* sub rbx, 8 */
+        for (size_t i = 0; i < sizeof(falsy) / sizeof(falsy[0]); i++) {
+            jit_mov_imm(a, JIT_RDX, VALUE_SPECIAL_BITS(falsy[i]));
+            JIT_EMIT(a, "\x48\x39\xD0"); /* cmp rax, rdx */
+            jit_jump_to(a, JIT_JE(a), ip[1]);
         }
-        return ok(make_null());
+        return;
     }
-    EvalResult obj_r = eval_node(target->as.index.object, env, module_dir);
-    if (obj_r.is_exception) {
-        return obj_r;
+    default:
+        jit_exit(a, offset);
+        return;
     }
-    EvalResult idx_r = eval_node(target->as.index.index, env, module_dir);
-    if (idx_r.is_exception) {
-        return idx_r;
+}
+
+/* Translates proto; on failure the proto just stays interpreted. */
+static void jit_compile(Proto *proto) {
+    JitAsm a;
+    memset(&a, 0, sizeof(a));
+    uint32_t *offsets = xmalloc(sizeof(uint32_t) * (proto->code_len + 1));
+    JIT_EMIT(&a, "\x53\x41\x54\x41\x55"); /* push rbx; push r12; push r13 */
+    JIT_EMIT(&a, "\x49\x89\xFC");         /* mov r12, rdi */
+    JIT_EMIT(&a, "\x49\x89\xF5");         /* mov r13, rsi */
+    JIT_EMIT(&a, "\x49\x8B\x1C\x24");     /* mov rbx, [r12] */
+    JIT_EMIT(&a, "\xFF\xE2");             /* jmp rdx */
+    uint32_t offset = 0;
+    while (offset < proto->code_len) {
+        offsets[offset] = (uint32_t)a.buf.len;
+        jit_instruction(&a, proto, offset);
+        offset += 1 + (uint32_t)op_operand_count((OpCode)proto->code[offset]);
     }
-    if (obj_r.value.type != VAL_TABLE) {
-        return error_msg("undefine on non-table");
+    offsets[offset] = (uint32_t)a.buf.len;
+    jit_exit(&a, offset);
+    for (size_t i = 0; i < a.patch_count; i++) {
+        size_t at = a.patches[i].at;
+        uint32_t rel = offsets[a.patches[i].target] - (uint32_t)(at + 4);
+        memcpy(a.buf.bytes + at, &rel, 4);
     }
-    if (idx_r.value.type == VAL_STRING &&
-        strcmp(idx_r.value.as.str->data, "proto") == 0) {
-        return error_msg("cannot undefine proto");
+    free(a.patches);
+
+    void *mem = mmap(NULL, a.buf.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        free(a.buf.bytes);
+        free(offsets);
+        g_jit_enabled = false;
+        return;
     }
-    if (!table_delete(obj_r.value.as.table, idx_r.value)) {
-        return error_msg("object is frozen");
+    memcpy(mem, a.buf.bytes, a.buf.len);
+    free(a.buf.bytes);
+    if (mprotect(mem, a.buf.len, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, a.buf.len);
+        free(offsets);
+        g_jit_enabled = false;
+        return;
     }
-    return ok(make_null());
+    struct Jit *jit = xmalloc(sizeof(struct Jit));
+    jit->code = (JitCode)mem;
+    jit->offsets = offsets;
+    jit->entry = (const uint8_t *)mem + offsets[0];
+    proto->jit = jit;
 }
 
-static EvalResult eval_node(Node *node, Env *env, const char *module_dir) {
-    switch (node->type) {
-    case NODE_LITERAL:
-        return ok(node->as.literal);
-    case NODE_VAR: {
-        Value out;
-        if (!env_get(env, node->as.var.name, &out)) {
-            return error_msg("undefined variable");
-        }
-        return ok(out);
+static void jit_note_call(Proto *proto) {
+    if (g_jit_enabled && !proto->jit && ++proto->calls >= JIT_HOT_CALLS) {
+        jit_compile(proto);
     }
-    case NODE_ASSIGN: {
-        EvalResult value_r = eval_node(node->as.assign.value, env, module_dir);
-        if (value_r.is_exception) {
-            return value_r;
+}
+
+/*
+ * Runs frame's native code from ip. Native calls and returns may leave a
+ * different frame on top; its ip is set to where the interpreter resumes.
+ */
+static void jit_run(CallFrame *frame, uint32_t *ip, Value **sp) {
+    uint32_t resume = frame->proto->jit->code(sp, frame, jit_entry(frame->proto, (uint32_t)(ip - frame->proto->code)));
+    CallFrame *top = &vm.frames[vm.frame_count - 1];
+    top->ip = top->proto->code + resume;
+}
+
+#define JIT_NOTE_CALL(proto) jit_note_call(proto)
+#define JIT_ENTER()                          \
+    if (frame->proto->jit) {                 \
+        jit_run(frame, ip, &sp);             \
+        LOAD_FRAME();                        \
+    }
+#else
+#define JIT_NOTE_CALL(proto) ((void)0)
+#define JIT_ENTER()
+#endif
+
+static EvalResult vm_run(void) {
+    size_t base_frame = vm.frame_count - 1;
+    size_t handler_base = vm.handler_count;
+    CallFrame *frame;
+    uint32_t *code;
+    uint32_t *ip;
+    Value *consts;
+    Value *sp = vm.sp;
+    Value exc;
+
+#define LOAD_FRAME()                            \
+    do {                                        \
+        frame = &vm.frames[vm.frame_count - 1]; \
+        code = frame->proto->code;              \
+        consts = frame->proto->consts;          \
+        ip = frame->ip;                         \
+    } while (0)
+#define READ() (*ip++)
+#define PUSH(v) (*sp++ = (v))
+#define POP() (*--sp)
+#define PEEK(n) (sp[-1 - (n)])
+#define THROW_VALUE(v)    \
+    do {                  \
+        exc = (v);        \
+        goto vm_throw;    \
+    } while (0)
+#define THROW_MSG(msg) THROW_VALUE(make_string_value(msg, strlen(msg)))
+/* Collects if one is pending; every live value is on the VM stack here. */
+#define GC_SAFEPOINT()                  \
+    if (g_heap.pending) {               \
+        vm.sp = sp;                     \
+        if (!gc_collect()) {            \
+            THROW_MSG("out of memory"); \
+        }                               \
+    }
+/*
+ * Applies an operator to two small ints in place; anything else takes
+ * binary_op. Not wrapped in do/while because VM_NEXT() may be `continue`.
+ */
+#define INT_BINARY(result)                                                  \
+    if (!value_is_small_int(PEEK(1)) || !value_is_small_int(PEEK(0))) { \
+        goto vm_binary;                                                 \
+    }                                                                   \
+    sp[-2] = (result);                                                  \
+    sp--;                                                               \
+    VM_NEXT()
+
+#ifdef PROTOLEX_COMPUTED_GOTO
+    static void *dispatch_table[] = {
+#define X(op) &&L_##op,
+        PROTOLEX_OPCODES(X)
+#undef X
+    };
+#define VM_CASE(op) L_##op:
+#define VM_NEXT() goto *dispatch_table[*ip++]
+#define VM_DISPATCH() VM_NEXT();
+#else
+#define VM_CASE(op) case op:
+#define VM_NEXT() continue
+#define VM_DISPATCH() switch ((OpCode)*ip++)
+#endif
+
+    LOAD_FRAME();
+    JIT_ENTER();
+    for (;;) {
+        VM_DISPATCH() {
+        VM_CASE(OP_CONST) {
+            PUSH(consts[READ()]);
+            VM_NEXT();
         }
-        if (value_r.value.type == VAL_UNDEFINED) {
-            return error_msg("cannot assign undefined");
+        VM_CASE(OP_NULL) {
+            PUSH(make_null());
+            VM_NEXT();
         }
-        Node *target = node->as.assign.target;
-        if (target->type == NODE_VAR) {
-            env_assign(env, target->as.var.name, value_r.value);
-            return ok(value_r.value);
+        VM_CASE(OP_POP) {
+            sp--;
+            VM_NEXT();
+        }
+        VM_CASE(OP_GET_LOCAL) {
+            Value v = frame->env->slots[READ()];
+            if (value_is_unbound(v)) {
+                THROW_MSG("undefined variable");
+            }
+            PUSH(v);
+            VM_NEXT();
+        }
+        VM_CASE(OP_SET_LOCAL) {
+            frame->env->slots[READ()] = PEEK(0);
+            gc_env_barrier(frame->env, PEEK(0));
+            VM_NEXT();
+        }
+        VM_CASE(OP_GET_VAR) {
+            Env *env = env_at(frame->env, READ());
+            Value v = env->slots[READ()];
+            if (value_is_unbound(v)) {
+                THROW_MSG("undefined variable");
+            }
+            PUSH(v);
+            VM_NEXT();
         }
-        if (target->type == NODE_DOT) {
-            EvalResult obj_r = eval_node(target->as.dot.object, env, module_dir);
-            if (obj_r.is_exception) {
-                return obj_r;
+        VM_CASE(OP_SET_VAR) {
+            Env *env = env_at(frame->env, READ());
+            env->slots[READ()] = PEEK(0);
+            gc_env_barrier(env, PEEK(0));
+            VM_NEXT();
+        }
+        VM_CASE(OP_CHECK_ASSIGN) {
+            if (value_type(PEEK(0)) == VAL_UNDEFINED) {
+                THROW_MSG("cannot assign undefined");
             }
-            if (obj_r.value.type != VAL_TABLE) {
-                return error_msg("assignment on non-table");
+            VM_NEXT();
+        }
+        VM_CASE(OP_PUSH_SCOPE) {
+            frame->env = vm_scope_env(frame, READ());
+            VM_NEXT();
+        }
+        VM_CASE(OP_POP_SCOPE) {
+            Env *env = frame->env;
+            frame->env = env->parent;
+            if (vm_env_on_stack(env)) {
+                vm.env_top = (size_t)((Value *)env - vm.env_stack);
             }
-            if (strcmp(target->as.dot.name, "proto") == 0) {
-                if (!table_set_proto(obj_r.value.as.table, value_r.value)) {
-                    return error_msg("invalid proto");
-                }
-                return ok(value_r.value);
+            VM_NEXT();
+        }
+        VM_CASE(OP_GET_FIELD) {
+            Value key = consts[READ()];
+            InlineCache *ic = &frame->proto->ics[READ()];
+            if (value_type(PEEK(0)) != VAL_TABLE) {
+                THROW_MSG("lookup on non-table");
+            }
+            sp[-1] = table_get_cached(ic, as_table(PEEK(0)), key);
+            VM_NEXT();
+        }
+        VM_CASE(OP_SET_FIELD) {
+            Value key = consts[READ()];
+            InlineCache *ic = &frame->proto->ics[READ()];
+            Value obj = POP();
+            if (value_type(obj) != VAL_TABLE) {
+                THROW_MSG("assignment on non-table");
             }
-            Value key = make_string_value(target->as.dot.name, strlen(target->as.dot.name));
-            if (!table_set(obj_r.value.as.table, key, value_r.value)) {
-                return error_msg("object is frozen");
+            if (!table_set_cached(ic, as_table(obj), key, PEEK(0))) {
+                THROW_MSG("object is frozen");
             }
-            return ok(value_r.value);
+            VM_NEXT();
         }
-        if (target->type == NODE_INDEX) {
-            EvalResult obj_r = eval_node(target->as.index.object, env, module_dir);
-            if (obj_r.is_exception) {
-                return obj_r;
+        VM_CASE(OP_SET_PROTO) {
+            Value obj = POP();
+            if (value_type(obj) != VAL_TABLE) {
+                THROW_MSG("assignment on non-table");
+            }
+            if (!table_set_proto(as_table(obj), PEEK(0))) {
+                THROW_MSG("invalid proto");
             }
-            EvalResult idx_r = eval_node(target->as.index.index, env, module_dir);
-            if (idx_r.is_exception) {
-                return idx_r;
+            VM_NEXT();
+        }
+        VM_CASE(OP_GET_INDEX) {
+            Value idx = POP();
+            if (value_type(PEEK(0)) != VAL_TABLE) {
+                THROW_MSG("index on non-table");
             }
-            if (obj_r.value.type != VAL_TABLE) {
-                return error_msg("assignment on non-table");
+            sp[-1] = table_get(as_table(PEEK(0)), idx);
+            VM_NEXT();
+        }
+        VM_CASE(OP_SET_INDEX) {
+            Value idx = POP();
+            Value obj = POP();
+            if (value_type(obj) != VAL_TABLE) {
+                THROW_MSG("assignment on non-table");
             }
-            if (idx_r.value.type == VAL_STRING &&
-                strcmp(idx_r.value.as.str->data, "proto") == 0) {
-                if (!table_set_proto(obj_r.value.as.table, value_r.value)) {
-                    return error_msg("invalid proto");
+            if (value_type(idx) == VAL_STRING && strcmp(as_string(idx)->data, "proto") == 0) {
+                if (!table_set_proto(as_table(obj), PEEK(0))) {
+                    THROW_MSG("invalid proto");
                 }
-                return ok(value_r.value);
+                VM_NEXT();
             }
-            if (!table_set(obj_r.value.as.table, idx_r.value, value_r.value)) {
-                return error_msg("object is frozen");
+            if (!table_set(as_table(obj), idx, PEEK(0))) {
+                THROW_MSG("object is frozen");
             }
-            return ok(value_r.value);
+            VM_NEXT();
         }
-        return error_msg("invalid assignment");
-    }
-    case NODE_BINARY: {
-        EvalResult left_r = eval_node(node->as.binary.left, env, module_dir);
-        if (left_r.is_exception) {
-            return left_r;
+        VM_CASE(OP_UNDEFINE_FIELD) {
+            Value key = consts[READ()];
+            if (value_type(PEEK(0)) != VAL_TABLE) {
+                THROW_MSG("undefine on non-table");
+            }
+            if (!table_delete(as_table(PEEK(0)), key)) {
+                THROW_MSG("object is frozen");
+            }
+            sp[-1] = make_null();
+            VM_NEXT();
         }
-        EvalResult right_r = eval_node(node->as.binary.right, env, module_dir);
-        if (right_r.is_exception) {
-            return right_r;
+        VM_CASE(OP_UNDEFINE_PROTO) {
+            if (value_type(PEEK(0)) != VAL_TABLE) {
+                THROW_MSG("undefine on non-table");
+            }
+            THROW_MSG("cannot undefine proto");
         }
-        return eval_binary(node->as.binary.op, left_r.value, right_r.value);
-    }
-    case NODE_UNARY: {
-        EvalResult inner = eval_node(node->as.unary.expr, env, module_dir);
-        if (inner.is_exception) {
-            return inner;
+        VM_CASE(OP_UNDEFINE_INDEX) {
+            Value idx = POP();
+            if (value_type(PEEK(0)) != VAL_TABLE) {
+                THROW_MSG("undefine on non-table");
+            }
+            if (value_type(idx) == VAL_STRING && strcmp(as_string(idx)->data, "proto") == 0) {
+                THROW_MSG("cannot undefine proto");
+            }
+            if (!table_delete(as_table(PEEK(0)), idx)) {
+                THROW_MSG("object is frozen");
+            }
+            sp[-1] = make_null();
+            VM_NEXT();
         }
-        if (strcmp(node->as.unary.op, "!") == 0) {
-            return ok(make_bool(!value_is_truthy(inner.value)));
+        VM_CASE(OP_NEW_TABLE) {
+            PUSH(make_table(table_new_sized(READ())));
+            VM_NEXT();
         }
-        if (strcmp(node->as.unary.op, "-") == 0) {
-            if (inner.value.type == VAL_FLOAT) {
-                return ok(make_float(-inner.value.as.f));
+        VM_CASE(OP_INIT_FIELD) {
+            Value key = consts[READ()];
+            Value v = POP();
+            table_set(as_table(PEEK(0)), key, v);
+            VM_NEXT();
+        }
+        VM_CASE(OP_INIT_PROTO) {
+            Value v = POP();
+            if (!table_set_proto(as_table(PEEK(0)), v)) {
+                THROW_MSG("invalid proto");
             }
-            return ok(make_int(-inner.value.as.i));
+            VM_NEXT();
         }
-        return error_msg("unknown unary op");
-    }
-    case NODE_CALL: {
-        EvalResult callee_r = eval_node(node->as.call.callee, env, module_dir);
-        if (callee_r.is_exception) {
-            return callee_r;
+        VM_CASE(OP_ADD) {
+            INT_BINARY(make_int(as_int(PEEK(1)) + as_int(PEEK(0))));
+        }
+        VM_CASE(OP_SUB) {
+            INT_BINARY(make_int(as_int(PEEK(1)) - as_int(PEEK(0))));
+        }
+        VM_CASE(OP_MUL) {
+            INT_BINARY(make_int(as_int(PEEK(1)) * as_int(PEEK(0))));
         }
-        size_t argc = node->as.call.args.count;
-        Value *argv = xmalloc(sizeof(Value) * argc);
-        for (size_t i = 0; i < argc; i++) {
-            EvalResult arg_r = eval_node(node->as.call.args.items[i], env, module_dir);
-            if (arg_r.is_exception) {
-                free(argv);
-                return arg_r;
+        VM_CASE(OP_DIV) {
+            if (PEEK(0).bits == make_int(0).bits) {
+                goto vm_binary;
             }
-            argv[i] = arg_r.value;
+            INT_BINARY(make_int(as_int(PEEK(1)) / as_int(PEEK(0))));
         }
-        EvalResult res = eval_call(callee_r.value, (int)argc, argv, module_dir);
-        free(argv);
-        return res;
-    }
-    case NODE_DOT: {
-        EvalResult obj_r = eval_node(node->as.dot.object, env, module_dir);
-        if (obj_r.is_exception) {
-            return obj_r;
+        VM_CASE(OP_EQ) {
+            INT_BINARY(make_bool(as_int(PEEK(1)) == as_int(PEEK(0))));
         }
-        if (obj_r.value.type != VAL_TABLE) {
-            return error_msg("lookup on non-table");
+        VM_CASE(OP_NE) {
+            INT_BINARY(make_bool(as_int(PEEK(1)) != as_int(PEEK(0))));
         }
-        Value key = make_string_value(node->as.dot.name, strlen(node->as.dot.name));
-        return ok(table_get(obj_r.value.as.table, key));
-    }
-    case NODE_INDEX: {
-        EvalResult obj_r = eval_node(node->as.index.object, env, module_dir);
-        if (obj_r.is_exception) {
-            return obj_r;
+        VM_CASE(OP_LT) {
+            INT_BINARY(make_bool(as_int(PEEK(1)) < as_int(PEEK(0))));
         }
-        EvalResult idx_r = eval_node(node->as.index.index, env, module_dir);
-        if (idx_r.is_exception) {
-            return idx_r;
+        VM_CASE(OP_LE) {
+            INT_BINARY(make_bool(as_int(PEEK(1)) <= as_int(PEEK(0))));
         }
-        if (obj_r.value.type != VAL_TABLE) {
-            return error_msg("index on non-table");
+        VM_CASE(OP_GT) {
+            INT_BINARY(make_bool(as_int(PEEK(1)) > as_int(PEEK(0))));
         }
-        return ok(table_get(obj_r.value.as.table, idx_r.value));
-    }
-    case NODE_IF: {
-        EvalResult cond = eval_node(node->as.if_expr.cond, env, module_dir);
-        if (cond.is_exception) {
-            return cond;
+        VM_CASE(OP_GE) {
+            INT_BINARY(make_bool(as_int(PEEK(1)) >= as_int(PEEK(0))));
         }
-        if (value_is_truthy(cond.value)) {
-            return eval_block(node->as.if_expr.then_branch, env, module_dir, true);
+        VM_CASE(OP_AND)
+        VM_CASE(OP_OR) {
+        vm_binary:;
+            EvalResult r = binary_op((OpCode)ip[-1], PEEK(1), PEEK(0));
+            if (r.is_exception) {
+                THROW_VALUE(r.value);
+            }
+            sp--;
+            sp[-1] = r.value;
+            VM_NEXT();
         }
-        if (node->as.if_expr.else_branch) {
-            return eval_block(node->as.if_expr.else_branch, env, module_dir, true);
+        VM_CASE(OP_NOT) {
+            sp[-1] = make_bool(!value_is_truthy(PEEK(0)));
+            VM_NEXT();
         }
-        return ok(make_null());
-    }
-    case NODE_FN: {
-        Function *fn = xmalloc(sizeof(Function));
-        fn->is_native = false;
-        fn->arity = (int)node->as.fn.params.count;
-        fn->params = node->as.fn.params;
-        fn->body = node->as.fn.body;
-        fn->env = env;
-        fn->native = NULL;
-        return ok(make_function(fn));
-    }
-    case NODE_IMPORT: {
-        const char *path = node->as.import_stmt.path;
-        Value lib;
-        if (runtime_import(path, env, &lib)) {
-            env_define(env, node->as.import_stmt.name, lib);
-            return ok(lib);
-        }
-        char full[1024];
-        FILE *f = try_open_module(path, module_dir, full, sizeof(full));
-        if (!f) {
-            return error_msg("cannot open module");
-        }
-        fseek(f, 0, SEEK_END);
-        long len = ftell(f);
-        fseek(f, 0, SEEK_SET);
-        char *src = xmalloc(len + 1);
-        fread(src, 1, len, f);
-        src[len] = '\0';
-        fclose(f);
-
-        TokenList tokens = lex_source(src);
-        Parser parser;
-        parser.tokens = tokens;
-        parser.current = 0;
-        set_parse_context(&parser, full);
-        Node *program = parse_program(&parser);
-        clear_parse_context();
-
-        char *dir = NULL;
-        char *slash = strrchr(full, '/');
-        if (slash) {
-            dir = xstrndup(full, (size_t)(slash - full));
+        VM_CASE(OP_NEG) {
+            Value v = PEEK(0);
+            if (value_type(v) == VAL_FLOAT) {
+                sp[-1] = make_float(-as_float(v));
+            } else if (value_type(v) == VAL_INT) {
+                sp[-1] = make_int(-as_int(v));
+            } else {
+                THROW_MSG("non-numeric '-'");
+            }
+            VM_NEXT();
         }
-        Env *mod_env = env_new(env);
-        EvalResult res = eval_block(program, mod_env, dir, false);
-        if (dir) {
-            free(dir);
+        VM_CASE(OP_JUMP) {
+            ip = code + *ip;
+            VM_NEXT();
         }
-        if (res.is_exception) {
-            return res;
+        VM_CASE(OP_JUMP_IF_FALSE) {
+            uint32_t target = READ();
+            if (!value_is_truthy(POP())) {
+                ip = code + target;
+            }
+            VM_NEXT();
         }
-        env_define(env, node->as.import_stmt.name, res.value);
-        return ok(res.value);
-    }
-    case NODE_MUTATE: {
-        EvalResult target = eval_node(node->as.mutate.target, env, module_dir);
-        if (target.is_exception) {
-            return target;
+        VM_CASE(OP_CALL) {
+            GC_SAFEPOINT();
+            int argc = (int)READ();
+            Value *base = sp - argc - 1;
+            if (value_type(*base) != VAL_FUNCTION) {
+                THROW_MSG("call on non-function");
+            }
+            Function *fn = as_function(*base);
+            if (fn->is_native) {
+                vm.sp = sp;
+                EvalResult r = call_native(fn, argc, base + 1);
+                sp = base;
+                if (r.is_exception) {
+                    THROW_VALUE(r.value);
+                }
+                PUSH(r.value);
+                VM_NEXT();
+            }
+            if (argc != fn->arity) {
+                THROW_MSG("arity mismatch");
+            }
+            if (!vm_has_room(fn->proto, sp)) {
+                THROW_MSG("stack overflow");
+            }
+            JIT_NOTE_CALL(fn->proto);
+            frame->ip = ip;
+            vm_push_frame(fn, base, false);
+            LOAD_FRAME();
+            JIT_ENTER();
+            VM_NEXT();
         }
-        if (target.value.type != VAL_TABLE) {
-            return error_msg("mutate on non-table");
+        VM_CASE(OP_TAIL_CALL) {
+            GC_SAFEPOINT();
+            int argc = (int)READ();
+            Value *base = sp - argc - 1;
+            if (value_type(*base) != VAL_FUNCTION) {
+                THROW_MSG("call on non-function");
+            }
+            Function *fn = as_function(*base);
+            if (fn->is_native) {
+                vm.sp = sp;
+                EvalResult r = call_native(fn, argc, base + 1);
+                sp = base;
+                if (r.is_exception) {
+                    THROW_VALUE(r.value);
+                }
+                PUSH(r.value);
+                goto vm_return;
+            }
+            if (argc != fn->arity) {
+                THROW_MSG("arity mismatch");
+            }
+            /* Slide the callee and arguments down over the current frame. */
+            Value *dst = frame->base;
+            if (dst + argc + 1 + fn->proto->max_stack + 1 > vm.stack + VM_STACK_MAX) {
+                THROW_MSG("stack overflow");
+            }
+            JIT_NOTE_CALL(fn->proto);
+            memmove(dst, base, sizeof(Value) * (size_t)(argc + 1));
+            sp = dst + argc + 1;
+            vm.env_top = frame->env_mark;
+            Env *env = vm_call_env(fn->proto, fn->env);
+            vm_bind_args(env, fn, dst);
+            frame->proto = fn->proto;
+            frame->env = env;
+            frame->locals = env;
+            code = fn->proto->code;
+            consts = fn->proto->consts;
+            ip = code;
+            JIT_ENTER();
+            VM_NEXT();
         }
-        Table *t = target.value.as.table;
-        table_adjust_thaw(t, 1);
-        EvalResult res = eval_block(node->as.mutate.body, env, module_dir, true);
-        table_adjust_thaw(t, -1);
-        if (res.is_exception) {
-            return res;
+        VM_CASE(OP_CLOSURE) {
+            Proto *child = frame->proto->protos[READ()];
+            Function *fn = gc_alloc(GC_FUNCTION, sizeof(Function));
+            fn->is_native = false;
+            fn->arity = child->arity;
+            fn->proto = child;
+            fn->env = frame->env;
+            fn->native = NULL;
+            PUSH(make_function(fn));
+            VM_NEXT();
         }
-        return res;
-    }
-    case NODE_UNDEFINE:
-        return eval_undefine(node, env, module_dir);
-    case NODE_TRY: {
-        EvalResult attempt = eval_block(node->as.try_expr.try_block, env, module_dir, true);
-        EvalResult handled = attempt;
-        if (attempt.is_exception && node->as.try_expr.catch_block) {
-            if (node->as.try_expr.catch_any) {
-                handled = eval_block(node->as.try_expr.catch_block, env, module_dir, true);
-            } else {
-                Env *catch_env = env_new(env);
-                env_define(catch_env, node->as.try_expr.catch_name, attempt.value);
-                handled = eval_block(node->as.try_expr.catch_block, catch_env, module_dir, true);
+        VM_CASE(OP_IMPORT) {
+            const char *path = as_string(consts[READ()])->data;
+            Value lib;
+            if (runtime_import(path, frame->env, &lib)) {
+                PUSH(lib);
+                VM_NEXT();
+            }
+            Module *module = load_module(path, frame->proto->module_dir);
+            if (!module) {
+                THROW_MSG("cannot open module");
+            }
+            if (module->loaded) {
+                PUSH(module->value);
+                VM_NEXT();
             }
+            if (vm_module_running(module)) {
+                THROW_MSG("import cycle");
+            }
+            if (!vm_has_room(module->proto, sp)) {
+                THROW_MSG("stack overflow");
+            }
+            frame->ip = ip;
+            PUSH(make_null());
+            CallFrame *mod = &vm.frames[vm.frame_count++];
+            mod->proto = module->proto;
+            mod->ip = module->proto->code;
+            mod->base = sp - 1;
+            mod->env = env_new(g_root_env, (size_t)module->proto->slot_count);
+            mod->locals = NULL;
+            mod->env_mark = vm.env_top;
+            mod->boundary = false;
+            mod->module = module;
+            LOAD_FRAME();
+            VM_NEXT();
         }
-        if (node->as.try_expr.finally_block) {
-            EvalResult fin = eval_block(node->as.try_expr.finally_block, env, module_dir, true);
-            if (fin.is_exception) {
-                runtime_fatal("finally cannot throw");
+        VM_CASE(OP_MUTATE_BEGIN) {
+            Value target = POP();
+            if (value_type(target) != VAL_TABLE) {
+                THROW_MSG("mutate on non-table");
             }
+            table_thaw_begin(as_table(target));
+            vm_push_handler(HANDLER_MUTATE)->table = as_table(target);
+            VM_NEXT();
         }
-        return handled;
-    }
-    case NODE_THROW: {
-        EvalResult val = eval_node(node->as.throw_expr.expr, env, module_dir);
-        if (val.is_exception) {
-            return val;
+        VM_CASE(OP_MUTATE_END) {
+            vm.handler_count--;
+            table_thaw_end();
+            VM_NEXT();
         }
-        return exception(val.value);
-    }
-    case NODE_TABLE: {
-        Table *t = table_new();
-        for (size_t i = 0; i < node->as.table.items.count; i++) {
-            char *key = node->as.table.items.keys[i];
-            EvalResult val = eval_node(node->as.table.items.values[i], env, module_dir);
-            if (val.is_exception) {
-                return val;
-            }
-            if (strcmp(key, "proto") == 0) {
-                if (!table_set_proto(t, val.value)) {
-                    return error_msg("invalid proto");
-                }
-            } else {
-                Value k = make_string_value(key, strlen(key));
-                if (!table_set(t, k, val.value)) {
-                    return error_msg("object is frozen");
-                }
+        VM_CASE(OP_TRY_BEGIN) {
+            Handler *h = vm_push_handler(HANDLER_TRY);
+            h->sp = sp;
+            h->env = frame->env;
+            h->target = code + READ();
+            VM_NEXT();
+        }
+        VM_CASE(OP_TRY_END)
+        VM_CASE(OP_FINALLY_END) {
+            vm.handler_count--;
+            VM_NEXT();
+        }
+        VM_CASE(OP_FINALLY_BEGIN) {
+            vm_push_handler(HANDLER_FINALLY);
+            VM_NEXT();
+        }
+        VM_CASE(OP_THROW) {
+            THROW_VALUE(POP());
+        }
+        VM_CASE(OP_THROW_MSG) {
+            THROW_VALUE(consts[READ()]);
+        }
+        VM_CASE(OP_RETURN) {
+        vm_return:;
+            Value result = POP();
+            bool boundary = frame->boundary;
+            if (frame->module) {
+                frame->module->value = result;
+                frame->module->loaded = true;
+            }
+            sp = frame->base;
+            vm.env_top = frame->env_mark;
+            PUSH(result);
+            vm.frame_count--;
+            if (boundary) {
+                vm.sp = sp;
+                return ok(result);
+            }
+            LOAD_FRAME();
+            JIT_ENTER();
+            VM_NEXT();
+        }
+#ifndef PROTOLEX_COMPUTED_GOTO
+        default:
+            break;
+#endif
+        }
+#ifndef PROTOLEX_COMPUTED_GOTO
+        runtime_fatal("unknown opcode");
+#endif
+
+    vm_throw:;
+        bool caught = false;
+        while (!caught && vm.handler_count > handler_base) {
+            Handler *h = &vm.handlers[--vm.handler_count];
+            if (h->kind == HANDLER_MUTATE) {
+                table_thaw_end();
+                continue;
+            }
+            if (h->kind == HANDLER_FINALLY) {
+                runtime_fatal("finally cannot throw");
             }
+            vm.frame_count = h->frame_count;
+            LOAD_FRAME();
+            frame->env = h->env;
+            vm.env_top = h->env_top;
+            ip = h->target;
+            sp = h->sp;
+            PUSH(exc);
+            caught = true;
+        }
+        if (!caught) {
+            break;
         }
-        return ok(make_table(t));
     }
-    case NODE_BLOCK:
-        return eval_block(node, env, module_dir, false);
+    vm.env_top = vm.frames[base_frame].env_mark;
+    vm.frame_count = base_frame;
+    return exception(exc);
+
+#undef LOAD_FRAME
+#undef READ
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef THROW_VALUE
+#undef THROW_MSG
+#undef GC_SAFEPOINT
+#undef INT_BINARY
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_DISPATCH
+}
+
+static EvalResult vm_call(Value callee, int argc, Value *argv) {
+    if (value_type(callee) != VAL_FUNCTION) {
+        return error_msg("call on non-function");
+    }
+    Function *fn = as_function(callee);
+    if (fn->is_native) {
+        return call_native(fn, argc, argv);
+    }
+    if (argc != fn->arity) {
+        return error_msg("arity mismatch");
+    }
+    vm_init();
+    Value *entry_sp = vm.sp;
+    if (!vm_has_room(fn->proto, entry_sp + argc + 1)) {
+        return error_msg("stack overflow");
+    }
+    *vm.sp++ = callee;
+    for (int i = 0; i < argc; i++) {
+        *vm.sp++ = argv[i];
     }
-    return error_msg("unknown node");
+    vm_push_frame(fn, entry_sp, true);
+    EvalResult res = vm_run();
+    vm.sp = entry_sp;
+    return res;
+}
+
+EvalResult call_function(Value callee, int argc, Value *argv, const char *module_dir) {
+    (void)module_dir;
+    return vm_call(callee, argc, argv);
+}
+
+/* Runs a program in a fresh scope under the root env. */
+static EvalResult vm_run_program(Module *module, Env *root) {
+    Proto *proto = module->proto;
+    vm_init();
+    Value *entry_sp = vm.sp;
+    *vm.sp++ = make_null();
+    CallFrame *frame = &vm.frames[vm.frame_count++];
+    frame->proto = proto;
+    frame->ip = proto->code;
+    frame->base = entry_sp;
+    frame->env = env_new(root, (size_t)proto->slot_count);
+    frame->locals = NULL;
+    frame->env_mark = vm.env_top;
+    frame->boundary = true;
+    frame->module = module;
+    EvalResult res = vm_run();
+    vm.sp = entry_sp;
+    return res;
 }
 
 static Value native_clone(int argc, Value *argv, EvalResult *err) {
@@ -2134,16 +6913,16 @@ static Value native_clone(int argc, Value *argv, EvalResult *err) {
 
 static Value native_has(int argc, Value *argv, EvalResult *err) {
     (void)err;
-    if (argc != 2 || argv[0].type != VAL_TABLE) {
+    if (argc != 2 || value_type(argv[0]) != VAL_TABLE) {
         return make_bool(false);
     }
-    return make_bool(table_has_local(argv[0].as.table, argv[1]));
+    return make_bool(table_has_local(as_table(argv[0]), argv[1]));
 }
 
 static Value native_freeze(int argc, Value *argv, EvalResult *err) {
     (void)err;
-    if (argc == 1 && argv[0].type == VAL_TABLE) {
-        argv[0].as.table->frozen = true;
+    if (argc == 1 && value_type(argv[0]) == VAL_TABLE) {
+        table_freeze(as_table(argv[0]));
     }
     return make_null();
 }
@@ -2154,7 +6933,7 @@ static Value native_is_absent(int argc, Value *argv, EvalResult *err) {
         err->value = make_string_value("isAbsent expects (value)", 23);
         return make_null();
     }
-    return make_bool(argv[0].type == VAL_UNDEFINED);
+    return make_bool(value_type(argv[0]) == VAL_UNDEFINED);
 }
 
 static Value native_is_int(int argc, Value *argv, EvalResult *err) {
@@ -2163,7 +6942,7 @@ static Value native_is_int(int argc, Value *argv, EvalResult *err) {
         err->value = make_string_value("isInt expects (value)", 22);
         return make_null();
     }
-    return make_bool(argv[0].type == VAL_INT);
+    return make_bool(value_type(argv[0]) == VAL_INT);
 }
 
 static Value native_is_float(int argc, Value *argv, EvalResult *err) {
@@ -2172,7 +6951,7 @@ static Value native_is_float(int argc, Value *argv, EvalResult *err) {
         err->value = make_string_value("isFloat expects (value)", 24);
         return make_null();
     }
-    return make_bool(argv[0].type == VAL_FLOAT);
+    return make_bool(value_type(argv[0]) == VAL_FLOAT);
 }
 
 static Value native_is_string(int argc, Value *argv, EvalResult *err) {
@@ -2181,7 +6960,7 @@ static Value native_is_string(int argc, Value *argv, EvalResult *err) {
         err->value = make_string_value("isString expects (value)", 25);
         return make_null();
     }
-    return make_bool(argv[0].type == VAL_STRING);
+    return make_bool(value_type(argv[0]) == VAL_STRING);
 }
 
 static Value native_is_bool(int argc, Value *argv, EvalResult *err) {
@@ -2190,7 +6969,7 @@ static Value native_is_bool(int argc, Value *argv, EvalResult *err) {
         err->value = make_string_value("isBool expects (value)", 23);
         return make_null();
     }
-    return make_bool(argv[0].type == VAL_BOOL);
+    return make_bool(value_type(argv[0]) == VAL_BOOL);
 }
 
 static Value native_is_table(int argc, Value *argv, EvalResult *err) {
@@ -2199,7 +6978,7 @@ static Value native_is_table(int argc, Value *argv, EvalResult *err) {
         err->value = make_string_value("isTable expects (value)", 24);
         return make_null();
     }
-    return make_bool(argv[0].type == VAL_TABLE);
+    return make_bool(value_type(argv[0]) == VAL_TABLE);
 }
 
 static Value native_is_function(int argc, Value *argv, EvalResult *err) {
@@ -2208,64 +6987,50 @@ static Value native_is_function(int argc, Value *argv, EvalResult *err) {
         err->value = make_string_value("isFunction expects (value)", 27);
         return make_null();
     }
-    return make_bool(argv[0].type == VAL_FUNCTION);
+    return make_bool(value_type(argv[0]) == VAL_FUNCTION);
 }
 
-static Env *make_root_env(void) {
-    Env *env = env_new(NULL);
-    Function *clone_fn = xmalloc(sizeof(Function));
-    clone_fn->is_native = true;
-    clone_fn->native = native_clone;
-    env_define(env, "clone", make_function(clone_fn));
-
-    Function *has_fn = xmalloc(sizeof(Function));
-    has_fn->is_native = true;
-    has_fn->native = native_has;
-    env_define(env, "has", make_function(has_fn));
-
-    Function *freeze_fn = xmalloc(sizeof(Function));
-    freeze_fn->is_native = true;
-    freeze_fn->native = native_freeze;
-    env_define(env, "freeze", make_function(freeze_fn));
-
-    Function *is_absent_fn = xmalloc(sizeof(Function));
-    is_absent_fn->is_native = true;
-    is_absent_fn->native = native_is_absent;
-    env_define(env, "isAbsent", make_function(is_absent_fn));
-
-    Function *is_int_fn = xmalloc(sizeof(Function));
-    is_int_fn->is_native = true;
-    is_int_fn->native = native_is_int;
-    env_define(env, "isInt", make_function(is_int_fn));
-
-    Function *is_float_fn = xmalloc(sizeof(Function));
-    is_float_fn->is_native = true;
-    is_float_fn->native = native_is_float;
-    env_define(env, "isFloat", make_function(is_float_fn));
-
-    Function *is_string_fn = xmalloc(sizeof(Function));
-    is_string_fn->is_native = true;
-    is_string_fn->native = native_is_string;
-    env_define(env, "isString", make_function(is_string_fn));
-
-    Function *is_bool_fn = xmalloc(sizeof(Function));
-    is_bool_fn->is_native = true;
-    is_bool_fn->native = native_is_bool;
-    env_define(env, "isBool", make_function(is_bool_fn));
-
-    Function *is_table_fn = xmalloc(sizeof(Function));
-    is_table_fn->is_native = true;
-    is_table_fn->native = native_is_table;
-    env_define(env, "isTable", make_function(is_table_fn));
-
-    Function *is_function_fn = xmalloc(sizeof(Function));
-    is_function_fn->is_native = true;
-    is_function_fn->native = native_is_function;
-    env_define(env, "isFunction", make_function(is_function_fn));
+static const struct {
+    const char *name;
+    NativeFn fn;
+} builtins[] = {
+    {"clone", native_clone},
+    {"has", native_has},
+    {"freeze", native_freeze},
+    {"isAbsent", native_is_absent},
+    {"isInt", native_is_int},
+    {"isFloat", native_is_float},
+    {"isString", native_is_string},
+    {"isBool", native_is_bool},
+    {"isTable", native_is_table},
+    {"isFunction", native_is_function},
+};
+
+#define BUILTIN_COUNT (sizeof(builtins) / sizeof(builtins[0]))
 
+/* The root scope's slots are the builtins, in table order. */
+static void root_scope_init(Scope *s) {
+    scope_init(s, NULL);
+    for (size_t i = 0; i < BUILTIN_COUNT; i++) {
+        str_list_push(&s->names, (char *)builtins[i].name);
+    }
+}
+
+static Env *make_root_env(void) {
+    Env *env = env_new(NULL, BUILTIN_COUNT);
+    for (size_t i = 0; i < BUILTIN_COUNT; i++) {
+        Function *fn = xmalloc(sizeof(Function));
+        fn->is_native = true;
+        fn->native = builtins[i].fn;
+        env->slots[i] = make_function(fn);
+    }
     return env;
 }
 
+static size_t root_env_size(void) {
+    return BUILTIN_COUNT;
+}
+
 static char *read_file(const char *path) {
     FILE *f = fopen(path, "rb");
     if (!f) {
@@ -2282,8 +7047,59 @@ static char *read_file(const char *path) {
 }
 
 int main(int argc, char **argv) {
+    const char *prog = argv[0];
+    int first = 1;
+    for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+        if (strcmp(argv[first], "--gc-stats") == 0) {
+            if (!g_heap.stats) {
+                g_heap.stats = true;
+                atexit(gc_print_stats);
+            }
+        } else if (strcmp(argv[first], "--gc-pause-us") == 0 && first + 1 < argc) {
+            char *end = NULL;
+            long us = strtol(argv[++first], &end, 10);
+            if (!end || *end != '\0' || us <= 0) {
+                fprintf(stderr, "--gc-pause-us expects a positive number of microseconds\n");
+                return 1;
+            }
+            g_heap.pause_budget_us = us;
+        } else if (strcmp(argv[first], "--max-heap") == 0 && first + 1 < argc) {
+            char *end = NULL;
+            unsigned long long limit = strtoull(argv[++first], &end, 10);
+            int shift = 0;
+            if (end && (*end == 'K' || *end == 'k')) {
+                shift = 10;
+            } else if (end && (*end == 'M' || *end == 'm')) {
+                shift = 20;
+            } else if (end && (*end == 'G' || *end == 'g')) {
+                shift = 30;
+            }
+            if (shift) {
+                end++;
+            }
+            if (!end || *end != '\0' || limit == 0 || limit > (SIZE_MAX >> shift)) {
+                fprintf(stderr, "--max-heap expects a size in bytes, optionally with K, M or G\n");
+                return 1;
+            }
+            g_heap.limit = (size_t)limit << shift;
+        } else if (strcmp(argv[first], "--no-cache") == 0) {
+            g_module_cache = false;
+        } else if (strcmp(argv[first], "--jit") == 0) {
+#ifdef PROTOLEX_JIT
+            g_jit_enabled = true;
+#else
+            fprintf(stderr, "warning: --jit is not supported on this platform\n");
+#endif
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[first]);
+            return 1;
+        }
+    }
+    /* The script path becomes argv[1] from here on. */
+    argc -= first - 1;
+    argv += first - 1;
     if (argc < 2) {
-        fprintf(stderr, "usage: %s <file.plx>\n", argv[0]);
+        fprintf(stderr, "usage: %s [--jit] [--gc-stats] [--gc-pause-us N] [--max-heap SIZE] [--no-cache] <file.plx>\n", prog);
         return 1;
     }
     char *src = read_file(argv[1]);
@@ -2291,29 +7107,26 @@ int main(int argc, char **argv) {
         fprintf(stderr, "cannot open %s\n", argv[1]);
         return 1;
     }
-    TokenList tokens = lex_source(src);
-    Parser parser;
-    parser.tokens = tokens;
-    parser.current = 0;
-    set_parse_context(&parser, argv[1]);
-    Node *program = parse_program(&parser);
-    clear_parse_context();
-    Env *env = make_root_env();
+    g_malloc_reserve = malloc(MALLOC_RESERVE_BYTES);
+    g_root_env = make_root_env();
     char *dir = NULL;
     char *slash = strrchr(argv[1], '/');
     if (slash) {
         dir = xstrndup(argv[1], (size_t)(slash - argv[1]));
     }
     runtime_init(argc, argv, dir);
-    EvalResult res = eval_block(program, env, dir, false);
+    /* Registered like any module, so importing the script back is a cycle. */
+    char *canonical = realpath(argv[1], NULL);
+    if (!canonical) {
+        canonical = xstrndup(argv[1], strlen(argv[1]));
+    }
+    Module *main_module = module_add(canonical, compile_source(argv[1], src, dir));
+    EvalResult res = vm_run_program(main_module, g_root_env);
     if (res.is_exception) {
         fprintf(stderr, "uncaught exception: ");
         print_value(res.value);
         fprintf(stderr, "\n");
         return 1;
     }
-    if (dir) {
-        free(dir);
-    }
     return 0;
 }
@@ -5,11 +5,14 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
+/* Header and NUL-terminated bytes share one allocation. */
 typedef struct String {
-    char *data;
     size_t len;
     uint32_t hash;
+    bool interned; /* canonical: equal interned strings are the same String */
+    char data[];
 } String;
 
 typedef enum {
@@ -25,44 +28,177 @@ typedef enum {
 
 struct Function;
 struct Table;
-struct Node;
+struct Shape;
+struct Proto;
 struct Env;
+struct Rope;
 
+/*
+ * A Value is one NaN-boxed 64-bit word. Any bit pattern outside the
+ * tagged space is a double; NaNs are canonicalized by make_float so no
+ * real double lands there. Tagged values have the sign, exponent and
+ * quiet bits set, a 3-bit tag in bits 48-50 and a 48-bit payload:
+ *
+ *   VALUE_TAG_INT      signed 48-bit integer
+ *   VALUE_TAG_BIGINT   pointer to a heap int64_t, for ints outside 48 bits
+ *   VALUE_TAG_SPECIAL  null, false, true, undefined and internal markers
+ *   VALUE_TAG_STRING   String *
+ *   VALUE_TAG_TABLE    Table *
+ *   VALUE_TAG_FUNCTION Function *
+ *   VALUE_TAG_ROPE     Rope *, a string concatenation not yet flattened
+ *
+ * Inspect values only through value_type() and the as_*() accessors.
+ */
 typedef struct Value {
-    ValueType type;
-    union {
-        int64_t i;
-        double f;
-        bool b;
-        String *str;
-        struct Function *fn;
-        struct Table *table;
-    } as;
+    uint64_t bits;
 } Value;
 
-typedef struct {
-    Value key;
-    Value value;
-    bool used;
-    bool tombstone;
-} Entry;
+#define VALUE_TAGGED 0xFFF8000000000000ull
+#define VALUE_PAYLOAD 0x0000FFFFFFFFFFFFull
+#define VALUE_TAG_SHIFT 48
+
+enum {
+    VALUE_TAG_INT,
+    VALUE_TAG_BIGINT,
+    VALUE_TAG_SPECIAL,
+    VALUE_TAG_STRING,
+    VALUE_TAG_TABLE,
+    VALUE_TAG_FUNCTION,
+    VALUE_TAG_ROPE
+};
+
+enum {
+    VALUE_NULL,
+    VALUE_FALSE,
+    VALUE_TRUE,
+    VALUE_UNDEFINED,
+    VALUE_UNBOUND /* an Env slot before its first assignment, or an array hole */
+};
+
+#define VALUE_BITS(tag, payload) \
+    (VALUE_TAGGED | ((uint64_t)(tag) << VALUE_TAG_SHIFT) | ((uint64_t)(payload) & VALUE_PAYLOAD))
+#define VALUE_SPECIAL_BITS(which) VALUE_BITS(VALUE_TAG_SPECIAL, which)
+
+static inline bool value_is_tagged(Value v) {
+    return (v.bits & VALUE_TAGGED) == VALUE_TAGGED;
+}
+
+static inline unsigned value_tag(Value v) {
+    return (unsigned)((v.bits >> VALUE_TAG_SHIFT) & 7);
+}
+
+static inline void *value_pointer(Value v) {
+    return (void *)(uintptr_t)(v.bits & VALUE_PAYLOAD);
+}
+
+static inline ValueType value_type(Value v) {
+    if (!value_is_tagged(v)) {
+        return VAL_FLOAT;
+    }
+    switch (value_tag(v)) {
+    case VALUE_TAG_INT:
+    case VALUE_TAG_BIGINT:
+        return VAL_INT;
+    case VALUE_TAG_STRING:
+    case VALUE_TAG_ROPE:
+        return VAL_STRING;
+    case VALUE_TAG_TABLE:
+        return VAL_TABLE;
+    case VALUE_TAG_FUNCTION:
+        return VAL_FUNCTION;
+    default:
+        break;
+    }
+    switch (v.bits & VALUE_PAYLOAD) {
+    case VALUE_NULL:
+        return VAL_NULL;
+    case VALUE_FALSE:
+    case VALUE_TRUE:
+        return VAL_BOOL;
+    default:
+        return VAL_UNDEFINED;
+    }
+}
+
+/* True for ints that fit the 48-bit payload, the common case. */
+static inline bool value_is_small_int(Value v) {
+    return (v.bits >> VALUE_TAG_SHIFT) == (VALUE_TAGGED >> VALUE_TAG_SHIFT);
+}
+
+static inline int64_t as_int(Value v) {
+    if (value_is_small_int(v)) {
+        return (int64_t)(v.bits << 16) >> 16;
+    }
+    return *(int64_t *)value_pointer(v);
+}
+
+static inline double as_float(Value v) {
+    double d;
+    memcpy(&d, &v.bits, sizeof(d));
+    return d;
+}
+
+static inline bool as_bool(Value v) {
+    return v.bits == VALUE_SPECIAL_BITS(VALUE_TRUE);
+}
 
+String *rope_flatten(struct Rope *rope);
+
+/* Ropes are flattened on first access to their bytes. */
+static inline String *as_string(Value v) {
+    if (value_tag(v) == VALUE_TAG_ROPE) {
+        return rope_flatten((struct Rope *)value_pointer(v));
+    }
+    return (String *)value_pointer(v);
+}
+
+static inline struct Table *as_table(Value v) {
+    return (struct Table *)value_pointer(v);
+}
+
+static inline struct Function *as_function(Value v) {
+    return (struct Function *)value_pointer(v);
+}
+
+/*
+ * Open-addressing hash map in the style of a Swiss table. Slot i holds
+ * keys[i] and values[i]; ctrl[i] says whether it is empty, deleted, or full
+ * (then it holds 7 bits of the key's hash). All three arrays share one
+ * allocation. An empty map allocates nothing; up to MAP_SMALL keys are
+ * scanned linearly; bigger maps have a power-of-two number of 16-slot
+ * groups.
+ */
 typedef struct {
-    Entry *entries;
+    uint8_t *ctrl;
+    Value *keys;
+    Value *values;
     size_t capacity;
     size_t count;
+    size_t tombstones;
+    bool compact; /* every key is in its home group; set by freezing */
 } Map;
 
+/*
+ * A table keeps int keys 0..array_len-1 in a dense array next to its map;
+ * every other key, including ints past the end, lives in the map.
+ */
 typedef struct Table {
     Map map;
+    Value *array;
+    size_t array_len;
+    size_t array_cap;
+    size_t array_count; /* array slots that are not holes */
+    struct Shape *shape;
     struct Table *proto;
+    bool is_proto; /* some table has had it as its proto */
     bool frozen;
-    int thaw_count;
+    uint64_t thaw_epoch; /* mutate scope that last thawed it */
 } Table;
 
 typedef struct Env {
-    Map map;
     struct Env *parent;
+    size_t size;
+    Value slots[];
 } Env;
 
 typedef struct EvalResult {
@@ -81,8 +217,7 @@ typedef Value (*NativeFn)(int argc, Value *argv, EvalResult *err);
 typedef struct Function {
     bool is_native;
     int arity;
-    StrList params;
-    struct Node *body;
+    struct Proto *proto;
     Env *env;
     NativeFn native;
 } Function;
@@ -96,13 +231,61 @@ Value make_bool(bool v);
 Value make_null(void);
 Value make_undefined(void);
 Value make_string_value(const char *s, size_t len);
+Value make_interned_string(const char *s, size_t len);
+/* Builds a string in place: fill str->data[0..len), then seal it. */
+String *string_new(size_t len);
+Value string_seal(String *str);
+/*
+ * string_new for a length the program chose: collects if the string would
+ * not fit under --max-heap, then sets "out of memory" on err and returns
+ * NULL if it still does not fit or malloc fails. Natives call it before
+ * holding any value that is not on the VM stack.
+ */
+String *string_try_new(size_t len, EvalResult *err);
+/* a + b for two strings; long results are ropes, built in O(1). */
+Value string_concat(Value a, Value b);
 Value make_table(Table *t);
 Value make_function(Function *fn);
 
 Table *table_new(void);
+/* A table with room for key_count keys before it has to grow. */
+Table *table_new_sized(size_t key_count);
 bool table_set(Table *t, Value key, Value value);
+/* table_set without the frozen check, for natives updating their own tables. */
+void table_put(Table *t, Value key, Value value);
+Value table_get(Table *t, Value key);
 void table_freeze(Table *t);
 
+/* Keeps t alive through the current collection (for runtime roots). */
+void gc_mark_table(Table *t);
+
+typedef struct {
+    size_t bytes; /* tracked heap bytes currently allocated */
+    size_t minor_collections;
+    size_t major_collections;
+    size_t slices; /* incremental marking slices */
+    double last_slice_us;
+    double max_slice_us;
+    long pause_budget_us; /* 0 when major collections are not incremental */
+} GcStats;
+
+void gc_get_stats(GcStats *out);
+
+/* Tracked heap bytes, in total and by kind of storage. */
+typedef struct {
+    size_t bytes;
+    size_t peak;
+    size_t limit; /* --max-heap; 0 when unlimited */
+    size_t tables;
+    size_t entries; /* map and array storage of tables */
+    size_t strings;
+    size_t envs;
+    size_t functions;
+    size_t bigints;
+} HeapUsage;
+
+void heap_get_usage(HeapUsage *out);
+
 void print_value(Value v);
 void print_value_to(FILE *out, Value v);
 
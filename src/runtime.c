@@ -55,3 +55,18 @@ bool runtime_import(const char *path, Env *env, Value *out) {
     }
     return false;
 }
+
+void runtime_mark_roots(void) {
+    gc_mark_table(runtime_ctx.io);
+    gc_mark_table(runtime_ctx.time);
+    gc_mark_table(runtime_ctx.sys);
+    gc_mark_table(runtime_ctx.log);
+    gc_mark_table(runtime_ctx.string);
+    gc_mark_table(runtime_ctx.intlib);
+    gc_mark_table(runtime_ctx.floatlib);
+    gc_mark_table(runtime_ctx.mathlib);
+    gc_mark_table(runtime_ctx.sys_args);
+    gc_mark_table(runtime_ctx.sys_env);
+    gc_mark_table(runtime_ctx.string_builder_key);
+    runtime_io_mark_roots();
+}
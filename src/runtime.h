@@ -5,5 +5,6 @@
 
 void runtime_init(int argc, char **argv, const char *module_dir);
 bool runtime_import(const char *path, Env *env, Value *out);
+void runtime_mark_roots(void);
 
 #endif
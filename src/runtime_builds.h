@@ -4,6 +4,7 @@
 #include "runtime_internal.h"
 
 Table *runtime_io_build(void);
+void runtime_io_mark_roots(void);
 Table *runtime_time_build(void);
 Table *runtime_sys_build(void);
 Table *runtime_log_build(void);
@@ -17,6 +17,7 @@ typedef struct {
     Table *mathlib;
     Table *sys_args;
     Table *sys_env;
+    Table *string_builder_key; /* private key under which builders keep their text */
 } RuntimeContext;
 
 extern RuntimeContext runtime_ctx;
@@ -57,12 +57,19 @@ static FileEntry *file_registry_find(Table *obj) {
     return NULL;
 }
 
+/* Registered file objects stay alive so lookups by pointer remain valid. */
+void runtime_io_mark_roots(void) {
+    for (size_t i = 0; i < file_count; i++) {
+        gc_mark_table(files[i].object);
+    }
+}
+
 static Value native_io_open(int argc, Value *argv, EvalResult *err) {
-    if (argc != 2 || argv[0].type != VAL_STRING || argv[1].type != VAL_STRING) {
+    if (argc != 2 || value_type(argv[0]) != VAL_STRING || value_type(argv[1]) != VAL_STRING) {
         runtime_set_error(err, "io.open expects (string, string)");
         return make_null();
     }
-    FILE *f = fopen(argv[0].as.str->data, argv[1].as.str->data);
+    FILE *f = fopen(as_string(argv[0])->data, as_string(argv[1])->data);
     if (!f) {
         runtime_set_error(err, strerror(errno));
         return make_null();
@@ -74,11 +81,11 @@ static Value native_io_open(int argc, Value *argv, EvalResult *err) {
 }
 
 static Value native_io_read(int argc, Value *argv, EvalResult *err) {
-    if (argc != 1 || argv[0].type != VAL_TABLE) {
+    if (argc != 1 || value_type(argv[0]) != VAL_TABLE) {
         runtime_set_error(err, "io.read expects (file)");
         return make_null();
     }
-    FileEntry *entry = file_registry_find(argv[0].as.table);
+    FileEntry *entry = file_registry_find(as_table(argv[0]));
     if (!entry || !entry->file) {
         runtime_set_error(err, "invalid file");
         return make_null();
@@ -111,23 +118,23 @@ static Value native_io_read(int argc, Value *argv, EvalResult *err) {
 }
 
 static Value native_io_write(int argc, Value *argv, EvalResult *err) {
-    if (argc != 2 || argv[0].type != VAL_TABLE || argv[1].type != VAL_STRING) {
+    if (argc != 2 || value_type(argv[0]) != VAL_TABLE || value_type(argv[1]) != VAL_STRING) {
         runtime_set_error(err, "io.write expects (file, string)");
         return make_null();
     }
-    FileEntry *entry = file_registry_find(argv[0].as.table);
+    FileEntry *entry = file_registry_find(as_table(argv[0]));
     if (!entry || !entry->file) {
         runtime_set_error(err, "invalid file");
         return make_null();
     }
 #ifdef __EMSCRIPTEN__
     if (entry->file == stdout || entry->file == stderr) {
-        protolex_write_js(argv[1].as.str->data, (int)argv[1].as.str->len, entry->file == stderr);
+        protolex_write_js(as_string(argv[1])->data, (int)as_string(argv[1])->len, entry->file == stderr);
         return make_null();
     }
 #endif
-    size_t written = fwrite(argv[1].as.str->data, 1, argv[1].as.str->len, entry->file);
-    if (written != argv[1].as.str->len) {
+    size_t written = fwrite(as_string(argv[1])->data, 1, as_string(argv[1])->len, entry->file);
+    if (written != as_string(argv[1])->len) {
         runtime_set_error(err, "io.write failed");
         return make_null();
     }
@@ -136,11 +143,11 @@ static Value native_io_write(int argc, Value *argv, EvalResult *err) {
 }
 
 static Value native_io_close(int argc, Value *argv, EvalResult *err) {
-    if (argc != 1 || argv[0].type != VAL_TABLE) {
+    if (argc != 1 || value_type(argv[0]) != VAL_TABLE) {
         runtime_set_error(err, "io.close expects (file)");
         return make_null();
     }
-    FileEntry *entry = file_registry_find(argv[0].as.table);
+    FileEntry *entry = file_registry_find(as_table(argv[0]));
     if (!entry || !entry->file) {
         runtime_set_error(err, "invalid file");
         return make_null();
@@ -162,37 +169,37 @@ Table *runtime_io_build(void) {
     Function *open_fn = xmalloc(sizeof(Function));
     open_fn->is_native = true;
     open_fn->native = native_io_open;
-    table_set(io, make_string_value("open", 4), make_function(open_fn));
+    table_set(io, make_interned_string("open", 4), make_function(open_fn));
 
     Function *read_fn = xmalloc(sizeof(Function));
     read_fn->is_native = true;
     read_fn->native = native_io_read;
-    table_set(io, make_string_value("read", 4), make_function(read_fn));
+    table_set(io, make_interned_string("read", 4), make_function(read_fn));
 
     Function *write_fn = xmalloc(sizeof(Function));
     write_fn->is_native = true;
     write_fn->native = native_io_write;
-    table_set(io, make_string_value("write", 5), make_function(write_fn));
+    table_set(io, make_interned_string("write", 5), make_function(write_fn));
 
     Function *close_fn = xmalloc(sizeof(Function));
     close_fn->is_native = true;
     close_fn->native = native_io_close;
-    table_set(io, make_string_value("close", 5), make_function(close_fn));
+    table_set(io, make_interned_string("close", 5), make_function(close_fn));
 
     Table *stdin_obj = table_new();
     table_freeze(stdin_obj);
     file_registry_add(stdin_obj, stdin, false);
-    table_set(io, make_string_value("stdin", 5), make_table(stdin_obj));
+    table_set(io, make_interned_string("stdin", 5), make_table(stdin_obj));
 
     Table *stdout_obj = table_new();
     table_freeze(stdout_obj);
     file_registry_add(stdout_obj, stdout, false);
-    table_set(io, make_string_value("stdout", 6), make_table(stdout_obj));
+    table_set(io, make_interned_string("stdout", 6), make_table(stdout_obj));
 
     Table *stderr_obj = table_new();
     table_freeze(stderr_obj);
     file_registry_add(stderr_obj, stderr, false);
-    table_set(io, make_string_value("stderr", 6), make_table(stderr_obj));
+    table_set(io, make_interned_string("stderr", 6), make_table(stderr_obj));
 
     table_freeze(io);
     runtime_ctx.io = io;
@@ -4,5 +4,6 @@
 #include "runtime_internal.h"
 
 Table *runtime_io_build(void);
+void runtime_io_mark_roots(void);
 
 #endif
@@ -38,17 +38,17 @@ Table *runtime_log_build(void) {
     Function *info_fn = xmalloc(sizeof(Function));
     info_fn->is_native = true;
     info_fn->native = native_log_info;
-    table_set(log, make_string_value("info", 4), make_function(info_fn));
+    table_set(log, make_interned_string("info", 4), make_function(info_fn));
 
     Function *warn_fn = xmalloc(sizeof(Function));
     warn_fn->is_native = true;
     warn_fn->native = native_log_warn;
-    table_set(log, make_string_value("warn", 4), make_function(warn_fn));
+    table_set(log, make_interned_string("warn", 4), make_function(warn_fn));
 
     Function *error_fn = xmalloc(sizeof(Function));
     error_fn->is_native = true;
     error_fn->native = native_log_error;
-    table_set(log, make_string_value("error", 5), make_function(error_fn));
+    table_set(log, make_interned_string("error", 5), make_function(error_fn));
 
     table_freeze(log);
     runtime_ctx.log = log;
@@ -5,56 +5,96 @@
 #include "runtime_string.h"
 
 static Table *make_list_nil(void) {
-    Table *nil = table_new();
-    table_set(nil, make_string_value("isNil", 5), make_bool(true));
+    Table *nil = table_new_sized(1);
+    table_set(nil, make_interned_string("isNil", 5), make_bool(true));
     table_freeze(nil);
     return nil;
 }
 
 static Table *make_list_cons(Value head, Table *tail) {
-    Table *node = table_new();
-    table_set(node, make_string_value("isNil", 5), make_bool(false));
-    table_set(node, make_string_value("head", 4), head);
-    table_set(node, make_string_value("tail", 4), make_table(tail));
+    Table *node = table_new_sized(3);
+    table_set(node, make_interned_string("isNil", 5), make_bool(false));
+    table_set(node, make_interned_string("head", 4), head);
+    table_set(node, make_interned_string("tail", 4), make_table(tail));
     table_freeze(node);
     return node;
 }
 
 static Value native_string_length(int argc, Value *argv, EvalResult *err) {
-    if (argc != 1 || argv[0].type != VAL_STRING) {
+    if (argc != 1 || value_type(argv[0]) != VAL_STRING) {
         runtime_set_error(err, "string.length expects (string)");
         return make_null();
     }
-    return make_int((int64_t)argv[0].as.str->len);
+    return make_int((int64_t)as_string(argv[0])->len);
 }
 
 static Value native_string_concat(int argc, Value *argv, EvalResult *err) {
-    if (argc != 2 || argv[0].type != VAL_STRING || argv[1].type != VAL_STRING) {
+    if (argc != 2 || value_type(argv[0]) != VAL_STRING || value_type(argv[1]) != VAL_STRING) {
         runtime_set_error(err, "string.concat expects (string, string)");
         return make_null();
     }
-    size_t len = argv[0].as.str->len + argv[1].as.str->len;
-    char *buf = xmalloc(len);
-    memcpy(buf, argv[0].as.str->data, argv[0].as.str->len);
-    memcpy(buf + argv[0].as.str->len, argv[1].as.str->data, argv[1].as.str->len);
-    Value out = make_string_value(buf, len);
-    free(buf);
-    return out;
+    return string_concat(argv[0], argv[1]);
+}
+
+/*
+ * A builder is a frozen table holding the string built so far under a
+ * private key that scripts cannot name, so no other table passes for one.
+ * Appending concatenates onto it, which is O(1) for long text.
+ */
+static Value builder_text_key(void) {
+    return make_table(runtime_ctx.string_builder_key);
+}
+
+static Value native_string_builder(int argc, Value *argv, EvalResult *err) {
+    (void)argv;
+    if (argc != 0) {
+        runtime_set_error(err, "string.builder expects ()");
+        return make_null();
+    }
+    Table *builder = table_new_sized(1);
+    table_put(builder, builder_text_key(), make_string_value("", 0));
+    table_freeze(builder);
+    return make_table(builder);
+}
+
+/* Own fields only: a clone of a builder inherits its text but is not one. */
+static bool is_builder(Value v) {
+    return value_type(v) == VAL_TABLE && as_table(v)->proto == NULL &&
+           value_type(table_get(as_table(v), builder_text_key())) == VAL_STRING;
+}
+
+static Value native_string_append(int argc, Value *argv, EvalResult *err) {
+    if (argc != 2 || !is_builder(argv[0]) || value_type(argv[1]) != VAL_STRING) {
+        runtime_set_error(err, "string.append expects (builder, string)");
+        return make_null();
+    }
+    Table *builder = as_table(argv[0]);
+    Value text = table_get(builder, builder_text_key());
+    table_put(builder, builder_text_key(), string_concat(text, argv[1]));
+    return argv[0];
+}
+
+static Value native_string_build(int argc, Value *argv, EvalResult *err) {
+    if (argc != 1 || !is_builder(argv[0])) {
+        runtime_set_error(err, "string.build expects (builder)");
+        return make_null();
+    }
+    return table_get(as_table(argv[0]), builder_text_key());
 }
 
 static Value native_string_slice(int argc, Value *argv, EvalResult *err) {
-    if (argc != 3 || argv[0].type != VAL_STRING ||
-        argv[1].type != VAL_INT || argv[2].type != VAL_INT) {
+    if (argc != 3 || value_type(argv[0]) != VAL_STRING ||
+        value_type(argv[1]) != VAL_INT || value_type(argv[2]) != VAL_INT) {
         runtime_set_error(err, "string.slice expects (string, int, int)");
         return make_null();
     }
-    int64_t start = argv[1].as.i;
-    int64_t end = argv[2].as.i;
+    int64_t start = as_int(argv[1]);
+    int64_t end = as_int(argv[2]);
     if (start < 0 || end < 0 || start > end) {
         runtime_set_error(err, "string.slice invalid range");
         return make_null();
     }
-    size_t len = argv[0].as.str->len;
+    size_t len = as_string(argv[0])->len;
     if ((size_t)start > len) {
         start = (int64_t)len;
     }
@@ -62,24 +102,24 @@ static Value native_string_slice(int argc, Value *argv, EvalResult *err) {
         end = (int64_t)len;
     }
     size_t out_len = (size_t)(end - start);
-    return make_string_value(argv[0].as.str->data + start, out_len);
+    return make_string_value(as_string(argv[0])->data + start, out_len);
 }
 
 static Value native_string_index_of(int argc, Value *argv, EvalResult *err) {
-    if (argc != 2 || argv[0].type != VAL_STRING || argv[1].type != VAL_STRING) {
+    if (argc != 2 || value_type(argv[0]) != VAL_STRING || value_type(argv[1]) != VAL_STRING) {
         runtime_set_error(err, "string.indexOf expects (string, string)");
         return make_null();
     }
-    if (argv[1].as.str->len == 0) {
+    if (as_string(argv[1])->len == 0) {
         return make_int(0);
     }
-    if (argv[1].as.str->len > argv[0].as.str->len) {
+    if (as_string(argv[1])->len > as_string(argv[0])->len) {
         return make_int(-1);
     }
-    const char *hay = argv[0].as.str->data;
-    const char *needle = argv[1].as.str->data;
-    size_t hlen = argv[0].as.str->len;
-    size_t nlen = argv[1].as.str->len;
+    const char *hay = as_string(argv[0])->data;
+    const char *needle = as_string(argv[1])->data;
+    size_t hlen = as_string(argv[0])->len;
+    size_t nlen = as_string(argv[1])->len;
     for (size_t i = 0; i + nlen <= hlen; i++) {
         if (memcmp(hay + i, needle, nlen) == 0) {
             return make_int((int64_t)i);
@@ -89,43 +129,43 @@ static Value native_string_index_of(int argc, Value *argv, EvalResult *err) {
 }
 
 static Value native_string_starts_with(int argc, Value *argv, EvalResult *err) {
-    if (argc != 2 || argv[0].type != VAL_STRING || argv[1].type != VAL_STRING) {
+    if (argc != 2 || value_type(argv[0]) != VAL_STRING || value_type(argv[1]) != VAL_STRING) {
         runtime_set_error(err, "string.startsWith expects (string, string)");
         return make_null();
     }
-    if (argv[1].as.str->len > argv[0].as.str->len) {
+    if (as_string(argv[1])->len > as_string(argv[0])->len) {
         return make_bool(false);
     }
-    return make_bool(memcmp(argv[0].as.str->data, argv[1].as.str->data,
-                            argv[1].as.str->len) == 0);
+    return make_bool(memcmp(as_string(argv[0])->data, as_string(argv[1])->data,
+                            as_string(argv[1])->len) == 0);
 }
 
 static Value native_string_ends_with(int argc, Value *argv, EvalResult *err) {
-    if (argc != 2 || argv[0].type != VAL_STRING || argv[1].type != VAL_STRING) {
+    if (argc != 2 || value_type(argv[0]) != VAL_STRING || value_type(argv[1]) != VAL_STRING) {
         runtime_set_error(err, "string.endsWith expects (string, string)");
         return make_null();
     }
-    if (argv[1].as.str->len > argv[0].as.str->len) {
+    if (as_string(argv[1])->len > as_string(argv[0])->len) {
         return make_bool(false);
     }
-    size_t offset = argv[0].as.str->len - argv[1].as.str->len;
-    return make_bool(memcmp(argv[0].as.str->data + offset, argv[1].as.str->data,
-                            argv[1].as.str->len) == 0);
+    size_t offset = as_string(argv[0])->len - as_string(argv[1])->len;
+    return make_bool(memcmp(as_string(argv[0])->data + offset, as_string(argv[1])->data,
+                            as_string(argv[1])->len) == 0);
 }
 
 static Value native_string_split(int argc, Value *argv, EvalResult *err) {
-    if (argc != 2 || argv[0].type != VAL_STRING || argv[1].type != VAL_STRING) {
+    if (argc != 2 || value_type(argv[0]) != VAL_STRING || value_type(argv[1]) != VAL_STRING) {
         runtime_set_error(err, "string.split expects (string, string)");
         return make_null();
     }
-    if (argv[1].as.str->len == 0) {
+    if (as_string(argv[1])->len == 0) {
         runtime_set_error(err, "string.split empty separator");
         return make_null();
     }
-    const char *s = argv[0].as.str->data;
-    size_t len = argv[0].as.str->len;
-    const char *sep = argv[1].as.str->data;
-    size_t sep_len = argv[1].as.str->len;
+    const char *s = as_string(argv[0])->data;
+    size_t len = as_string(argv[0])->len;
+    const char *sep = as_string(argv[1])->data;
+    size_t sep_len = as_string(argv[1])->len;
 
     Value *parts = NULL;
     size_t count = 0;
@@ -171,13 +211,13 @@ static Value native_string_split(int argc, Value *argv, EvalResult *err) {
 }
 
 static Value native_string_to_int(int argc, Value *argv, EvalResult *err) {
-    if (argc != 1 || argv[0].type != VAL_STRING) {
+    if (argc != 1 || value_type(argv[0]) != VAL_STRING) {
         runtime_set_error(err, "string.toInt expects (string)");
         return make_null();
     }
     char *end = NULL;
-    long long val = strtoll(argv[0].as.str->data, &end, 10);
-    if (!end || (size_t)(end - argv[0].as.str->data) != argv[0].as.str->len) {
+    long long val = strtoll(as_string(argv[0])->data, &end, 10);
+    if (!end || (size_t)(end - as_string(argv[0])->data) != as_string(argv[0])->len) {
         runtime_set_error(err, "string.toInt invalid");
         return make_null();
     }
@@ -185,13 +225,13 @@ static Value native_string_to_int(int argc, Value *argv, EvalResult *err) {
 }
 
 static Value native_string_to_float(int argc, Value *argv, EvalResult *err) {
-    if (argc != 1 || argv[0].type != VAL_STRING) {
+    if (argc != 1 || value_type(argv[0]) != VAL_STRING) {
         runtime_set_error(err, "string.toFloat expects (string)");
         return make_null();
     }
     char *end = NULL;
-    double val = strtod(argv[0].as.str->data, &end);
-    if (!end || (size_t)(end - argv[0].as.str->data) != argv[0].as.str->len) {
+    double val = strtod(as_string(argv[0])->data, &end);
+    if (!end || (size_t)(end - as_string(argv[0])->data) != as_string(argv[0])->len) {
         runtime_set_error(err, "string.toFloat invalid");
         return make_null();
     }
@@ -199,57 +239,57 @@ static Value native_string_to_float(int argc, Value *argv, EvalResult *err) {
 }
 
 static Value native_string_char_at(int argc, Value *argv, EvalResult *err) {
-    if (argc != 2 || argv[0].type != VAL_STRING || argv[1].type != VAL_INT) {
+    if (argc != 2 || value_type(argv[0]) != VAL_STRING || value_type(argv[1]) != VAL_INT) {
         runtime_set_error(err, "string.charAt expects (string, int)");
         return make_null();
     }
-    int64_t idx = argv[1].as.i;
-    if (idx < 0 || (size_t)idx >= argv[0].as.str->len) {
+    int64_t idx = as_int(argv[1]);
+    if (idx < 0 || (size_t)idx >= as_string(argv[0])->len) {
         runtime_set_error(err, "string.charAt out of bounds");
         return make_null();
     }
-    return make_string_value(argv[0].as.str->data + idx, 1);
+    return make_string_value(as_string(argv[0])->data + idx, 1);
 }
 
 static Value native_string_repeat(int argc, Value *argv, EvalResult *err) {
-    if (argc != 2 || argv[0].type != VAL_STRING || argv[1].type != VAL_INT) {
+    if (argc != 2 || value_type(argv[0]) != VAL_STRING || value_type(argv[1]) != VAL_INT) {
         runtime_set_error(err, "string.repeat expects (string, int)");
         return make_null();
     }
-    int64_t n = argv[1].as.i;
+    int64_t n = as_int(argv[1]);
     if (n < 0) {
         runtime_set_error(err, "string.repeat expects non-negative");
         return make_null();
     }
-    if (n == 0 || argv[0].as.str->len == 0) {
+    if (n == 0 || as_string(argv[0])->len == 0) {
         return make_string_value("", 0);
     }
-    size_t part_len = argv[0].as.str->len;
-    if (n > (int64_t)(SIZE_MAX / part_len)) {
+    size_t part_len = as_string(argv[0])->len;
+    if ((uint64_t)n > (SIZE_MAX - sizeof(String) - 1) / part_len) {
         runtime_set_error(err, "string.repeat overflow");
         return make_null();
     }
-    size_t total_len = part_len * (size_t)n;
-    char *buf = xmalloc(total_len);
+    String *out = string_try_new(part_len * (size_t)n, err);
+    if (!out) {
+        return make_null();
+    }
     size_t offset = 0;
     for (int64_t i = 0; i < n; i++) {
-        memcpy(buf + offset, argv[0].as.str->data, part_len);
+        memcpy(out->data + offset, as_string(argv[0])->data, part_len);
         offset += part_len;
     }
-    Value out = make_string_value(buf, total_len);
-    free(buf);
-    return out;
+    return string_seal(out);
 }
 
 static Value native_string_for_each(int argc, Value *argv, EvalResult *err) {
-    if (argc != 2 || argv[0].type != VAL_STRING || argv[1].type != VAL_FUNCTION) {
+    if (argc != 2 || value_type(argv[0]) != VAL_STRING || value_type(argv[1]) != VAL_FUNCTION) {
         runtime_set_error(err, "string.forEach expects (string, function)");
         return make_null();
     }
     Value str = argv[0];
     Value fn = argv[1];
-    for (size_t i = 0; i < str.as.str->len; i++) {
-        Value ch = make_string_value(str.as.str->data + i, 1);
+    for (size_t i = 0; i < as_string(str)->len; i++) {
+        Value ch = make_string_value(as_string(str)->data + i, 1);
         Value args[2];
         args[0] = ch;
         args[1] = make_int((int64_t)i);
@@ -283,12 +323,12 @@ static void buffer_append(char **buf, size_t *len, size_t *cap, const char *data
 }
 
 static Value native_string_format(int argc, Value *argv, EvalResult *err) {
-    if (argc < 1 || argv[0].type != VAL_STRING) {
+    if (argc < 1 || value_type(argv[0]) != VAL_STRING) {
         runtime_set_error(err, "string.format expects (string, ...)");
         return make_null();
     }
-    const char *fmt = argv[0].as.str->data;
-    size_t fmt_len = argv[0].as.str->len;
+    const char *fmt = as_string(argv[0])->data;
+    size_t fmt_len = as_string(argv[0])->len;
     size_t argi = 1;
     char *out = NULL;
     size_t out_len = 0;
@@ -356,37 +396,37 @@ static Value native_string_format(int argc, Value *argv, EvalResult *err) {
         switch (conv) {
         case 'd':
         case 'i':
-            if (v.type != VAL_INT) {
+            if (value_type(v) != VAL_INT) {
                 runtime_set_error(err, "string.format expected int");
                 free(out);
                 return make_null();
             }
-            needed = snprintf(NULL, 0, spec, (long long)v.as.i);
+            needed = snprintf(NULL, 0, spec, (long long)as_int(v));
             tmp = xmalloc((size_t)needed + 1);
-            snprintf(tmp, (size_t)needed + 1, spec, (long long)v.as.i);
+            snprintf(tmp, (size_t)needed + 1, spec, (long long)as_int(v));
             break;
         case 'u':
         case 'x':
         case 'X':
         case 'o':
-            if (v.type != VAL_INT) {
+            if (value_type(v) != VAL_INT) {
                 runtime_set_error(err, "string.format expected int");
                 free(out);
                 return make_null();
             }
-            needed = snprintf(NULL, 0, spec, (unsigned long long)v.as.i);
+            needed = snprintf(NULL, 0, spec, (unsigned long long)as_int(v));
             tmp = xmalloc((size_t)needed + 1);
-            snprintf(tmp, (size_t)needed + 1, spec, (unsigned long long)v.as.i);
+            snprintf(tmp, (size_t)needed + 1, spec, (unsigned long long)as_int(v));
             break;
         case 'c':
-            if (v.type != VAL_INT) {
+            if (value_type(v) != VAL_INT) {
                 runtime_set_error(err, "string.format expected int");
                 free(out);
                 return make_null();
             }
-            needed = snprintf(NULL, 0, spec, (int)v.as.i);
+            needed = snprintf(NULL, 0, spec, (int)as_int(v));
             tmp = xmalloc((size_t)needed + 1);
-            snprintf(tmp, (size_t)needed + 1, spec, (int)v.as.i);
+            snprintf(tmp, (size_t)needed + 1, spec, (int)as_int(v));
             break;
         case 'f':
         case 'F':
@@ -394,24 +434,24 @@ static Value native_string_format(int argc, Value *argv, EvalResult *err) {
         case 'E':
         case 'g':
         case 'G':
-            if (v.type != VAL_FLOAT) {
+            if (value_type(v) != VAL_FLOAT) {
                 runtime_set_error(err, "string.format expected float");
                 free(out);
                 return make_null();
             }
-            needed = snprintf(NULL, 0, spec, v.as.f);
+            needed = snprintf(NULL, 0, spec, as_float(v));
             tmp = xmalloc((size_t)needed + 1);
-            snprintf(tmp, (size_t)needed + 1, spec, v.as.f);
+            snprintf(tmp, (size_t)needed + 1, spec, as_float(v));
             break;
         case 's':
-            if (v.type != VAL_STRING) {
+            if (value_type(v) != VAL_STRING) {
                 runtime_set_error(err, "string.format expected string");
                 free(out);
                 return make_null();
             }
-            needed = snprintf(NULL, 0, spec, v.as.str->data);
+            needed = snprintf(NULL, 0, spec, as_string(v)->data);
             tmp = xmalloc((size_t)needed + 1);
-            snprintf(tmp, (size_t)needed + 1, spec, v.as.str->data);
+            snprintf(tmp, (size_t)needed + 1, spec, as_string(v)->data);
             break;
         default:
             runtime_set_error(err, "string.format unsupported spec");
@@ -432,72 +472,89 @@ Table *runtime_string_build(void) {
     if (runtime_ctx.string) {
         return runtime_ctx.string;
     }
+    runtime_ctx.string_builder_key = table_new_sized(0);
+    table_freeze(runtime_ctx.string_builder_key);
     Table *string = table_new();
 
     Function *len_fn = xmalloc(sizeof(Function));
     len_fn->is_native = true;
     len_fn->native = native_string_length;
-    table_set(string, make_string_value("length", 6), make_function(len_fn));
+    table_set(string, make_interned_string("length", 6), make_function(len_fn));
 
     Function *concat_fn = xmalloc(sizeof(Function));
     concat_fn->is_native = true;
     concat_fn->native = native_string_concat;
-    table_set(string, make_string_value("concat", 6), make_function(concat_fn));
+    table_set(string, make_interned_string("concat", 6), make_function(concat_fn));
 
     Function *slice_fn = xmalloc(sizeof(Function));
     slice_fn->is_native = true;
     slice_fn->native = native_string_slice;
-    table_set(string, make_string_value("slice", 5), make_function(slice_fn));
+    table_set(string, make_interned_string("slice", 5), make_function(slice_fn));
 
     Function *split_fn = xmalloc(sizeof(Function));
     split_fn->is_native = true;
     split_fn->native = native_string_split;
-    table_set(string, make_string_value("split", 5), make_function(split_fn));
+    table_set(string, make_interned_string("split", 5), make_function(split_fn));
 
     Function *index_fn = xmalloc(sizeof(Function));
     index_fn->is_native = true;
     index_fn->native = native_string_index_of;
-    table_set(string, make_string_value("indexOf", 7), make_function(index_fn));
+    table_set(string, make_interned_string("indexOf", 7), make_function(index_fn));
 
     Function *starts_fn = xmalloc(sizeof(Function));
     starts_fn->is_native = true;
     starts_fn->native = native_string_starts_with;
-    table_set(string, make_string_value("startsWith", 10), make_function(starts_fn));
+    table_set(string, make_interned_string("startsWith", 10), make_function(starts_fn));
 
     Function *ends_fn = xmalloc(sizeof(Function));
     ends_fn->is_native = true;
     ends_fn->native = native_string_ends_with;
-    table_set(string, make_string_value("endsWith", 8), make_function(ends_fn));
+    table_set(string, make_interned_string("endsWith", 8), make_function(ends_fn));
 
     Function *to_int_fn = xmalloc(sizeof(Function));
     to_int_fn->is_native = true;
     to_int_fn->native = native_string_to_int;
-    table_set(string, make_string_value("toInt", 5), make_function(to_int_fn));
+    table_set(string, make_interned_string("toInt", 5), make_function(to_int_fn));
 
     Function *to_float_fn = xmalloc(sizeof(Function));
     to_float_fn->is_native = true;
     to_float_fn->native = native_string_to_float;
-    table_set(string, make_string_value("toFloat", 7), make_function(to_float_fn));
+    table_set(string, make_interned_string("toFloat", 7), make_function(to_float_fn));
 
     Function *char_at_fn = xmalloc(sizeof(Function));
     char_at_fn->is_native = true;
     char_at_fn->native = native_string_char_at;
-    table_set(string, make_string_value("charAt", 6), make_function(char_at_fn));
+    table_set(string, make_interned_string("charAt", 6), make_function(char_at_fn));
 
     Function *repeat_fn = xmalloc(sizeof(Function));
     repeat_fn->is_native = true;
     repeat_fn->native = native_string_repeat;
-    table_set(string, make_string_value("repeat", 6), make_function(repeat_fn));
+    table_set(string, make_interned_string("repeat", 6), make_function(repeat_fn));
 
     Function *for_each_fn = xmalloc(sizeof(Function));
     for_each_fn->is_native = true;
     for_each_fn->native = native_string_for_each;
-    table_set(string, make_string_value("forEach", 7), make_function(for_each_fn));
+    table_set(string, make_interned_string("forEach", 7), make_function(for_each_fn));
 
     Function *format_fn = xmalloc(sizeof(Function));
     format_fn->is_native = true;
     format_fn->native = native_string_format;
-    table_set(string, make_string_value("format", 6), make_function(format_fn));
+    table_set(string, make_interned_string("format", 6), make_function(format_fn));
+
+    Function *builder_fn = xmalloc(sizeof(Function));
+    builder_fn->is_native = true;
+    builder_fn->native = native_string_builder;
+    table_set(string, make_interned_string("builder", 7), make_function(builder_fn));
+
+    Function *append_fn = xmalloc(sizeof(Function));
+    append_fn->is_native = true;
+    append_fn->native = native_string_append;
+    table_set(string, make_interned_string("append", 6), make_function(append_fn));
+
+    Function *build_fn = xmalloc(sizeof(Function));
+    build_fn->is_native = true;
+    build_fn->native = native_string_build;
+    table_set(string, make_interned_string("build", 5), make_function(build_fn));
 
     table_freeze(string);
     runtime_ctx.string = string;
@@ -36,32 +36,74 @@ static Value native_sys_platform(int argc, Value *argv, EvalResult *err) {
 }
 
 static Value native_sys_exit(int argc, Value *argv, EvalResult *err) {
-    if (argc != 1 || argv[0].type != VAL_INT) {
+    if (argc != 1 || value_type(argv[0]) != VAL_INT) {
         runtime_set_error(err, "sys.exit expects (int)");
         return make_null();
     }
-    exit((int)argv[0].as.i);
+    exit((int)as_int(argv[0]));
+}
+
+static Value native_sys_gc_stats(int argc, Value *argv, EvalResult *err) {
+    (void)argv;
+    if (argc != 0) {
+        runtime_set_error(err, "sys.gcStats expects ()");
+        return make_null();
+    }
+    GcStats st;
+    gc_get_stats(&st);
+    Table *t = table_new_sized(7);
+    table_set(t, make_interned_string("bytes", 5), make_int((int64_t)st.bytes));
+    table_set(t, make_interned_string("minor", 5), make_int((int64_t)st.minor_collections));
+    table_set(t, make_interned_string("major", 5), make_int((int64_t)st.major_collections));
+    table_set(t, make_interned_string("slices", 6), make_int((int64_t)st.slices));
+    table_set(t, make_interned_string("lastSliceUs", 11), make_float(st.last_slice_us));
+    table_set(t, make_interned_string("maxSliceUs", 10), make_float(st.max_slice_us));
+    table_set(t, make_interned_string("pauseBudgetUs", 13), make_int(st.pause_budget_us));
+    table_freeze(t);
+    return make_table(t);
+}
+
+static Value native_sys_memory(int argc, Value *argv, EvalResult *err) {
+    (void)argv;
+    if (argc != 0) {
+        runtime_set_error(err, "sys.memory expects ()");
+        return make_null();
+    }
+    HeapUsage use;
+    heap_get_usage(&use);
+    Table *t = table_new_sized(9);
+    table_set(t, make_interned_string("bytes", 5), make_int((int64_t)use.bytes));
+    table_set(t, make_interned_string("peak", 4), make_int((int64_t)use.peak));
+    table_set(t, make_interned_string("limit", 5), make_int((int64_t)use.limit));
+    table_set(t, make_interned_string("tables", 6), make_int((int64_t)use.tables));
+    table_set(t, make_interned_string("entries", 7), make_int((int64_t)use.entries));
+    table_set(t, make_interned_string("strings", 7), make_int((int64_t)use.strings));
+    table_set(t, make_interned_string("envs", 4), make_int((int64_t)use.envs));
+    table_set(t, make_interned_string("functions", 9), make_int((int64_t)use.functions));
+    table_set(t, make_interned_string("bigints", 7), make_int((int64_t)use.bigints));
+    table_freeze(t);
+    return make_table(t);
 }
 
 static Table *build_sys_args(void) {
     if (runtime_ctx.sys_args) {
         return runtime_ctx.sys_args;
     }
-    Table *nil = table_new();
-    table_set(nil, make_string_value("isNil", 5), make_bool(true));
+    Table *nil = table_new_sized(1);
+    table_set(nil, make_interned_string("isNil", 5), make_bool(true));
     table_freeze(nil);
 
     Value list = make_table(nil);
     for (int i = runtime_ctx.argc - 1; i >= 1; i--) {
-        Table *node = table_new();
-        table_set(node, make_string_value("isNil", 5), make_bool(false));
-        table_set(node, make_string_value("head", 4),
+        Table *node = table_new_sized(3);
+        table_set(node, make_interned_string("isNil", 5), make_bool(false));
+        table_set(node, make_interned_string("head", 4),
                   make_string_value(runtime_ctx.argv[i], strlen(runtime_ctx.argv[i])));
-        table_set(node, make_string_value("tail", 4), list);
+        table_set(node, make_interned_string("tail", 4), list);
         table_freeze(node);
         list = make_table(node);
     }
-    runtime_ctx.sys_args = list.as.table;
+    runtime_ctx.sys_args = as_table(list);
     return runtime_ctx.sys_args;
 }
 
@@ -78,7 +120,7 @@ static Table *build_sys_env(void) {
             continue;
         }
         size_t klen = (size_t)(eq - *p);
-        Value key = make_string_value(*p, klen);
+        Value key = make_interned_string(*p, klen);
         Value val = make_string_value(eq + 1, strlen(eq + 1));
         table_set(env, key, val);
     }
@@ -93,23 +135,33 @@ Table *runtime_sys_build(void) {
         return runtime_ctx.sys;
     }
     Table *sys = table_new();
-    table_set(sys, make_string_value("args", 4), make_table(build_sys_args()));
-    table_set(sys, make_string_value("env", 3), make_table(build_sys_env()));
+    table_set(sys, make_interned_string("args", 4), make_table(build_sys_args()));
+    table_set(sys, make_interned_string("env", 3), make_table(build_sys_env()));
 
     Function *cwd_fn = xmalloc(sizeof(Function));
     cwd_fn->is_native = true;
     cwd_fn->native = native_sys_cwd;
-    table_set(sys, make_string_value("cwd", 3), make_function(cwd_fn));
+    table_set(sys, make_interned_string("cwd", 3), make_function(cwd_fn));
 
     Function *platform_fn = xmalloc(sizeof(Function));
     platform_fn->is_native = true;
     platform_fn->native = native_sys_platform;
-    table_set(sys, make_string_value("platform", 8), make_function(platform_fn));
+    table_set(sys, make_interned_string("platform", 8), make_function(platform_fn));
 
     Function *exit_fn = xmalloc(sizeof(Function));
     exit_fn->is_native = true;
     exit_fn->native = native_sys_exit;
-    table_set(sys, make_string_value("exit", 4), make_function(exit_fn));
+    table_set(sys, make_interned_string("exit", 4), make_function(exit_fn));
+
+    Function *gc_stats_fn = xmalloc(sizeof(Function));
+    gc_stats_fn->is_native = true;
+    gc_stats_fn->native = native_sys_gc_stats;
+    table_set(sys, make_interned_string("gcStats", 7), make_function(gc_stats_fn));
+
+    Function *memory_fn = xmalloc(sizeof(Function));
+    memory_fn->is_native = true;
+    memory_fn->native = native_sys_memory;
+    table_set(sys, make_interned_string("memory", 6), make_function(memory_fn));
 
     table_freeze(sys);
     runtime_ctx.sys = sys;
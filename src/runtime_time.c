@@ -37,11 +37,11 @@ static Value native_time_monotonic(int argc, Value *argv, EvalResult *err) {
 }
 
 static Value native_time_sleep(int argc, Value *argv, EvalResult *err) {
-    if (argc != 1 || argv[0].type != VAL_INT) {
+    if (argc != 1 || value_type(argv[0]) != VAL_INT) {
         runtime_set_error(err, "time.sleep expects (int)");
         return make_null();
     }
-    int64_t ms = argv[0].as.i;
+    int64_t ms = as_int(argv[0]);
     if (ms < 0) {
         runtime_set_error(err, "time.sleep expects non-negative");
         return make_null();
@@ -61,17 +61,17 @@ Table *runtime_time_build(void) {
     Function *now_fn = xmalloc(sizeof(Function));
     now_fn->is_native = true;
     now_fn->native = native_time_now;
-    table_set(time, make_string_value("now", 3), make_function(now_fn));
+    table_set(time, make_interned_string("now", 3), make_function(now_fn));
 
     Function *mono_fn = xmalloc(sizeof(Function));
     mono_fn->is_native = true;
     mono_fn->native = native_time_monotonic;
-    table_set(time, make_string_value("monotonic", 9), make_function(mono_fn));
+    table_set(time, make_interned_string("monotonic", 9), make_function(mono_fn));
 
     Function *sleep_fn = xmalloc(sizeof(Function));
     sleep_fn->is_native = true;
     sleep_fn->native = native_time_sleep;
-    table_set(time, make_string_value("sleep", 5), make_function(sleep_fn));
+    table_set(time, make_interned_string("sleep", 5), make_function(sleep_fn));
 
     table_freeze(time);
     runtime_ctx.time = time;
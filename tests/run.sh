@@ -17,6 +17,40 @@ run_test "lang_proto" "$ROOT/tests/lang_proto.plx"
 run_test "lang_literals" "$ROOT/tests/lang_literals.plx"
 run_test "lang_mutate" "$ROOT/tests/lang_mutate.plx"
 run_test "lang_try" "$ROOT/tests/lang_try.plx"
+run_test "lang_tail_calls" "$ROOT/tests/lang_tail_calls.plx"
+run_test "lang_scope" "$ROOT/tests/lang_scope.plx"
+run_test "lang_modules" "$ROOT/tests/lang_modules.plx"
+run_test "lang_modules (cached)" "$ROOT/tests/lang_modules.plx"
+run_test "lang_modules (--no-cache)" --no-cache "$ROOT/tests/lang_modules.plx"
+
+# Cache files next to very long paths must never clobber the script itself.
+long_path_test() {
+  printf "test: %s\n" "lang_modules (long path)"
+  dir=$(mktemp -d)
+  long="$dir"
+  while [ ${#long} -lt 900 ]; do
+    long="$long/dddddddddddddddddddddddddddddddddddddddddddddddddd"
+  done
+  mkdir -p "$long"
+  # Pad the file name so the whole path is exactly 1099 bytes.
+  pad=$((1099 - ${#long} - 5))
+  name=$(printf "%${pad}s" "" | tr " " "s")
+  script="$long/$name.plx"
+  cp "$ROOT/tests/lang_basics.plx" "$script"
+  "$BIN" "$script"
+  "$BIN" "$script"
+  cmp -s "$ROOT/tests/lang_basics.plx" "$script"
+  rm -rf "$dir"
+}
+long_path_test
+run_test "lang_jit" "$ROOT/tests/lang_jit.plx"
+run_test "lang_gc" "$ROOT/tests/lang_gc.plx"
+run_test "lang_jit (--jit)" --jit "$ROOT/tests/lang_jit.plx"
+run_test "lang_gc (--gc-pause-us)" --gc-pause-us 50 "$ROOT/tests/lang_gc.plx"
+run_test "lang_heap" --max-heap 4M "$ROOT/tests/lang_heap.plx"
+# Keys built at run time must be collectable, so the churn fits in 32 MB.
+printf "test: %s\n" "lang_keys"
+(ulimit -v 32768 && "$BIN" "$ROOT/tests/lang_keys.plx")
 
 run_test "lib_io" "$ROOT/tests/lib_io.plx"
 run_test "lib_time" "$ROOT/tests/lib_time.plx"